@@ -10,9 +10,13 @@
  * @author Emile-Hugo Spir
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
 #include "crypto_cli.h"
 #include "crypto_utils.h"
 
@@ -25,7 +29,9 @@ void printCryptoHelp()
 	 --verifyFile fileToVerify publicKeyFile\n\
 	 --signString hexEncodedstringToSign privateKeyFile\n\
 	 --verifyString stringToVerify hexEncodedSignature publicKeyFile\n\
-	 --verifyStringHex hexEncodedStringToVerify hexEncodedSignature publicKeyFile\n");
+	 --verifyStringHex hexEncodedStringToVerify hexEncodedSignature publicKeyFile\n\
+	 --hash file [file...]\n\
+	 --signDaemon [socketPath]\n");
 }
 
 bool processCrypto(int argc, char const *argv[])
@@ -76,6 +82,48 @@ bool processCrypto(int argc, char const *argv[])
 	{
 		verifyString((const unsigned char *) argv[2], strlen(argv[2]), argv[3], true, argv[4]);
 	}
+	else if(!strcmp(argv[1], "--hash") && argc >= 3)
+	{
+		const size_t numberFiles = (size_t) argc - 2;
+		uint8_t * hashes = malloc(numberFiles * HASH_LENGTH);
+		bool * success = malloc(numberFiles * sizeof(bool));
+
+		if(hashes == NULL || success == NULL)
+		{
+			puts("Memory error");
+			free(hashes);
+			free(success);
+			return true;
+		}
+
+		long numberThreads = sysconf(_SC_NPROCESSORS_ONLN);
+		HashThroughput throughput;
+
+		hashFiles(&argv[2], numberFiles, 0, hashes, success, numberThreads > 0 ? (size_t) numberThreads : 1, &throughput);
+
+		for(size_t i = 0; i < numberFiles; ++i)
+		{
+			if(success[i])
+			{
+				char hashHex[HASH_LENGTH * 2 + 1];
+				hydro_bin2hex(hashHex, sizeof(hashHex), &hashes[i * HASH_LENGTH], HASH_LENGTH);
+				printf("%s  %s\n", hashHex, argv[i + 2]);
+			}
+			else
+				printf("Couldn't hash %s\n", argv[i + 2]);
+		}
+
+		const double seconds = (double) throughput.elapsedNanoseconds / 1e9;
+		fprintf(stderr, "Hashed %llu bytes in %.3f s (%.1f MiB/s)\n", (unsigned long long) throughput.bytesHashed, seconds,
+				seconds > 0 ? (double) throughput.bytesHashed / (1024 * 1024) / seconds : 0);
+
+		free(hashes);
+		free(success);
+	}
+	else if(!strcmp(argv[1], "--signDaemon") && argc <= 3)
+	{
+		runSignDaemon(argc == 3 ? argv[2] : NULL);
+	}
 	else
 		return false;
 
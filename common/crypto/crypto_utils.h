@@ -12,6 +12,9 @@
  * @author Emile-Hugo Spir
  */
 
+#ifndef RAVENS_CRYPTO_UTILS_H
+#define RAVENS_CRYPTO_UTILS_H
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -58,11 +61,24 @@ void hashBlock(const uint8_t * data, size_t length, uint16_t counter, bool reuse
 void hashMemory(const uint8_t * data, const size_t length, uint8_t * hashBuffer);
 bool hashFile(const char * filename, uint8_t * hashBuffer, size_t skip);
 
+typedef struct
+{
+	uint64_t bytesHashed;
+	uint64_t elapsedNanoseconds;	//Wall clock time of the whole batch
+} HashThroughput;
+
+//Hash numberFiles files on up to numberThreads threads. hashBuffers receives HASH_LENGTH bytes per file, success whether each file could be hashed
+bool hashFiles(const char * const * filenames, size_t numberFiles, size_t skip, uint8_t * hashBuffers, bool * success, size_t numberThreads, HashThroughput * throughput);
+
+//Serve signing requests on a UNIX socket, or on stdin/stdout if socketPath is NULL (see signDaemon.c)
+bool runSignDaemon(const char * socketPath);
+
 // High level testing functions
 
 bool generateKeys(const char * privKeyFile, const char * pubKeyFile);
 bool testSignature(const uint8_t * message, bool wantFail, const char * privKeyFile, const char * pubKeyFile);
 bool testCrypto();
+bool testSignDaemon(const char * privKeyFile, const char * pubKeyFile);
 bool signFile(const char *inputFile, const char *outputFile, const char *privKeyFile);
 bool signString(const char * inputString, const char * privKeyFile, uint8_t * signature);
 bool verifyFile(const char *inputFile, const char * pubKeyFile);
@@ -71,3 +87,5 @@ bool verifyString(const uint8_t *inputString, size_t stringLength, const char *s
 #ifdef __cplusplus
 }
 #endif
+
+#endif //RAVENS_CRYPTO_UTILS_H
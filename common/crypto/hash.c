@@ -11,6 +11,11 @@
  * @author Emile-Hugo Spir
  */
 
+#ifndef TARGET_LIKE_MBED
+//Needed for mmap, posix_fadvise and clock_gettime as the library is built as strict C11
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "sha256.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -20,6 +25,13 @@
 #include "../core.h"
 #else
 #define RAVENS_CRITICAL
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 void hashBlock(const uint8_t * data, const size_t length, const uint16_t counter, bool reuseHash, uint8_t * hashBuffer)
@@ -47,6 +59,210 @@ RAVENS_CRITICAL void hashMemory(const uint8_t * data, const size_t length, uint8
 }
 
 
+#ifndef TARGET_LIKE_MBED
+
+//Used when the file can't be mapped (pipes, special files...)
+#define HASH_READ_BUFFER_SIZE (1u << 20u)
+
+static bool hashFileDescriptor(int fd, size_t skip, uint8_t * hashBuffer, uint64_t * bytesHashed)
+{
+	mbedtls_sha256_context ctx;
+	mbedtls_sha256_init( &ctx );
+	mbedtls_sha256_starts_ret( &ctx, 0 );
+
+	bool success = true;
+	struct stat st;
+
+	//Map regular files, so that the data goes straight from the page cache to SHA-256
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	{
+		const size_t fileSize = (size_t) st.st_size;
+
+		if(fileSize > skip)
+		{
+			void * mapping = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if(mapping != MAP_FAILED)
+			{
+				posix_madvise(mapping, fileSize, POSIX_MADV_SEQUENTIAL);
+
+				mbedtls_sha256_update_ret( &ctx, (const uint8_t *) mapping + skip, fileSize - skip);
+				*bytesHashed += fileSize - skip;
+
+				munmap(mapping, fileSize);
+				goto finish;
+			}
+		}
+		else
+			goto finish;
+	}
+
+	//Couldn't map the file, we read it in large chunks instead
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	uint8_t * buffer = malloc(HASH_READ_BUFFER_SIZE);
+	if(buffer == NULL)
+	{
+		success = false;
+		goto finish;
+	}
+
+	//Skip by reading as the descriptor may not be seekable
+	while(success)
+	{
+		const ssize_t lengthRead = read(fd, buffer, HASH_READ_BUFFER_SIZE);
+
+		if(lengthRead <= 0)
+		{
+			success = lengthRead == 0;
+			break;
+		}
+
+		size_t length = (size_t) lengthRead, offset = 0;
+
+		if(skip)
+		{
+			offset = skip < length ? skip : length;
+			skip -= offset;
+		}
+
+		mbedtls_sha256_update_ret( &ctx, buffer + offset, length - offset);
+		*bytesHashed += length - offset;
+	}
+
+	free(buffer);
+
+finish:
+	mbedtls_sha256_finish_ret( &ctx, hashBuffer );
+	mbedtls_sha256_free( &ctx );
+
+	return success;
+}
+
+bool hashFile(const char * filename, uint8_t * hashBuffer, size_t skip)
+{
+	const int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	uint64_t ignore = 0;
+	const bool success = hashFileDescriptor(fd, skip, hashBuffer, &ignore);
+
+	close(fd);
+	return success;
+}
+
+typedef struct
+{
+	const char * const * filenames;
+	size_t numberFiles;
+	size_t skip;
+	uint8_t * hashBuffers;
+	bool * success;
+
+	pthread_mutex_t lock;
+	size_t nextFile;
+	uint64_t bytesHashed;
+} HashFilesJob;
+
+static void * hashFilesWorker(void * context)
+{
+	HashFilesJob * job = context;
+	uint64_t bytesHashed = 0;
+
+	while(true)
+	{
+		pthread_mutex_lock(&job->lock);
+		const size_t index = job->nextFile++;
+		pthread_mutex_unlock(&job->lock);
+
+		if(index >= job->numberFiles)
+			break;
+
+		const int fd = open(job->filenames[index], O_RDONLY);
+
+		job->success[index] = fd >= 0 && hashFileDescriptor(fd, job->skip, &job->hashBuffers[index * HASH_LENGTH], &bytesHashed);
+
+		if(fd >= 0)
+			close(fd);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->bytesHashed += bytesHashed;
+	pthread_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+static uint64_t monotonicNanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+bool hashFiles(const char * const * filenames, size_t numberFiles, size_t skip, uint8_t * hashBuffers, bool * success, size_t numberThreads, HashThroughput * throughput)
+{
+	if((filenames == NULL || hashBuffers == NULL || success == NULL) && numberFiles != 0)
+		return false;
+
+	HashFilesJob job = {
+		.filenames = filenames,
+		.numberFiles = numberFiles,
+		.skip = skip,
+		.hashBuffers = hashBuffers,
+		.success = success,
+
+		.nextFile = 0,
+		.bytesHashed = 0
+	};
+
+	if(pthread_mutex_init(&job.lock, NULL) != 0)
+		return false;
+
+	const uint64_t start = monotonicNanoseconds();
+
+	if(numberThreads > numberFiles)
+		numberThreads = numberFiles;
+
+	//The calling thread is one of the workers
+	pthread_t * threads = NULL;
+	size_t numberStarted = 0;
+
+	if(numberThreads > 1)
+	{
+		threads = malloc((numberThreads - 1) * sizeof(pthread_t));
+
+		for(; threads != NULL && numberStarted < numberThreads - 1; ++numberStarted)
+		{
+			if(pthread_create(&threads[numberStarted], NULL, hashFilesWorker, &job) != 0)
+				break;
+		}
+	}
+
+	hashFilesWorker(&job);
+
+	for(size_t i = 0; i < numberStarted; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+
+	if(throughput != NULL)
+	{
+		throughput->bytesHashed = job.bytesHashed;
+		throughput->elapsedNanoseconds = monotonicNanoseconds() - start;
+	}
+
+	bool output = true;
+	for(size_t i = 0; i < numberFiles; ++i)
+		output &= success[i];
+
+	return output;
+}
+
+#else
+
 bool hashFile(const char * filename, uint8_t * hashBuffer, size_t skip)
 {
 	FILE * file = fopen(filename, "rb");
@@ -78,3 +294,5 @@ bool hashFile(const char * filename, uint8_t * hashBuffer, size_t skip)
 	fclose(file);
 	return true;
 }
+
+#endif
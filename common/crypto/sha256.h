@@ -153,6 +153,19 @@ int mbedtls_sha256_ret( const unsigned char *input,
  */
 int mbedtls_sha256_self_test( int verbose );
 
+/*
+ * Hardware accelerated compression, only built for x86 hosts (i.e. Hugin).
+ * The portable code is used whenever the CPU lacks the SHA extensions.
+ */
+#if !defined(TARGET_LIKE_MBED) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_ACCELERATED
+
+#include <stdbool.h>
+
+bool sha256AccelerationAvailable(void);
+void sha256ProcessBlocksAccelerated(uint32_t state[8], const unsigned char * data, size_t blocks);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -147,6 +147,14 @@ int mbedtls_internal_sha256_process( mbedtls_sha256_context *ctx,
     uint32_t A[8];
     unsigned int i;
 
+#if defined(SHA256_ACCELERATED)
+    if( sha256AccelerationAvailable() )
+    {
+        sha256ProcessBlocksAccelerated( ctx->state, data, 1 );
+        return( 0 );
+    }
+#endif
+
     for( i = 0; i < 8; i++ )
         A[i] = ctx->state[i];
 
@@ -233,6 +241,17 @@ int mbedtls_sha256_update_ret( mbedtls_sha256_context *ctx,
         left = 0;
     }
 
+#if defined(SHA256_ACCELERATED)
+    if( ilen >= 64 && sha256AccelerationAvailable() )
+    {
+        size_t blocks = ilen / 64;
+        sha256ProcessBlocksAccelerated( ctx->state, input, blocks );
+
+        input += blocks * 64;
+        ilen  -= blocks * 64;
+    }
+#endif
+
     while( ilen >= 64 )
     {
         if( ( ret = mbedtls_internal_sha256_process( ctx, input ) ) != 0 )
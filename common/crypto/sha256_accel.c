@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * Purpose: SHA-256 compression using the x86 SHA extensions, picked at runtime by sha256.min.c
+ * @author Emile-Hugo Spir
+ */
+
+#include "sha256.h"
+
+#ifdef SHA256_ACCELERATED
+
+#include <stdbool.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+static const uint32_t K[64] =
+{
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+	0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+	0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+	0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+	0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+	0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+	0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+	0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+	0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+//Probed once before main so that hashing threads only ever read it
+static bool accelerationAvailable = false;
+
+__attribute__((constructor)) static void probeAcceleration(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	//SSSE3 and SSE4.1 are needed for the shuffles surrounding the SHA instructions
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_SSSE3) == 0 || (ecx & bit_SSE4_1) == 0)
+		return;
+
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return;
+
+	accelerationAvailable = (ebx & (1u << 29u)) != 0;
+}
+
+bool sha256AccelerationAvailable(void)
+{
+	return accelerationAvailable;
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256ProcessBlocksAccelerated(uint32_t state[8], const unsigned char * data, size_t blocks)
+{
+	const __m128i byteSwapMask = _mm_set_epi64x(0x0c0d0e0f08090a0bll, 0x0405060700010203ll);
+
+	//The SHA instructions expect the state as ABEF/CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while(blocks--)
+	{
+		const __m128i savedState0 = state0, savedState1 = state1;
+		__m128i schedule[4];
+
+		//Each iteration performs four rounds
+		for(unsigned int group = 0; group < 16; ++group)
+		{
+			__m128i words;
+
+			if(group < 4)
+				words = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &data[group * 16]), byteSwapMask);
+			else
+			{
+				//W[t] = s1(W[t-2]) + W[t-7] + s0(W[t-15]) + W[t-16]
+				const __m128i previous = schedule[(group + 3) % 4];
+				words = _mm_sha256msg1_epu32(schedule[group % 4], schedule[(group + 1) % 4]);
+				words = _mm_add_epi32(words, _mm_alignr_epi8(previous, schedule[(group + 2) % 4], 4));
+				words = _mm_sha256msg2_epu32(words, previous);
+			}
+
+			schedule[group % 4] = words;
+
+			__m128i roundInput = _mm_add_epi32(words, _mm_loadu_si128((const __m128i *) &K[group * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, roundInput);
+			roundInput = _mm_shuffle_epi32(roundInput, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, roundInput);
+		}
+
+		state0 = _mm_add_epi32(state0, savedState0);
+		state1 = _mm_add_epi32(state1, savedState1);
+		data += 64;
+	}
+
+	//Back to ABCD/EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *) &state[0], state0);
+	_mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+#endif
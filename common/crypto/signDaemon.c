@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * Purpose: Long-lived signing service, so that the update server doesn't spawn Hugin for every challenge
+ * @author Emile-Hugo Spir
+ *
+ * Every request and reply is a frame: its length (uint32, little endian) followed by its content.
+ *
+ * Request:	uint16 count, then count times:
+ *				uint16 keyPathLength, keyPath, uint32 messageLength, message
+ * Reply:	uint16 count, then count times:
+ *				uint8 status (1 if signed), signature (SIGNATURE_LENGTH bytes, zeroed on failure)
+ *
+ * The private keys are loaded from their path the first time they are used, then kept in memory.
+ * Unlike --signString, there is no fallback to the default key.
+ */
+
+#ifndef TARGET_LIKE_MBED
+//Needed for pthread and the UNIX sockets as the library is built as strict C11
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "crypto_utils.h"
+
+#define SIGN_DAEMON_MAX_FRAME		(1u << 20u)
+#define SIGN_DAEMON_KEY_CACHE		64
+#define SIGN_DAEMON_MAX_KEY_PATH	4096
+
+typedef struct
+{
+	char * path;
+	uint8_t key[hydro_sign_SECRETKEYBYTES];
+} CachedKey;
+
+static CachedKey keyCache[SIGN_DAEMON_KEY_CACHE];
+static size_t nextEviction = 0;
+static pthread_mutex_t keyCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool fetchKey(const char * path, size_t pathLength, uint8_t key[hydro_sign_SECRETKEYBYTES])
+{
+	bool found = false;
+
+	pthread_mutex_lock(&keyCacheLock);
+
+	for(size_t i = 0; i < SIGN_DAEMON_KEY_CACHE && keyCache[i].path != NULL; ++i)
+	{
+		if(strlen(keyCache[i].path) == pathLength && memcmp(keyCache[i].path, path, pathLength) == 0)
+		{
+			memcpy(key, keyCache[i].key, hydro_sign_SECRETKEYBYTES);
+			found = true;
+			break;
+		}
+	}
+
+	if(!found)
+	{
+		char filename[SIGN_DAEMON_MAX_KEY_PATH + 1];
+		memcpy(filename, path, pathLength);
+		filename[pathLength] = '\0';
+
+		//Keys of new updates replace the oldest ones once the cache is full
+		if(memchr(path, '\0', pathLength) == NULL && loadKey(filename, true, key))
+		{
+			CachedKey * entry = &keyCache[nextEviction];
+			char * pathCopy = malloc(pathLength + 1);
+
+			if(pathCopy != NULL)
+			{
+				memcpy(pathCopy, filename, pathLength + 1);
+				free(entry->path);
+				entry->path = pathCopy;
+				memcpy(entry->key, key, hydro_sign_SECRETKEYBYTES);
+				nextEviction = (nextEviction + 1) % SIGN_DAEMON_KEY_CACHE;
+			}
+
+			found = true;
+		}
+	}
+
+	pthread_mutex_unlock(&keyCacheLock);
+	return found;
+}
+
+static void clearKeyCache()
+{
+	pthread_mutex_lock(&keyCacheLock);
+
+	for(size_t i = 0; i < SIGN_DAEMON_KEY_CACHE; ++i)
+	{
+		clearMemory(keyCache[i].key, sizeof(keyCache[i].key));
+		free(keyCache[i].path);
+		keyCache[i].path = NULL;
+	}
+
+	nextEviction = 0;
+	pthread_mutex_unlock(&keyCacheLock);
+}
+
+static bool readFully(int fd, uint8_t * buffer, size_t length)
+{
+	while(length > 0)
+	{
+		const ssize_t bytesRead = read(fd, buffer, length);
+		if(bytesRead < 0 && errno == EINTR)
+			continue;
+
+		if(bytesRead <= 0)
+			return false;
+
+		buffer += bytesRead;
+		length -= (size_t) bytesRead;
+	}
+
+	return true;
+}
+
+static bool writeFully(int fd, const uint8_t * buffer, size_t length)
+{
+	while(length > 0)
+	{
+		const ssize_t bytesWritten = write(fd, buffer, length);
+		if(bytesWritten < 0 && errno == EINTR)
+			continue;
+
+		if(bytesWritten <= 0)
+			return false;
+
+		buffer += bytesWritten;
+		length -= (size_t) bytesWritten;
+	}
+
+	return true;
+}
+
+static uint32_t readLittleEndian(const uint8_t * data, uint8_t length)
+{
+	uint32_t output = 0;
+
+	for(uint8_t i = 0; i < length; ++i)
+		output |= (uint32_t) data[i] << (8u * i);
+
+	return output;
+}
+
+static void writeLittleEndian(uint8_t * data, uint32_t value, uint8_t length)
+{
+	for(uint8_t i = 0; i < length; ++i)
+		data[i] = (uint8_t) (value >> (8u * i));
+}
+
+//Sign every entry of a request frame. Returns false if the frame is malformed
+static bool signBatch(const uint8_t * request, size_t requestLength, uint8_t * reply, size_t * replyLength)
+{
+	if(requestLength < sizeof(uint16_t))
+		return false;
+
+	const uint16_t count = (uint16_t) readLittleEndian(request, sizeof(uint16_t));
+	size_t offset = sizeof(uint16_t);
+
+	writeLittleEndian(reply, count, sizeof(uint16_t));
+	uint8_t * replyEntry = &reply[sizeof(uint16_t)];
+
+	for(uint16_t i = 0; i < count; ++i)
+	{
+		if(requestLength - offset < sizeof(uint16_t))
+			return false;
+
+		const size_t pathLength = readLittleEndian(&request[offset], sizeof(uint16_t));
+		offset += sizeof(uint16_t);
+
+		if(pathLength == 0 || pathLength > SIGN_DAEMON_MAX_KEY_PATH || requestLength - offset < pathLength + sizeof(uint32_t))
+			return false;
+
+		const char * path = (const char *) &request[offset];
+		offset += pathLength;
+
+		const size_t messageLength = readLittleEndian(&request[offset], sizeof(uint32_t));
+		offset += sizeof(uint32_t);
+
+		if(requestLength - offset < messageLength)
+			return false;
+
+		uint8_t key[hydro_sign_SECRETKEYBYTES];
+
+		replyEntry[0] = fetchKey(path, pathLength, key) && signBuffer(&request[offset], messageLength, &replyEntry[1], key);
+		if(!replyEntry[0])
+			memset(&replyEntry[1], 0, SIGNATURE_LENGTH);
+
+		clearMemory(key, sizeof(key));
+		offset += messageLength;
+		replyEntry += 1 + SIGNATURE_LENGTH;
+	}
+
+	*replyLength = (size_t) (replyEntry - reply);
+	return offset == requestLength;
+}
+
+//Serve frames until the peer closes the stream or sends a malformed request
+static void serveStream(int input, int output)
+{
+	//libhydrogen's random state is thread local
+	hydro_init();
+
+	uint8_t * request = malloc(SIGN_DAEMON_MAX_FRAME);
+
+	//Each entry takes at least 7 bytes of the request and 1 + SIGNATURE_LENGTH bytes of the reply
+	uint8_t * reply = malloc(sizeof(uint32_t) + sizeof(uint16_t) + UINT16_MAX * (1 + SIGNATURE_LENGTH));
+
+	if(request == NULL || reply == NULL)
+	{
+		fputs("Memory error\n", stderr);
+		free(request);
+		free(reply);
+		return;
+	}
+
+	uint8_t header[sizeof(uint32_t)];
+	while(readFully(input, header, sizeof(header)))
+	{
+		const uint32_t frameLength = readLittleEndian(header, sizeof(header));
+		size_t replyLength;
+
+		if(frameLength > SIGN_DAEMON_MAX_FRAME || !readFully(input, request, frameLength)
+		   || !signBatch(request, frameLength, &reply[sizeof(uint32_t)], &replyLength))
+		{
+			fputs("Invalid signing request\n", stderr);
+			break;
+		}
+
+		writeLittleEndian(reply, (uint32_t) replyLength, sizeof(uint32_t));
+		if(!writeFully(output, reply, sizeof(uint32_t) + replyLength))
+			break;
+	}
+
+	free(request);
+	free(reply);
+}
+
+static void * serveClient(void * context)
+{
+	const int client = (int) (intptr_t) context;
+
+	serveStream(client, client);
+	close(client);
+	return NULL;
+}
+
+bool runSignDaemon(const char * socketPath)
+{
+	//A client leaving early mustn't kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	if(socketPath == NULL)
+	{
+		serveStream(STDIN_FILENO, STDOUT_FILENO);
+		clearKeyCache();
+		return true;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if(strlen(socketPath) >= sizeof(address.sun_path))
+	{
+		fputs("Socket path too long\n", stderr);
+		return false;
+	}
+
+	strcpy(address.sun_path, socketPath);
+
+	const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(server < 0)
+	{
+		perror("Couldn't create the socket");
+		return false;
+	}
+
+	//Replace the socket left by a previous instance
+	unlink(socketPath);
+
+	//Only the owner of the daemon may get challenges signed
+	const mode_t previousMask = umask(0077);
+	const bool bound = bind(server, (const struct sockaddr *) &address, sizeof(address)) == 0;
+	umask(previousMask);
+
+	if(!bound || listen(server, SOMAXCONN) != 0)
+	{
+		perror("Couldn't listen on the socket");
+		close(server);
+		return false;
+	}
+
+	fprintf(stderr, "Signing daemon listening on %s\n", socketPath);
+
+	//One thread per client, which are expected to be a handful of long-lived server processes
+	while(true)
+	{
+		const int client = accept(server, NULL, NULL);
+		if(client < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			perror("Couldn't accept a client");
+			break;
+		}
+
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, serveClient, (void *) (intptr_t) client) != 0)
+		{
+			close(client);
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+
+	close(server);
+	unlink(socketPath);
+	clearKeyCache();
+	return false;
+}
+
+static size_t appendEntry(uint8_t * request, const char * keyPath, const uint8_t * message, uint32_t messageLength)
+{
+	const size_t pathLength = strlen(keyPath);
+
+	writeLittleEndian(request, (uint32_t) pathLength, sizeof(uint16_t));
+	memcpy(&request[sizeof(uint16_t)], keyPath, pathLength);
+	writeLittleEndian(&request[sizeof(uint16_t) + pathLength], messageLength, sizeof(uint32_t));
+	memcpy(&request[sizeof(uint16_t) + pathLength + sizeof(uint32_t)], message, messageLength);
+
+	return sizeof(uint16_t) + pathLength + sizeof(uint32_t) + messageLength;
+}
+
+bool testSignDaemon(const char * privKeyFile, const char * pubKeyFile)
+{
+	int sockets[2];
+	pthread_t thread;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+	{
+		puts("\tIO error");
+		return false;
+	}
+
+	if(pthread_create(&thread, NULL, serveClient, (void *) (intptr_t) sockets[1]) != 0)
+	{
+		close(sockets[0]);
+		close(sockets[1]);
+		return false;
+	}
+
+	//Two challenges signed by the same key, and one whose key doesn't exist
+	const uint8_t firstChallenge[] = "First challenge", secondChallenge[] = "Second, longer, challenge";
+	uint8_t request[1024];
+	size_t length = sizeof(uint32_t);
+
+	writeLittleEndian(&request[length], 3, sizeof(uint16_t));
+	length += sizeof(uint16_t);
+	length += appendEntry(&request[length], privKeyFile, firstChallenge, sizeof(firstChallenge));
+	length += appendEntry(&request[length], "/nonexistent/key", firstChallenge, sizeof(firstChallenge));
+	length += appendEntry(&request[length], privKeyFile, secondChallenge, sizeof(secondChallenge));
+	writeLittleEndian(request, (uint32_t) (length - sizeof(uint32_t)), sizeof(uint32_t));
+
+	uint8_t reply[sizeof(uint32_t) + sizeof(uint16_t) + 3 * (1 + SIGNATURE_LENGTH)];
+	bool output = writeFully(sockets[0], request, length) && readFully(sockets[0], reply, sizeof(reply));
+
+	close(sockets[0]);
+	pthread_join(thread, NULL);
+	clearKeyCache();
+
+	uint8_t publicKey[hydro_sign_PUBLICKEYBYTES];
+	output = output && loadKey(pubKeyFile, false, publicKey);
+
+	const uint8_t * entries = &reply[sizeof(uint32_t) + sizeof(uint16_t)];
+	output = output && readLittleEndian(reply, sizeof(uint32_t)) == sizeof(reply) - sizeof(uint32_t)
+			 && readLittleEndian(&reply[sizeof(uint32_t)], sizeof(uint16_t)) == 3
+			 && entries[0] == 1 && validateSignature(firstChallenge, sizeof(firstChallenge), &entries[1], publicKey)
+			 && entries[1 + SIGNATURE_LENGTH] == 0
+			 && entries[2 * (1 + SIGNATURE_LENGTH)] == 1 && validateSignature(secondChallenge, sizeof(secondChallenge), &entries[2 * (1 + SIGNATURE_LENGTH) + 1], publicKey);
+
+	puts(output ? "\tSigning daemon test successful" : "\tSigning daemon test failure");
+	return output;
+}
+
+#endif
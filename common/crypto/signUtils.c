@@ -239,6 +239,9 @@ bool testCrypto()
 	if(!generateKeys(namePriv, namePub))
 		return false;
 
-	return testSignature((const uint8_t*) "UGluayBmbHVmZnkgdW5pY29ybiBkYW5jaW5nIG9uIHJhaW5ib3dzDQpQaW5rIGZsdWZmeSB1bmljb3JuIGRhbmNpbmcgb24gcmFpbmJvd3MNClBpbmsgZmx1ZmZ5IHVuaWNvcm4gZGFuY2luZyBvbiByYWluYm93cw==", true, namePriv, namePub);
+	if(!testSignature((const uint8_t*) "UGluayBmbHVmZnkgdW5pY29ybiBkYW5jaW5nIG9uIHJhaW5ib3dzDQpQaW5rIGZsdWZmeSB1bmljb3JuIGRhbmNpbmcgb24gcmFpbmJvd3MNClBpbmsgZmx1ZmZ5IHVuaWNvcm4gZGFuY2luZyBvbiByYWluYm93cw==", true, namePriv, namePub))
+		return false;
+
+	return testSignDaemon(namePriv, namePub);
 }
 
@@ -193,6 +193,15 @@ RAVENS_CRITICAL bool decodeInstruction(DecoderContext * context, const uint8_t *
 			break;
 		}
 
+		case OPCODE_MOVE_PAGES:
+		{
+			//Both operands are always explicit, USE_BLOCK doesn't apply
+			command->mainAddress = readBlockID(context, byteStream, currentByteOffset, length);
+			command->secondaryAddress = readBlockID(context, byteStream, currentByteOffset, length);
+			command->length = readBits(byteStream, currentByteOffset, length, context->blockIDBits) + 1;
+			break;
+		}
+
 		default:
 		{
 			//Unknown instruction
@@ -20,7 +20,7 @@
  *	|      |          xx00          |          xx01           |        xx10        |           xx11           |
  *	+------+------------------------+-------------------------+--------------------+--------------------------+
  *	| 00xx | ERASE                  | LOAD_AND_FLUSH          | COMMIT             | FLUSH_AND_PARTIAL_COMMIT |
- *	| 01xx | USE_BLOCK              | RELEASE_BLOCK           | REBASE             |                          |
+ *	| 01xx | USE_BLOCK              | RELEASE_BLOCK           | REBASE             | MOVE_PAGES               |
  *	| 10xx | COPY_NAND_TO_NAND      | COPY_NAND_TO_CACHE      | COPY_CACHE_TO_NAND | COPY_CACHE_TO_CACHE      |
  *	| 11xx | CHAINED_COPY_FROM_NAND | CHAINED_COPY_FROM_CACHE | CHAINED_COPY_SKIP  | END_OF_STREAM            |
  *	+------+------------------------+-------------------------+--------------------+--------------------------+
@@ -43,8 +43,7 @@ typedef enum
 	OPCODE_USE_BLOCK = 0b0100,
 	OPCODE_RELEASE = 0b0101,
 	OPCODE_REBASE = 0b0110,
-
-	OPCODE_ILLEGAL = 0b0111,
+	OPCODE_MOVE_PAGES = 0b0111,
 
 	OPCODE_COPY_NN = 0b1000,
 	OPCODE_COPY_NC = 0b1001,
@@ -53,7 +52,10 @@ typedef enum
 	OPCODE_CHAINED_COPY_N = 0b1100,
 	OPCODE_CHAINED_COPY_C = 0b1101,
 	OPCODE_CHAINED_SKIP = 0b1110,
-	OPCODE_END_OF_STREAM = 0b1111
+	OPCODE_END_OF_STREAM = 0b1111,
+
+	//Every opcode is in use, this value can't be decoded and only signal an error
+	OPCODE_ILLEGAL = 0b10000
 } OPCODE;
 
 //Encoder related config
@@ -15,8 +15,13 @@
 
 #include "crypto/crypto_utils.h"
 
-#define MANIFEST_FORMAT_VERSION 0
+#define MANIFEST_FORMAT_VERSION 1
 #define BSDIFF_MAGIC 0x5ec1714e
+#define BSDIFF_INDEXED_MAGIC 0x5ec1714f
+
+//Reversible transforms applied to the BSDiff payload before compression, flagged by its first byte
+#define BSDIFF_FILTER_ZERO_RUN		0x1u
+#define BSDIFF_FILTER_THUMB_BRANCH	0x2u
 
 typedef struct __attribute__((__packed__))
 {
@@ -63,13 +68,24 @@ typedef struct
 
 } UpdateHashRequest;
 
-typedef struct
+typedef struct __attribute__((__packed__))
 {
 	uint32_t start;
 	uint16_t length;
 	uint8_t hash[HASH_LENGTH];
 } UpdateFinalHash;
 
+//Where the decompression of an indexed BSDiff payload can restart, with the state of the parser when it reaches the page
+typedef struct __attribute__((__packed__))
+{
+	uint32_t page;				//Counted from the first page of the BSDiff
+	uint32_t inputOffset;		//In the compressed stream
+	uint32_t segment;
+	uint32_t segmentOffset;
+	uint32_t subsegmentLength;
+	uint8_t didDelta;
+} BSDiffSeekPoint;
+
 #ifdef STATIC_BIT_SIZE
 
 typedef struct
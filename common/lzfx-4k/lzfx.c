@@ -75,7 +75,7 @@ typedef unsigned char u8;
 #define LZFX_MAX_REF_IF_LOW_OFF		(LZFX_MAX_REF_IF_HIGH_OFF + 0b11110u)
 
 #define MAX_REF_FORMAT_1 (0b11110u)
-#define MAX_OFF_FORMAT_1 (1u << 11u)
+#define MAX_OFF_FORMAT_1 (1u << 10u)
 
 #define LZFX_MAX_REF(off) ((off) < MAX_OFF_FORMAT_1 ? LZFX_MAX_REF_IF_LOW_OFF : LZFX_MAX_REF_IF_HIGH_OFF)
 
@@ -270,6 +270,385 @@ int lzfx_compress(const void *const ibuf, const size_t ilen, void *obuf, size_t
 	return 0;
 }
 
+/* Optimal parsing
+
+    For every position of the input, we record the cheapest known way to
+    encode the data up to there, and whether it ended with a literal or a
+    back reference. Back references are found by walking a hash chain over
+    the 4 KiB window, keeping for each length the closest match, as a
+    closer match never costs more bytes.
+
+    Literal runs cost one control byte every LZFX_MAX_LIT bytes, which is
+    tracked through the length of the run leading to each position.
+*/
+
+#define LZFX_MIN_MATCH		3u
+#define LZFX_CHAIN_HLOG		15u
+#define LZFX_CHAIN_HSIZE	(1u << LZFX_CHAIN_HLOG)
+#define LZFX_CHAIN_HASH(p)	((((uint32_t) (p)[0] << 16u) | ((uint32_t) (p)[1] << 8u) | (p)[2]) * 2654435761u >> (32u - LZFX_CHAIN_HLOG))
+
+typedef struct
+{
+	uint32_t cost;			/* Bytes needed to encode the input up to this position */
+	uint16_t length;		/* Length of the back reference ending here, 0 if a literal */
+	uint16_t offset;		/* Encoded offset of that back reference */
+	uint8_t literalRun;		/* Length of the literal run ending here, modulo LZFX_MAX_LIT */
+} LzfxNode;
+
+static inline unsigned int lzfx_backref_cost(unsigned int length, unsigned int off)
+{
+	return length - 2 < MAX_REF_FORMAT_1 && off < MAX_OFF_FORMAT_1 ? 2 : 3;
+}
+
+static void lzfx_find_matches(const u8 *in, size_t ilen, size_t pos, const int32_t *head, const int32_t *chain, unsigned int chainDepth, LzfxNode *nodes)
+{
+	const uint32_t baseCost = nodes[0].cost;
+	unsigned int bestLength = LZFX_MIN_MATCH - 1;
+
+	for (int32_t candidate = head[LZFX_CHAIN_HASH(&in[pos])]; candidate >= 0 && chainDepth--; candidate = chain[candidate & (LZFX_MAX_OFF - 1)])
+	{
+		const size_t off = pos - (size_t) candidate - 1;
+		if (off >= LZFX_MAX_OFF)
+			break;
+
+		size_t maxLength = LZFX_MAX_REF(off);
+		if (maxLength > ilen - pos)
+			maxLength = ilen - pos;
+
+		/* A candidate is only interesting if it's longer than the closer ones */
+		if (maxLength <= bestLength || in[candidate + bestLength] != in[pos + bestLength])
+			continue;
+
+		unsigned int length = 0;
+		while (length < maxLength && in[candidate + length] == in[pos + length])
+			length++;
+
+		for (unsigned int currentLength = bestLength + 1; currentLength <= length; ++currentLength)
+		{
+			const uint32_t cost = baseCost + lzfx_backref_cost(currentLength, (unsigned int) off);
+			LzfxNode *node = &nodes[currentLength];
+
+			if (cost < node->cost)
+			{
+				node->cost = cost;
+				node->length = (uint16_t) currentLength;
+				node->offset = (uint16_t) off;
+				node->literalRun = 0;
+			}
+		}
+
+		if (length > bestLength)
+			bestLength = length;
+
+		/* We can't do better */
+		if (bestLength == LZFX_MAX_REF_IF_LOW_OFF || pos + bestLength == ilen)
+			break;
+	}
+}
+
+static int lzfx_emit_literals(const u8 *literals, size_t length, u8 **op, const u8 *out_end)
+{
+	while (length)
+	{
+		const size_t runLength = length > LZFX_MAX_LIT ? LZFX_MAX_LIT : length;
+
+		if (fx_expect_false(*op + runLength + 1 > out_end))
+			return LZFX_ESIZE;
+
+		*(*op)++ = (u8) (runLength - 1);
+		memcpy(*op, literals, runLength);
+
+		*op += runLength;
+		literals += runLength;
+		length -= runLength;
+	}
+
+	return 0;
+}
+
+static int lzfx_emit_backref(unsigned int length, unsigned int off, u8 **op, const u8 *out_end)
+{
+	u8 *output = *op;
+	length -= 2;  /* We encode the length as #octets - 2 */
+
+	if (fx_expect_false(output + 3 > out_end))
+		return LZFX_ESIZE;
+
+	/* Format 1: [1LLLLLoo oooooooo] */
+	if (length < MAX_REF_FORMAT_1 && off < MAX_OFF_FORMAT_1)
+	{
+		*output++ = (u8) (0b10000000u | ((length << 2u) & 0b01111100) | (off & 0b11u));
+		*output++ = (u8) ((off >> 2u) & 0xffu);
+	}
+	/* Format 2: [11111Loo oooooooo ooLLLLLL] */
+	else
+	{
+		const unsigned int copyLen = length - (off < MAX_OFF_FORMAT_1 ? 0b11110 : 0);
+
+		*output++ = (u8) (0b11111000u | ((copyLen & 1u) << 2u) | (off & 0b11u));
+		*output++ = (u8) ((off >> 2u) & 0xffu);
+		*output++ = (u8) (((copyLen >> 1u) & 0b111111u) | (((off >> 10u) & 0b11u) << 6u));
+	}
+
+	*op = output;
+	return 0;
+}
+
+/*  Parse in[start, end), back references reaching at most LZFX_MAX_OFF bytes
+    before start. nodes must hold end - start + 1 entries */
+static int lzfx_compress_range(const u8 *in, size_t start, size_t end, u8 *obuf, size_t *olen, unsigned int chainDepth, LzfxNode *nodes, int32_t *head, int32_t *chain)
+{
+	const size_t length = end - start;
+
+	memset(head, 0xff, LZFX_CHAIN_HSIZE * sizeof(int32_t));
+
+	/* Index the history so that the block can refer to it */
+	for (size_t pos = start > LZFX_MAX_OFF ? start - LZFX_MAX_OFF : 0; pos < start && pos + LZFX_MIN_MATCH <= end; ++pos)
+	{
+		const uint32_t hash = LZFX_CHAIN_HASH(&in[pos]);
+
+		chain[pos & (LZFX_MAX_OFF - 1)] = head[hash];
+		head[hash] = (int32_t) pos;
+	}
+
+	nodes[0].cost = 0;
+	nodes[0].length = 0;
+	nodes[0].literalRun = 0;
+	for (size_t i = 1; i <= length; ++i)
+		nodes[i].cost = UINT32_MAX;
+
+	for (size_t pos = start; pos < end; ++pos)
+	{
+		/* Extending a literal run is free until it needs a new control byte */
+		const LzfxNode *current = &nodes[pos - start];
+		const uint32_t literalCost = current->cost + 1 + (current->literalRun == 0);
+
+		if (literalCost < current[1].cost)
+		{
+			nodes[pos - start + 1].cost = literalCost;
+			nodes[pos - start + 1].length = 0;
+			nodes[pos - start + 1].literalRun = (uint8_t) ((current->literalRun + 1) % LZFX_MAX_LIT);
+		}
+
+		if (pos + LZFX_MIN_MATCH <= end)
+		{
+			const uint32_t hash = LZFX_CHAIN_HASH(&in[pos]);
+
+			lzfx_find_matches(in, end, pos, head, chain, chainDepth, &nodes[pos - start]);
+
+			chain[pos & (LZFX_MAX_OFF - 1)] = head[hash];
+			head[hash] = (int32_t) pos;
+		}
+	}
+
+	/* Walk back the cheapest path, reusing the length field to link each token to the next one */
+	size_t pos = length;
+	uint32_t next = UINT32_MAX;
+	while (pos > 0)
+	{
+		const size_t tokenLength = nodes[pos].length ? nodes[pos].length : 1;
+
+		nodes[pos].cost = next;
+		next = (uint32_t) pos;
+		pos -= tokenLength;
+	}
+
+	/* Emit the tokens in order, merging the literals into runs */
+	u8 *op = obuf;
+	const u8 *const out_end = op + *olen;
+	size_t literalStart = 0;
+	int rc = 0;
+
+	for (size_t tokenEnd = next; tokenEnd != UINT32_MAX && rc == 0; tokenEnd = nodes[tokenEnd].cost)
+	{
+		if (nodes[tokenEnd].length == 0)
+			continue;
+
+		const size_t tokenStart = tokenEnd - nodes[tokenEnd].length;
+
+		rc = lzfx_emit_literals(&in[start + literalStart], tokenStart - literalStart, &op, out_end);
+		if (rc == 0)
+			rc = lzfx_emit_backref(nodes[tokenEnd].length, nodes[tokenEnd].offset, &op, out_end);
+
+		literalStart = tokenEnd;
+	}
+
+	if (rc == 0)
+		rc = lzfx_emit_literals(&in[start + literalStart], length - literalStart, &op, out_end);
+
+	if (rc == 0)
+		*olen = (size_t) (op - obuf);
+
+	return rc;
+}
+
+static unsigned int lzfx_chain_depth(int level)
+{
+	if (level <= LZFX_LEVEL_FAST)
+		return 1;
+
+	if (level > LZFX_LEVEL_MAX)
+		level = LZFX_LEVEL_MAX;
+
+	return 1u << (level + 1u);
+}
+
+int lzfx_compress_level(const void *const ibuf, const size_t ilen, void *obuf, size_t *const olen, int level)
+{
+	if (level <= LZFX_LEVEL_FAST)
+		return lzfx_compress(ibuf, ilen, obuf, olen);
+
+	if (olen == NULL || (ibuf == NULL && ilen != 0) || (obuf == NULL && ilen != 0))
+		return LZFX_EARGS;
+
+	if (ilen == 0)
+	{
+		*olen = 0;
+		return 0;
+	}
+
+	LzfxNode *nodes = malloc((ilen + 1) * sizeof(LzfxNode));
+	int32_t *head = malloc(LZFX_CHAIN_HSIZE * sizeof(int32_t));
+	int32_t *chain = malloc(LZFX_MAX_OFF * sizeof(int32_t));
+
+	int rc = LZFX_ENOMEM;
+	if (nodes != NULL && head != NULL && chain != NULL)
+		rc = lzfx_compress_range((const u8 *) ibuf, 0, ilen, (u8 *) obuf, olen, lzfx_chain_depth(level), nodes, head, chain);
+
+	free(nodes);
+	free(head);
+	free(chain);
+
+	return rc;
+}
+
+/* Streaming compression
+
+    The buffer holds up to LZFX_MAX_OFF bytes of history followed by the block
+    being filled. Once the block is full, it's compressed and the last
+    LZFX_MAX_OFF bytes are moved to the front to serve as the next history.
+    Every block ends with a complete token, so the outputs simply concatenate.
+*/
+
+#define LZFX_STREAM_OUTPUT_SIZE	(LZFX_STREAM_BLOCK + LZFX_STREAM_BLOCK / LZFX_MAX_LIT + 1)
+
+int lzfx_stream_init(lzfx_stream *stream, int level, lzfx_sink sink, void *sinkContext)
+{
+	if (stream == NULL || sink == NULL)
+		return LZFX_EARGS;
+
+	stream->buffer = malloc(LZFX_MAX_OFF + LZFX_STREAM_BLOCK);
+	stream->output = malloc(LZFX_STREAM_OUTPUT_SIZE);
+	stream->nodes = malloc((LZFX_STREAM_BLOCK + 1) * sizeof(LzfxNode));
+	stream->head = malloc(LZFX_CHAIN_HSIZE * sizeof(int32_t));
+	stream->chain = malloc(LZFX_MAX_OFF * sizeof(int32_t));
+
+	stream->historyLength = 0;
+	stream->blockLength = 0;
+	stream->chainDepth = lzfx_chain_depth(level);
+	stream->sink = sink;
+	stream->sinkContext = sinkContext;
+
+	if (stream->buffer == NULL || stream->output == NULL || stream->nodes == NULL || stream->head == NULL || stream->chain == NULL)
+	{
+		lzfx_stream_free(stream);
+		return LZFX_ENOMEM;
+	}
+
+	return 0;
+}
+
+static int lzfx_stream_flush_block(lzfx_stream *stream)
+{
+	if (stream->blockLength == 0)
+		return 0;
+
+	const size_t end = stream->historyLength + stream->blockLength;
+	size_t outputLength = LZFX_STREAM_OUTPUT_SIZE;
+
+	int rc = lzfx_compress_range(stream->buffer, stream->historyLength, end, stream->output, &outputLength, stream->chainDepth, stream->nodes, stream->head, stream->chain);
+	if (rc == 0)
+		rc = stream->sink(stream->sinkContext, stream->output, outputLength);
+
+	if (rc != 0)
+		return rc;
+
+	/* Keep the end of the data around for the next block */
+	stream->historyLength = end < LZFX_MAX_OFF ? end : LZFX_MAX_OFF;
+	memmove(stream->buffer, &stream->buffer[end - stream->historyLength], stream->historyLength);
+	stream->blockLength = 0;
+
+	return 0;
+}
+
+int lzfx_stream_write(lzfx_stream *stream, const void *data, size_t length)
+{
+	const u8 *input = (const u8 *) data;
+
+	if (stream == NULL || stream->buffer == NULL || (data == NULL && length != 0))
+		return LZFX_EARGS;
+
+	while (length)
+	{
+		size_t chunk = LZFX_STREAM_BLOCK - stream->blockLength;
+		if (chunk > length)
+			chunk = length;
+
+		memcpy(&stream->buffer[stream->historyLength + stream->blockLength], input, chunk);
+		stream->blockLength += chunk;
+		input += chunk;
+		length -= chunk;
+
+		if (stream->blockLength == LZFX_STREAM_BLOCK)
+		{
+			const int rc = lzfx_stream_flush_block(stream);
+			if (rc != 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+int lzfx_stream_restart(lzfx_stream *stream)
+{
+	if (stream == NULL || stream->buffer == NULL)
+		return LZFX_EARGS;
+
+	const int rc = lzfx_stream_flush_block(stream);
+	if (rc == 0)
+		stream->historyLength = 0;
+
+	return rc;
+}
+
+int lzfx_stream_finish(lzfx_stream *stream)
+{
+	if (stream == NULL || stream->buffer == NULL)
+		return LZFX_EARGS;
+
+	const int rc = lzfx_stream_flush_block(stream);
+	lzfx_stream_free(stream);
+
+	return rc;
+}
+
+void lzfx_stream_free(lzfx_stream *stream)
+{
+	if (stream == NULL)
+		return;
+
+	free(stream->buffer);
+	free(stream->output);
+	free(stream->nodes);
+	free(stream->head);
+	free(stream->chain);
+
+	stream->buffer = stream->output = NULL;
+	stream->nodes = NULL;
+	stream->head = stream->chain = NULL;
+}
+
 /* Decompressor */
 int lzfx_decompress(const void *ibuf, size_t ilen, void *obuf, size_t *olen)
 {
@@ -39,6 +39,7 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
 
 /* Hashtable size (2**LZFX_HLOG entries) */
 #ifndef LZFX_HLOG_4K
@@ -49,6 +50,7 @@ extern "C" {
 #define LZFX_ESIZE      (-1)      /* Output buffer too small */
 #define LZFX_ECORRUPT   (-2)      /* Invalid data for decompression */
 #define LZFX_EARGS      (-3)      /* Arguments invalid (NULL) */
+#define LZFX_ENOMEM     (-4)      /* Couldn't allocate the compressor's state */
 
 /*  Buffer-to buffer compression.
 
@@ -61,6 +63,64 @@ extern "C" {
 */
 int lzfx_compress(const void* ibuf, size_t ilen, void* obuf, size_t *olen);
 
+/*  Same as lzfx_compress, with a tunable compression effort.
+
+    LZFX_LEVEL_FAST is the greedy, single probe encoder used by lzfx_compress.
+    Higher levels search hash chains of increasing depth and pick the cheapest
+    sequence of literals and back references (optimal parsing). The output
+    uses the same format and can be read by any lzfx-4k decompressor.
+
+    Levels above LZFX_LEVEL_FAST allocate about 12 bytes per input byte.
+*/
+#define LZFX_LEVEL_FAST	1
+#define LZFX_LEVEL_MAX	9
+
+int lzfx_compress_level(const void* ibuf, size_t ilen, void* obuf, size_t *olen, int level);
+
+/*  Streaming compression.
+
+    The input is fed in arbitrary pieces through lzfx_stream_write and is
+    compressed by blocks of LZFX_STREAM_BLOCK bytes, which can refer to the
+    previous 4 KiB of input. The compressed data is handed to the sink as soon
+    as each block is done and forms a single stream, identical in format to
+    the output of lzfx_compress_level. The memory used doesn't depend on the
+    size of the input.
+
+    The sink returns 0 on success, any other value interrupts the compression
+    and is returned by the function which flushed the block.
+    lzfx_stream_finish flushes the last block and releases the stream, which
+    must otherwise be released by lzfx_stream_free.
+
+    lzfx_stream_restart flushes the pending block and forgets the history: the
+    data written afterwards never refers to what came before, so a decompressor
+    can start reading the stream from that point.
+*/
+#define LZFX_STREAM_BLOCK	(1u << 15u)
+
+typedef int (*lzfx_sink)(void *context, const void *data, size_t length);
+
+typedef struct
+{
+	unsigned char *buffer;		/* History followed by the block being filled */
+	size_t historyLength;
+	size_t blockLength;
+
+	unsigned char *output;
+	void *nodes;
+	int32_t *head;
+	int32_t *chain;
+	unsigned int chainDepth;
+
+	lzfx_sink sink;
+	void *sinkContext;
+} lzfx_stream;
+
+int lzfx_stream_init(lzfx_stream *stream, int level, lzfx_sink sink, void *sinkContext);
+int lzfx_stream_write(lzfx_stream *stream, const void *data, size_t length);
+int lzfx_stream_restart(lzfx_stream *stream);
+int lzfx_stream_finish(lzfx_stream *stream);
+void lzfx_stream_free(lzfx_stream *stream);
+
 /*  Buffer-to-buffer decompression.
 
     Supply pre-allocated input and output buffers via ibuf and obuf, and
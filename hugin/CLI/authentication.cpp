@@ -12,7 +12,11 @@
 
 #include <iostream>
 #include <cstring>
+#include <cassert>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <sys/stat.h>
 #include "../Scheduler/public_command.h"
 #include "scheduler_cli.h"
@@ -37,192 +41,210 @@ void printAuthenticationHelp()
 		 "	[--path | -p] path	- Path to the directory containing the config and the manifest files." << endl <<
 		 "	[--output | -o] outputDirectory" << endl <<
 		 "	[--key | -k] pathToPrivateDeviceKey" << endl << endl;
+
+	cout << "Optional arguments:" << endl <<
+		 "	[--threads | -j] count	- Number of versions to sign in parallel (default: one per core)." << endl << endl;
 }
 
-bool authenticate(vector<VersionData> & versions, const char * inputPath, const char * keyFile, const char * outputPath)
+//Sign the manifest 1 of a single version and move its manifest 2 to the output directory. May run on any thread
+static bool authenticateVersion(VersionData & version, const VersionData & lastVersion, const string & inputString, const string & output, const uint8_t * privateKey)
 {
-	const VersionData lastVersion = versions.back();
+	const string inputManifest(inputString + "/" + version.manifest2Path);
 
-	//Can the version fit in 31 bits
-	if(lastVersion.version > (1u << 31u))
+	UpdateHeader manifest1;
+	memset(&manifest1, 0, sizeof(manifest1));
+	manifest1.sectionSignedDeviceKey.formatVersion = MANIFEST_FORMAT_VERSION;
+
+	//Get manifest2 size
+	struct stat st;
+	if(stat(inputManifest.c_str(), &st) != 0)
 	{
-		cerr << "Version ID is too large to encode in the manifest." << endl;
+		cerr << "Couldn't get metadata on " << version.manifest2Path << ". Aborting" << endl;
+		return false;
+	}
+	else if(st.st_size == 0 || st.st_size > UINT32_MAX)
+	{
+		cerr << "Invalid manifest size for " << version.manifest2Path << ". Aborting" << endl;
 		return false;
 	}
 
-	uint8_t privateKey[hydro_sign_SECRETKEYBYTES];
-	if(!loadKey(keyFile, true, privateKey))
+	//Hash the manifest2
+	if(!hashFile(inputManifest.c_str(), manifest1.sectionSignedDeviceKey.updateHash, 0))
 	{
-		cerr << "Couldn't load the device key" << endl;
+		cerr << "Couldn't hash " << version.manifest2Path << ". Aborting" << endl;
 		return false;
 	}
 
-	const string inputString(inputPath), output(outputPath);
+	//Populate some fields
+	manifest1.sectionSignedDeviceKey.manifestLength = (uint32_t) st.st_size;
+	manifest1.sectionSignedDeviceKey.oldVersionID = version.version;
+	manifest1.sectionSignedDeviceKey.versionID = lastVersion.version;
+	manifest1.sectionSignedDeviceKey.haveExtra = !version.rangesToCheckBeforeUpdate.empty();
 
-	for(auto & version : versions)
+	size_t bufferLength = 0;
+	vector<uint8_t> hashVerificationBuffer;
+
+	if(manifest1.sectionSignedDeviceKey.haveExtra)
 	{
-		if(version.version == lastVersion.version)
-			continue;
+		//Check that we can safely encode the number of validations
+		assert(version.rangesToCheckBeforeUpdate.size() < UINT16_MAX);
 
-		const string inputManifest(inputString + "/" + version.manifest2Path);
+		//Grab a buffer
+		bufferLength = SIGNATURE_LENGTH + sizeof(uint16_t) + version.rangesToCheckBeforeUpdate.size() * sizeof(struct SingleHashRequest);
+		hashVerificationBuffer.resize(bufferLength);
 
-		UpdateHeader manifest1;
-		memset(&manifest1, 0, sizeof(manifest1));
-		manifest1.sectionSignedDeviceKey.formatVersion = MANIFEST_FORMAT_VERSION;
+		size_t bufferIndex = SIGNATURE_LENGTH;
 
-		//Get manifest2 size
-		struct stat st;
-		if(stat(inputManifest.c_str(), &st) != 0)
-		{
-			cerr << "Couldn't get metadata on " << version.manifest2Path << ". Aborting" << endl;
-			clearMemory(privateKey, sizeof(privateKey));
-			return false;
-		}
-		else if(st.st_size == 0 || st.st_size > UINT32_MAX)
-		{
-			cerr << "Invalid manifest size for " << version.manifest2Path << ". Aborting" << endl;
-			clearMemory(privateKey, sizeof(privateKey));
-			return false;
-		}
+		//Add the numberValidation field of UpdateHashRequest
+		auto numberValidation = static_cast<uint16_t>(version.rangesToCheckBeforeUpdate.size());
+		memcpy(&hashVerificationBuffer[bufferIndex], &numberValidation, sizeof(numberValidation));
+		bufferIndex += sizeof(numberValidation);
 
-		//Hash the manifest2
-		if(!hashFile(inputManifest.c_str(), manifest1.sectionSignedDeviceKey.updateHash, 0))
+		//Append SingleHashRequest
+		for(uint16_t i = 0; i < numberValidation; ++i)
 		{
-			cerr << "Couldn't hash " << version.manifest2Path << ". Aborting" << endl;
-			clearMemory(privateKey, sizeof(privateKey));
-			return false;
+			SingleHashRequest curHashRequest{
+				.start = version.rangesToCheckBeforeUpdate[i].start,
+				.length = version.rangesToCheckBeforeUpdate[i].length
+			};
+
+			memcpy(&hashVerificationBuffer[bufferIndex], &curHashRequest, sizeof(curHashRequest));
+			bufferIndex += sizeof(curHashRequest);
 		}
 
-		//Populate some fields
-		manifest1.sectionSignedDeviceKey.manifestLength = (uint32_t) st.st_size;
-		manifest1.sectionSignedDeviceKey.oldVersionID = version.version;
-		manifest1.sectionSignedDeviceKey.versionID = lastVersion.version;
-		manifest1.sectionSignedDeviceKey.haveExtra = !version.rangesToCheckBeforeUpdate.empty();
+		//Alright, we can sign the package
+		signBuffer(hashVerificationBuffer.data() + SIGNATURE_LENGTH,
+				   bufferLength - SIGNATURE_LENGTH,
+				   hashVerificationBuffer.data(), privateKey);
+	}
 
-		size_t bufferLength = 0;
-		uint8_t * hashVerificationBuffer = nullptr;
+	//We're now only missing the public key and the signature for the main package
 
-		if(manifest1.sectionSignedDeviceKey.haveExtra)
-		{
-			//Check that we can safely encode the number of validations
-			assert(version.rangesToCheckBeforeUpdate.size() < UINT16_MAX);
+	//Generate the keys. libhydrogen keeps its random state per thread, and generateKeyMemory seeds it
+	uint8_t secretUpdateKey[hydro_sign_SECRETKEYBYTES];
+	generateKeyMemory(secretUpdateKey, manifest1.sectionSignedDeviceKey.updatePubKey);
 
-			//Grab a buffer
-			bufferLength = SIGNATURE_LENGTH + sizeof(uint16_t) + version.rangesToCheckBeforeUpdate.size() * sizeof(struct SingleHashRequest);
-			hashVerificationBuffer = (uint8_t *) malloc(bufferLength);
-			if(hashVerificationBuffer == nullptr)
-			{
-				cerr << "Memory error!" << endl;
-				clearMemory(privateKey, sizeof(privateKey));
-				return false;
-			}
+	//Sign the package
+	signBuffer((const uint8_t *) &manifest1.sectionSignedDeviceKey + SIGNATURE_LENGTH,
+			   sizeof(manifest1.sectionSignedDeviceKey) - sizeof(manifest1.sectionSignedDeviceKey.signature),
+			   manifest1.sectionSignedDeviceKey.signature, privateKey);
 
-			size_t bufferIndex = SIGNATURE_LENGTH;
+	//Save the public & private keys
+	const string versionString("_" + to_string(version.version) + "_" + to_string(lastVersion.version));
 
-			//Add the numberValidation field of UpdateHashRequest
-			auto numberValidation = static_cast<uint16_t>(version.rangesToCheckBeforeUpdate.size());
-			memcpy(&hashVerificationBuffer[bufferIndex], &numberValidation, sizeof(numberValidation));
-			bufferIndex += sizeof(numberValidation);
+	version.manifest1Path = "manifest1";
+	version.manifest1Path += versionString;
 
-			//Append SingleHashRequest
-			for(uint16_t i = 0; i < numberValidation; ++i)
-			{
-				SingleHashRequest curHashRequest{
-					.start = version.rangesToCheckBeforeUpdate[i].start,
-					.length = version.rangesToCheckBeforeUpdate[i].length
-				};
+	const string newManifest1Path = output + '/' + version.manifest1Path;
 
-				memcpy(&hashVerificationBuffer[bufferIndex], &curHashRequest, sizeof(curHashRequest));
-				bufferIndex += sizeof(curHashRequest);
-			}
+	{
+		char secretKeyHex[hydro_sign_SECRETKEYBYTES * 2 + 1];
+		hydro_bin2hex(secretKeyHex, sizeof(secretKeyHex), secretUpdateKey, sizeof(secretUpdateKey));
+		version.secretKey = string(secretKeyHex);
+
+		clearMemory(secretUpdateKey, sizeof(secretUpdateKey));
+		clearMemory((uint8_t *) secretKeyHex, sizeof(secretKeyHex));
+	}
+
+	{
+		char publicKeyHex[hydro_sign_PUBLICKEYBYTES * 2 + 1] = {0};
+		hydro_bin2hex(publicKeyHex, sizeof(publicKeyHex), manifest1.sectionSignedDeviceKey.updatePubKey, sizeof(manifest1.sectionSignedDeviceKey.updatePubKey));
+		version.publicKey = string(publicKeyHex);
+	}
+
+	//Write the manifest 1
+	FILE * outputFile = fopen(newManifest1Path.c_str(), "wb");
+	if(outputFile == nullptr)
+	{
+		cerr << "Couldn't open the file for the manifest 1 (" << newManifest1Path << ")" << endl;
+		return false;
+	}
+
+	if(fwrite(&manifest1, 1, sizeof(manifest1.sectionSignedDeviceKey), outputFile) != sizeof(manifest1.sectionSignedDeviceKey))
+	{
+		cerr << "Couldn't write to the manifest 1 file (" << newManifest1Path << ")" << endl;
+		fclose(outputFile);
+		return false;
+	}
 
-			//Alright, we can sign the package
-			signBuffer(hashVerificationBuffer + SIGNATURE_LENGTH,
-					   bufferLength - SIGNATURE_LENGTH,
-					   hashVerificationBuffer, privateKey);
+	if(manifest1.sectionSignedDeviceKey.haveExtra)
+	{
+		version.startVerificationIndex = sizeof(manifest1.sectionSignedDeviceKey);
+		if(fwrite(hashVerificationBuffer.data(), 1, bufferLength, outputFile) != bufferLength)
+		{
+			cerr << "Couldn't write to the validation portion of the manifest 1 file (" << newManifest1Path << ")" << endl;
+			fclose(outputFile);
+			return false;
 		}
+	}
+	else
+		version.startVerificationIndex = 0;
 
-		//We're now only missing the public key and the signature for the main package
+	fclose(outputFile);
 
-		//Generate the keys
-		uint8_t secretUpdateKey[hydro_sign_SECRETKEYBYTES];
-		generateKeyMemory(secretUpdateKey, manifest1.sectionSignedDeviceKey.updatePubKey);
+	const string newManifest2Path(output + "/" + version.manifest2Path);
 
-		//Sign the package
-		signBuffer((const uint8_t *) &manifest1.sectionSignedDeviceKey + SIGNATURE_LENGTH,
-				   sizeof(manifest1.sectionSignedDeviceKey) - sizeof(manifest1.sectionSignedDeviceKey.signature),
-				   manifest1.sectionSignedDeviceKey.signature, privateKey);
+	//We generated the manifest 1. Now, we may move the manifest 2 to the final directory
+	if(rename(inputManifest.c_str(), newManifest2Path.c_str()))
+	{
+		cerr << "Couldn't move the manifest 2 of version " << to_string(version.version) << " to it's new path (" << newManifest2Path << ")" << endl;
+		return false;
+	}
 
-		//Save the public & private keys
-		const string versionString("_" + to_string(version.version) + "_" + to_string(lastVersion.version));
+	return true;
+}
 
-		version.manifest1Path = "manifest1";
-		version.manifest1Path += versionString;
+bool authenticate(vector<VersionData> & versions, const char * inputPath, const char * keyFile, const char * outputPath, size_t numberThreads)
+{
+	const VersionData lastVersion = versions.back();
 
-		const string newManifest1Path = output + '/' + version.manifest1Path;
+	//Can the version fit in 31 bits
+	if(lastVersion.version > (1u << 31u))
+	{
+		cerr << "Version ID is too large to encode in the manifest." << endl;
+		return false;
+	}
 
-		{
-			char secretKeyHex[hydro_sign_SECRETKEYBYTES * 2 + 1];
-			hydro_bin2hex(secretKeyHex, sizeof(secretKeyHex), secretUpdateKey, sizeof(secretUpdateKey));
-			version.secretKey = string(secretKeyHex);
+	//The workers share this single copy of the device key
+	uint8_t privateKey[hydro_sign_SECRETKEYBYTES];
+	if(!loadKey(keyFile, true, privateKey))
+	{
+		cerr << "Couldn't load the device key" << endl;
+		return false;
+	}
 
-			clearMemory(secretUpdateKey, sizeof(secretUpdateKey));
-			clearMemory((uint8_t *) secretKeyHex, sizeof(secretKeyHex));
-		}
+	const string inputString(inputPath), output(outputPath);
 
-		{
-			char publicKeyHex[hydro_sign_PUBLICKEYBYTES * 2 + 1] = {0};
-			hydro_bin2hex(publicKeyHex, sizeof(publicKeyHex), manifest1.sectionSignedDeviceKey.updatePubKey, sizeof(manifest1.sectionSignedDeviceKey.updatePubKey));
-			version.publicKey = string(publicKeyHex);
-		}
+	//Each version only touches its own entry and files, so the workers simply pick the next version in line
+	const size_t numberVersions = versions.size() - 1;
+	atomic<size_t> nextVersion(0);
+	atomic<bool> failed(false);
 
-		//Write the manifest 1
-		FILE * outputFile = fopen(newManifest1Path.c_str(), "wb");
-		if(outputFile == nullptr)
+	auto worker = [&]()
+	{
+		size_t index;
+		while(!failed && (index = nextVersion++) < numberVersions)
 		{
-			clearMemory(privateKey, sizeof(privateKey));
-			cerr << "Couldn't open the file for the manifest 1 (" << newManifest1Path << ")" << endl;
-			free(hashVerificationBuffer);
-			return false;
-		}
+			VersionData & version = versions[index];
 
-		if(fwrite(&manifest1, 1, sizeof(manifest1.sectionSignedDeviceKey), outputFile) != sizeof(manifest1.sectionSignedDeviceKey))
-		{
-			clearMemory(privateKey, sizeof(privateKey));
-			cerr << "Couldn't write to the manifest 1 file (" << newManifest1Path << ")" << endl;
-			free(hashVerificationBuffer);
-			return false;
+			if(version.version != lastVersion.version && !authenticateVersion(version, lastVersion, inputString, output, privateKey))
+				failed = true;
 		}
+	};
 
-		if(manifest1.sectionSignedDeviceKey.haveExtra)
-		{
-			version.startVerificationIndex = sizeof(manifest1.sectionSignedDeviceKey);
-			if(fwrite(hashVerificationBuffer, 1, bufferLength, outputFile) != bufferLength)
-			{
-				clearMemory(privateKey, sizeof(privateKey));
-				cerr << "Couldn't write to the validation portion of the manifest 1 file (" << newManifest1Path << ")" << endl;
-				free(hashVerificationBuffer);
-				return false;
-			}
-		}
-		else
-			version.startVerificationIndex = 0;
+	numberThreads = max<size_t>(min(numberThreads, numberVersions), 1);
 
-		free(hashVerificationBuffer);
-		fclose(outputFile);
+	vector<thread> workers;
+	for(size_t i = 1; i < numberThreads; ++i)
+		workers.emplace_back(worker);
 
-		const string newManifest2Path(output + "/" + version.manifest2Path);
+	worker();
 
-		//We generated the manifest 1. Now, we may move the manifest 2 to the final directory
-		if(rename(inputManifest.c_str(), newManifest2Path.c_str()))
-		{
-			clearMemory(privateKey, sizeof(privateKey));
-			cerr << "Couldn't move the manifest 2 of version " << to_string(version.version) << " to it's new path (" << newManifest2Path << ")" << endl;
-			return false;
-		}
-	}
+	for(auto & workerThread : workers)
+		workerThread.join();
 
-	return true;
+	clearMemory(privateKey, sizeof(privateKey));
+	return !failed;
 }
 
 bool writeJson(vector<VersionData> & versions, const char * outputPath)
@@ -268,7 +290,8 @@ bool writeJson(vector<VersionData> & versions, const char * outputPath)
 			for(const auto & range : version.rangesToCheckBeforeUpdate)
 			{
 				rapidjson::Value hash;
-				hash.SetString(range.expectedHash.c_str(), static_cast<rapidjson::SizeType>(range.expectedHash.size()));
+				const string hexHash = range.hexHash();
+				hash.SetString(hexHash.c_str(), static_cast<rapidjson::SizeType>(hexHash.size()), outputConfig.GetAllocator());
 				validation.PushBack(hash, outputConfig.GetAllocator());
 			}
 
@@ -311,6 +334,7 @@ bool processAuthentication(int argc, char *argv[])
 	int index = 1;
 	char * output = nullptr;
 	const char * path = nullptr, * keyFile = nullptr;
+	size_t numberThreads = max(thread::hardware_concurrency(), 1u);
 
 	while(index < argc)
 	{
@@ -329,6 +353,17 @@ bool processAuthentication(int argc, char *argv[])
 			output = argv[index + 1];
 			index += 2;
 		}
+		else if((!strcmp(argv[index], "--threads") || !strcmp(argv[index], "-j")) && index + 1 < argc)
+		{
+			numberThreads = strtoul(argv[index + 1], nullptr, 10);
+			if(numberThreads == 0)
+			{
+				cerr << "Invalid number of threads: " << argv[index + 1] << endl;
+				return false;
+			}
+
+			index += 2;
+		}
 		else
 		{
 			cerr << "Invalid argument: " << argv[index++] << endl;
@@ -351,7 +386,7 @@ bool processAuthentication(int argc, char *argv[])
 	if(!parseConfig(pathToConfig.c_str(), true, versions, ignore, ignore))
 		return false;
 
-	if(!authenticate(versions, path, keyFile, output))
+	if(!authenticate(versions, path, keyFile, output, numberThreads))
 		return false;
 
 	return writeJson(versions, output);
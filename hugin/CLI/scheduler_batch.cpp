@@ -11,8 +11,12 @@
  */
 
 #include <iostream>
+#include <cstring>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <memory>
+#include <thread>
 #include <rapidjson/document.h>
 #include <rapidjson/prettywriter.h>
 #include <rapidjson/filewritestream.h>
@@ -20,14 +24,20 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <layout.h>
+#include <crypto_utils.h>
 #include "../Scheduler/bsdiff/bsdiff.h"
 #include "../Scheduler/config.h"
 #include "../Scheduler/public_command.h"
+#include "../Scheduler/validation.h"
+#include "../Server/update_catalog.h"
 #include "scheduler_cli.h"
 
+#define BATCH_CATALOG_FILE "catalog.bin"
+
 using namespace std;
 
-bool parseConfig(const char * configFile, bool wantManifests, vector<VersionData> & output, size_t & flashSize, size_t & flashPageSize)
+bool parseConfig(const char * configFile, bool wantManifests, vector<VersionData> & output, size_t & flashSize, size_t & flashPageSize, string * deviceName)
 {
 	size_t configSize;
 	uint8_t * configContent = readFile(configFile, &configSize);
@@ -64,6 +74,10 @@ bool parseConfig(const char * configFile, bool wantManifests, vector<VersionData
 	else
 		flashPageSize = BLOCK_SIZE_BIT_DEFAULT;
 
+	//Key of the cells in the binary catalog
+	if(deviceName != nullptr)
+		*deviceName = config.HasMember("device") && config["device"].IsString() ? config["device"].GetString() : "";
+
 	if(flashPageSize > flashSize)
 	{
 		cerr << "Page size can't be larger than flash size" << endl;
@@ -110,7 +124,11 @@ bool parseConfig(const char * configFile, bool wantManifests, vector<VersionData
 				}
 
 				VerificationRange newRange(range["start"].GetUint(), static_cast<uint16_t>(range["length"].GetUint()));
-				newRange.expectedHash = string(range["hash"].GetString());
+				if(!newRange.setHashFromHex(range["hash"].GetString(), range["hash"].GetStringLength()))
+				{
+					cerr << "Invalid range to validate: malformed hash" << endl;
+					return false;
+				}
 
 				rangesToCheckBeforeUpdate.push_back(newRange);
 			}
@@ -286,11 +304,33 @@ bool canUseDir(char * dir)
 	}
 }
 
-bool processSchedulerBatch(const char * configFile, char * outputDir)
+//A cell of the previous catalog can be reused if it was generated from the same binaries toward the same version
+static const UpdateCatalogEntry * findReusableCell(const UpdateCatalog & catalog, const string & deviceName, uint32_t oldVersion, uint32_t finalVersion, const uint8_t * oldHash, const uint8_t * finalHash)
+{
+	const UpdateCatalogEntry * cell = catalog.find(deviceName, oldVersion);
+	if(cell == nullptr || cell->toVersion != finalVersion || (cell->flags & UPDATE_CATALOG_HAS_SOURCES) == 0
+	   || memcmp(cell->sourceHash, oldHash, HASH_LENGTH) != 0 || memcmp(cell->targetHash, finalHash, HASH_LENGTH) != 0)
+		return nullptr;
+
+	return cell;
+}
+
+static bool writeManifest(const string & path, const uint8_t * data, size_t length)
+{
+	FILE * file = fopen(path.c_str(), "wb");
+	if(file == nullptr)
+		return false;
+
+	const bool success = length == 0 || fwrite(data, 1, length, file) == length;
+	return fclose(file) == 0 && success;
+}
+
+bool processSchedulerBatch(const char * configFile, char * outputDir, ValidationMode validation)
 {
 	size_t flashSize, flashPageSize;
+	string deviceName;
 	vector<VersionData> versions;
-	if(!parseConfig(configFile, false, versions, flashSize, flashPageSize))
+	if(!parseConfig(configFile, false, versions, flashSize, flashPageSize, &deviceName))
 		return false;
 
 	//Update the value
@@ -316,13 +356,42 @@ bool processSchedulerBatch(const char * configFile, char * outputDir)
 		lastVersion = version.version;
 	}
 
+	//A directory holding a catalog is ours, we only refresh it
+	const string catalogPath = string(outputDir) + "/" + BATCH_CATALOG_FILE;
+	struct stat catalogInfo = {};
+	const bool haveCatalog = stat(catalogPath.c_str(), &catalogInfo) == 0;
+
 	//Make sure we can freely write to the output path
-	if(!canUseDir(outputDir))
+	if(!haveCatalog && !canUseDir(outputDir))
 	{
 		cerr << "Couldn't take control of the output directory" << endl;
 		return false;
 	}
 
+	//The cells generated with other settings are stale
+	const UpdateCatalogParameters parameters = {MANIFEST_FORMAT_VERSION, FLASH_SIZE_BIT, BLOCK_SIZE_BIT, (uint8_t) COMPRESSION_LEVEL, (uint32_t) VERIFICATION_RANGE_OVERHEAD};
+	UpdateCatalog previousCatalog;
+	bool reuseCells = haveCatalog && previousCatalog.open(catalogPath);
+
+	if(reuseCells && !(previousCatalog.parameters() == parameters))
+	{
+		cout << "The catalog was generated with other settings, every manifest will be regenerated" << endl;
+		reuseCells = false;
+	}
+
+	//Identify the binaries by their content rather than their version number
+	vector<const char *> binaryPaths;
+	for(const auto & version : versions)
+		binaryPaths.push_back(version.binaryPath.c_str());
+
+	vector<uint8_t> binaryHashes(binaryPaths.size() * HASH_LENGTH);
+	unique_ptr<bool[]> hashed(new bool[binaryPaths.size()]);
+	if(!hashFiles(binaryPaths.data(), binaryPaths.size(), 0, binaryHashes.data(), hashed.get(), max(thread::hardware_concurrency(), 1u), nullptr))
+	{
+		cerr << "Couldn't read the binaries" << endl;
+		return false;
+	}
+
 	//Create a new config file
 	rapidjson::Document outputConfig;
 	outputConfig.SetObject();
@@ -349,20 +418,82 @@ bool processSchedulerBatch(const char * configFile, char * outputDir)
 	VersionData finalVersion = versions.back();
 	versions.pop_back();
 
-	for(const auto & oldVersion : versions)
+	const uint8_t * finalHash = &binaryHashes[versions.size() * HASH_LENGTH];
+	UpdateCatalogWriter catalog(parameters);
+	deque<MappedFile> generatedManifests;
+	size_t reusedCells = 0;
+
+	for(size_t versionIndex = 0; versionIndex < versions.size(); ++versionIndex)
 	{
+		const VersionData & oldVersion = versions[versionIndex];
+		const uint8_t * oldHash = &binaryHashes[versionIndex * HASH_LENGTH];
+
 		//Craft the output file name
 		const string output("manifest2_" + to_string(oldVersion.version) + "_" + to_string(finalVersion.version));
 		const string fullOutput = string(outputDir) + "/" + output;
 		vector<VerificationRange> preUpdateHashes;
 
-		//Generate the manifest
-		if(!runSchedulerWithFiles(oldVersion.binaryPath.c_str(), finalVersion.binaryPath.c_str(), fullOutput.c_str(), preUpdateHashes, false, false))
+		UpdateCatalogCell cell;
+		cell.device = deviceName;
+		cell.fromVersion = oldVersion.version;
+		cell.toVersion = finalVersion.version;
+		cell.haveSources = true;
+		memcpy(cell.sourceHash, oldHash, HASH_LENGTH);
+		memcpy(cell.targetHash, finalHash, HASH_LENGTH);
+
+		const UpdateCatalogEntry * cached = !reuseCells ? nullptr : findReusableCell(previousCatalog, deviceName, oldVersion.version, finalVersion.version, oldHash, finalHash);
+		if(cached != nullptr)
 		{
-			cerr << "Couldn't diff with version " << to_string(oldVersion.version) << " (file " << oldVersion.binaryPath << ")" << endl;
-			return false;
+			//The previous catalog stays mapped until we are done, even once replaced
+			cell.manifest2 = previousCatalog.bytes(cached->manifest2Offset);
+			cell.manifest2Size = cached->manifest2Size;
+
+			const UpdateCatalogRange * ranges = previousCatalog.ranges(*cached);
+			for(uint32_t i = 0; i < cached->verificationCount; ++i)
+			{
+				preUpdateHashes.emplace_back(ranges[i].start, ranges[i].length);
+				memcpy(preUpdateHashes.back().expectedHash, ranges[i].hash, HASH_LENGTH);
+			}
+
+			if(!writeManifest(fullOutput, cell.manifest2, cell.manifest2Size))
+			{
+				cerr << "Couldn't write " << fullOutput << endl;
+				return false;
+			}
+
+			reusedCells += 1;
+		}
+		else
+		{
+			//Generate the manifest
+			if(!runSchedulerWithFiles(oldVersion.binaryPath.c_str(), finalVersion.binaryPath.c_str(), fullOutput.c_str(), preUpdateHashes, false, false, false, validation))
+			{
+				cerr << "Couldn't diff with version " << to_string(oldVersion.version) << " (file " << oldVersion.binaryPath << ")" << endl;
+				return false;
+			}
+
+			generatedManifests.emplace_back();
+			if(!generatedManifests.back().map(fullOutput))
+			{
+				cerr << "Couldn't read back " << fullOutput << endl;
+				return false;
+			}
+
+			cell.manifest2 = generatedManifests.back().bytes();
+			cell.manifest2Size = generatedManifests.back().size();
 		}
 
+		for(const auto & verif : preUpdateHashes)
+		{
+			UpdateCatalogRange range = {};
+			range.start = verif.start;
+			range.length = verif.length;
+			memcpy(range.hash, verif.expectedHash, HASH_LENGTH);
+			cell.verification.push_back(range);
+		}
+
+		catalog.add(move(cell));
+
 		//Create the new object in the output JSON file
 		rapidjson::Value versionID, binaryPath, manifestPath;
 
@@ -390,7 +521,8 @@ bool processSchedulerBatch(const char * configFile, char * outputDir)
 
 				startRange.SetUint(verif.start);
 				lengthRange.SetUint(verif.length);
-				expectedHash.SetString(verif.expectedHash.c_str(), static_cast<rapidjson::SizeType>(verif.expectedHash.size()), outputConfig.GetAllocator());
+				const string hexHash = verif.hexHash();
+				expectedHash.SetString(hexHash.c_str(), static_cast<rapidjson::SizeType>(hexHash.size()), outputConfig.GetAllocator());
 
 				currentCheck.SetObject();
 				currentCheck.AddMember("start", startRange, outputConfig.GetAllocator());
@@ -435,6 +567,9 @@ bool processSchedulerBatch(const char * configFile, char * outputDir)
 	outputConfig.Accept(writer);
 	fclose(outputConfigFile);
 
-	return true;
+	if(reusedCells != 0)
+		cout << "Reused " << reusedCells << " of " << versions.size() << " manifests from the catalog" << endl;
+
+	return catalog.write(catalogPath);
 }
 
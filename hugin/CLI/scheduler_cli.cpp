@@ -17,6 +17,8 @@
 #include "../Scheduler/public_command.h"
 #include "../Scheduler/bsdiff/bsdiff.h"
 #include "../Scheduler/validation.h"
+#include "../Scheduler/config.h"
+#include "../../munin/integration/drivers/Host/flash_simulator.h"
 #include "scheduler_cli.h"
 
 using namespace std;
@@ -38,16 +40,70 @@ void printSchedulerHelp()
 	cout << "Optional arguments:" << endl <<
 "	--verbose		- Print additional information on the patch generation" << endl <<
 "	--dryRun		- Perform the diff but doesn't actually write down the update. Useful for testing. Not valid in batchMode" << endl <<
+"	--estimate		- Run the update through a simulation of Munin and report the expected update time and number of erases" << endl <<
+"				Only supported with the default flash geometry" << endl <<
+"	--validate=mode		- How thoroughly the patch is replayed before being written. Valid in batchMode" << endl <<
+"				full re-encodes the bytecode and compares the whole image (default)" << endl <<
+"				fast only compares the pages the update writes to" << endl <<
+"				off skips the validation entirely" << endl <<
 "	--flashSize value	- Determine the address space. Value should be the power of two to be used." << endl <<
 "				(e.g. 20 means that the flash is 2^20 bytes = 1MiB)" << endl <<
 "				Default value is 20 (i.e. 1MiB)" << endl <<
 "	--pageSize value	- Size of the flash pages to be by the scheduler. Value should be the power of two to be used." << endl <<
 "				(e.g. 12 means that the flash is 2^12 bytes = 4KiB" << endl <<
 "				Default value is 12 (i.e. 4096 bytes)" << endl <<
+"	--rangeOverhead value	- Cost of an extra range checked before the update, in bytes the device could hash instead." << endl <<
+"				Gaps smaller than that between the ranges are hashed rather than checked separately. Valid in batchMode" << endl <<
+"				Default value is 256, 0 only merges contiguous ranges" << endl <<
+"	--compressionLevel value	- Effort spent compressing the patch, from 1 (fastest) to 9 (smallest). Valid in batchMode" << endl <<
+"				Default value is 9" << endl <<
 "	--diffAndSign" << endl << endl;
 }
 
-bool runSchedulerWithFiles(const char * oldFile, const char * newFile, const char * output, vector<VerificationRange> & preUpdateHashes, bool printLog, bool dryRun)
+bool estimatePatchCost(const uint8_t * oldFileContent, size_t oldFileSize, const uint8_t * newFileContent, size_t newFileSize, const vector<uint8_t> & manifest)
+{
+	if(simulatedFlashSizeBit() != FLASH_SIZE_BIT || simulatedBlockSizeBit() != BLOCK_SIZE_BIT)
+	{
+		cerr << "The simulator only supports a flash of 2^" << simulatedFlashSizeBit() << " bytes with pages of 2^" << simulatedBlockSizeBit() << " bytes" << endl;
+		return false;
+	}
+
+	FlashSimulatorReport report{};
+	if(!simulateUpdate(oldFileContent, oldFileSize, manifest.data(), manifest.size(), &report))
+	{
+		cerr << "The simulated update failed. Please open a bug report!" << endl;
+		return false;
+	}
+
+	if(memcmp(simulatedFlash(), newFileContent, newFileSize) != 0)
+	{
+		cerr << "The simulated update didn't produce the new firmware. Please open a bug report!" << endl;
+		return false;
+	}
+
+	const SimulatedRegionStats & firmware = report.regions[SIMULATED_REGION_FIRMWARE];
+	const SimulatedRegionStats & backup = report.regions[SIMULATED_REGION_BACKUP];
+	const SimulatedRegionStats & metadata = report.regions[SIMULATED_REGION_METADATA];
+
+	const uint64_t programCalls = firmware.programCalls + backup.programCalls + metadata.programCalls;
+	const uint64_t totalTime = report.eraseTime + report.programTime + report.decompressionTime - report.overlappedTime;
+
+	printf("Estimated update time: %.2f s\n", totalTime / 1000000.0);
+	printf("	Erasing: %.2f s\n", report.eraseTime / 1000000.0);
+	printf("	Programming (%llu calls, %llu saved by combining the writes): %.2f s\n", (unsigned long long) programCalls, (unsigned long long) report.savedProgramCalls, report.programTime / 1000000.0);
+	printf("	Decompressing %llu bytes: %.2f s\n", (unsigned long long) report.decompressedBytes, report.decompressionTime / 1000000.0);
+	if(report.overlappedTime != 0)
+		printf("	Decompressing during the erases: -%.2f s\n", report.overlappedTime / 1000000.0);
+
+	printf("Erase count: %llu\n", (unsigned long long) (firmware.erasedPages + backup.erasedPages + metadata.erasedPages));
+	printf("	Firmware: %llu erases, %llu writes\n", (unsigned long long) firmware.erasedPages, (unsigned long long) firmware.programmedUnits);
+	printf("	Cache backup: %llu erases, %llu writes\n", (unsigned long long) backup.erasedPages, (unsigned long long) backup.programmedUnits);
+	printf("	Metadata: %llu erases, %llu writes\n", (unsigned long long) metadata.erasedPages, (unsigned long long) metadata.programmedUnits);
+
+	return true;
+}
+
+bool runSchedulerWithFiles(const char * oldFile, const char * newFile, const char * output, vector<VerificationRange> & preUpdateHashes, bool printLog, bool dryRun, bool estimate, ValidationMode validation)
 {
 	if(oldFile == nullptr || newFile == nullptr || (output == nullptr && !dryRun))
 	{
@@ -90,15 +146,41 @@ bool runSchedulerWithFiles(const char * oldFile, const char * newFile, const cha
 	}
 
 	//Perform semantic validations
-	if(!validateSchedulerPatch(oldFileContent, oldFileSize, newFileContent, newFileSize, patch))
+	if(!validateSchedulerPatch(oldFileContent, oldFileSize, newFileContent, newFileSize, patch, validation))
 	{
 		cerr << "Couldn't validate the diff between the two images. Please open a bug report!" << endl;
 		retValue = false;
 		goto cleanup;
 	}
 
+	//The estimate runs the manifest the way it will be sent to the device, so we serialize it once for both
+	if(estimate)
+	{
+		vector<uint8_t> manifest;
+		if(!writeBSDiff(patch, manifest))
+		{
+			cerr << "Couldn't serialize the patch for the simulation" << endl;
+			retValue = false;
+			goto cleanup;
+		}
+
+		if(!estimatePatchCost(oldFileContent, oldFileSize, newFileContent, newFileSize, manifest))
+		{
+			retValue = false;
+			goto cleanup;
+		}
+
+		if(!dryRun)
+		{
+			FILE * outputFile = fopen(output, "wb");
+			retValue = outputFile != nullptr && fwrite(manifest.data(), 1, manifest.size(), outputFile) == manifest.size();
+			if(outputFile != nullptr)
+				fclose(outputFile);
+		}
+	}
+
 	//Restrict outputFile's scope
-	if(!dryRun)
+	else if(!dryRun)
 	{
 		FILE * outputFile = fopen(output, "wb");
 		retValue = outputFile != nullptr && writeBSDiff(patch, outputFile);
@@ -127,7 +209,7 @@ bool writeVerifRangeToFile(const vector<VerificationRange> & preUpdateHashes, co
 		return false;
 
 	for(const auto & range : preUpdateHashes)
-		fprintf(file, "%d, %d, %s\n", range.start, range.length, range.expectedHash.c_str());
+		fprintf(file, "%d, %d, %s\n", range.start, range.length, range.hexHash().c_str());
 
 	fclose(file);
 	return true;
@@ -137,6 +219,7 @@ bool processScheduler(int argc, char *argv[])
 {
 	int index = 1;
 	char * output = nullptr;
+	ValidationMode validation = VALIDATION_FULL;
 
 	if(argc > 1 && !strcmp(argv[1], "--batchMode"))
 	{
@@ -153,6 +236,24 @@ bool processScheduler(int argc, char *argv[])
 				output = argv[index + 1];
 				index += 1;
 			}
+			else if(!strncmp(argv[index], "--validate=", sizeof("--validate=") - 1))
+			{
+				if(!parseValidationMode(&argv[index][sizeof("--validate=") - 1], validation))
+				{
+					cerr << "Invalid validation mode: " << argv[index] << endl;
+					return false;
+				}
+			}
+			else if(!strcmp(argv[index], "--rangeOverhead") && index + 1 < argc)
+			{
+				_realVerificationRangeOverhead = static_cast<size_t>(atoi(argv[index + 1]));
+				index += 1;
+			}
+			else if(!strcmp(argv[index], "--compressionLevel") && index + 1 < argc)
+			{
+				_realCompressionLevel = static_cast<size_t>(atoi(argv[index + 1]));
+				index += 1;
+			}
 			else
 			{
 				cerr << "Invalid argument: " << argv[index] << endl;
@@ -166,12 +267,12 @@ bool processScheduler(int argc, char *argv[])
 			return false;
 		}
 
-		return processSchedulerBatch(config, output);
+		return processSchedulerBatch(config, output, validation);
 	}
 	else
 	{
 		const char * oldFile = nullptr, * newFile = nullptr;
-		bool wantLog = false, dryRun = false;
+		bool wantLog = false, dryRun = false, estimate = false;
 		while(index < argc)
 		{
 			if((!strcmp(argv[index], "--original") || !strcmp(argv[index], "-v1")) && index + 1 < argc)
@@ -194,6 +295,21 @@ bool processScheduler(int argc, char *argv[])
 				dryRun = true;
 				index += 1;
 			}
+			else if(!strcmp(argv[index], "--estimate"))
+			{
+				estimate = true;
+				index += 1;
+			}
+			else if(!strncmp(argv[index], "--validate=", sizeof("--validate=") - 1))
+			{
+				if(!parseValidationMode(&argv[index][sizeof("--validate=") - 1], validation))
+				{
+					cerr << "Invalid validation mode: " << argv[index] << endl;
+					return false;
+				}
+
+				index += 1;
+			}
 			else if(!strcmp(argv[index], "--verbose"))
 			{
 				wantLog = true;
@@ -220,6 +336,16 @@ bool processScheduler(int argc, char *argv[])
 				_realBlockSizeBit = static_cast<size_t>(atoi(argv[index + 1]));
 				index += 2;
 			}
+			else if(!strcmp(argv[index], "--rangeOverhead") && index + 1 < argc)
+			{
+				_realVerificationRangeOverhead = static_cast<size_t>(atoi(argv[index + 1]));
+				index += 2;
+			}
+			else if(!strcmp(argv[index], "--compressionLevel") && index + 1 < argc)
+			{
+				_realCompressionLevel = static_cast<size_t>(atoi(argv[index + 1]));
+				index += 2;
+			}
 			else
 			{
 				cerr << "Invalid argument: " << argv[index++] << endl;
@@ -228,7 +354,7 @@ bool processScheduler(int argc, char *argv[])
 
 		vector<VerificationRange> preUpdateHashes;
 
-		if(!runSchedulerWithFiles(oldFile, newFile, output, preUpdateHashes, wantLog, dryRun))
+		if(!runSchedulerWithFiles(oldFile, newFile, output, preUpdateHashes, wantLog, dryRun, estimate, validation))
 			return false;
 
 		if(dryRun)
@@ -35,9 +35,11 @@ void printAuthenticationHelp();
 bool processAuthentication(int argc, char *argv[]);
 
 #ifdef RAVENS_PUBLIC_COMMAND_H
-	bool runSchedulerWithFiles(const char * oldFile, const char * newFile, const char * output, std::vector<VerificationRange> & preUpdateHashes, bool printLog, bool dryRun);
-	bool processSchedulerBatch(const char * configFile, char * outputDir);
-	bool parseConfig(const char * configFile, bool wantManifests, std::vector<VersionData> & output, size_t & flashSize, size_t & flashPageSize);
+#ifdef RAVENS_VALIDATION_H
+	bool runSchedulerWithFiles(const char * oldFile, const char * newFile, const char * output, std::vector<VerificationRange> & preUpdateHashes, bool printLog, bool dryRun, bool estimate, ValidationMode validation);
+	bool processSchedulerBatch(const char * configFile, char * outputDir, ValidationMode validation);
+#endif
+	bool parseConfig(const char * configFile, bool wantManifests, std::vector<VersionData> & output, size_t & flashSize, size_t & flashPageSize, std::string * deviceName = nullptr);
 #endif
 
 bool canUseDir(char * dir);
@@ -104,6 +104,17 @@ void Encoder::encodeInstruction(const PublicCommand & command, uint8_t & bitLeng
 			break;
 		}
 
+		case MOVE_PAGES:
+		{
+			assert(numberOfBitsNecessary(command.length - 1) <= blockIDBits);
+
+			writeBits(OPCODE_MOVE_PAGES, INSTRUCTION_WIDTH, instruction, bitLength);
+			writeBits(extractBlockID(command.mainAddress), blockIDBits, instruction, bitLength);
+			writeBits(extractBlockID(command.secondaryAddress), blockIDBits, instruction, bitLength);
+			writeBits(command.length - 1, blockIDBits, instruction, bitLength);
+			break;
+		}
+
 		case COPY:
 		{
 			const bool isMainCache = command.mainAddress >= CACHE_ADDRESS;
@@ -184,13 +195,17 @@ void Encoder::encodeInstruction(const PublicCommand & command, uint8_t & bitLeng
 		}
 		case REBASE:
 		{
+			//The new base is encoded relative to the full address space
 			blockBase.value = 0;
+			blockIDBits = BLOCK_ID_SPACE;
+			const uint64_t newBase = extractBlockID(command.mainAddress);
+
 			blockIDBits = numberOfBitsNecessary(command.length);
 
 			assert(numberOfBitsNecessary(blockIDBits - 1u) <= REBASE_LENGTH_BITS);
 
 			writeBits(OPCODE_REBASE, INSTRUCTION_WIDTH, instruction, bitLength);
-			writeBits(extractBlockID(command.mainAddress), BLOCK_ID_SPACE, instruction, bitLength);
+			writeBits(newBase, BLOCK_ID_SPACE, instruction, bitLength);
 			writeBits(blockIDBits - 1u, REBASE_LENGTH_BITS, instruction, bitLength);
 
 			blockBase = command.mainAddress;
@@ -345,6 +360,11 @@ bool Encoder::_decodeInstruction(const uint8_t * byteStream, size_t & currentByt
 			command.command = REBASE;
 			break;
 		}
+		case OPCODE_MOVE_PAGES:
+		{
+			command.command = MOVE_PAGES;
+			break;
+		}
 		case OPCODE_COPY_NN:
 		case OPCODE_COPY_NC:
 		case OPCODE_COPY_CN:
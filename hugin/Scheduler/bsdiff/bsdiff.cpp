@@ -38,6 +38,7 @@ __FBSDID("$FreextraBufferSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c,v 1.1 2005/08/06
 #include <cassert>
 #include <climits>
 #include <iostream>
+#include <algorithm>
 
 #define BSDIFF_PRIVATE
 
@@ -258,75 +259,235 @@ void SchedulerPatch::compactBSDiff()
 	bsdiff = newBSDiff;
 }
 
-bool writeBSDiff(const SchedulerPatch & patch, void * output)
+//Buffers the payload in front of the compressor, which output is sent straight to the sink
+class BSDiffSerializer
 {
-	size_t length;
-	uint8_t * encodedCommands = nullptr;
-	Encoder encoder;
-	encoder.encode(patch.commands, encodedCommands, length);
+	lzfx_stream stream{};
+	uint8_t buffer[4096]{};
+	size_t bufferLength = 0;
+	bool failed;
 
-	if(encodedCommands == nullptr)
-		return false;
+	lzfx_sink sink;
+	void * sinkContext;
+	size_t compressedLength = 0;
 
-	if(fwrite(encodedCommands, length, 1, (FILE *) output) != 1)
+	static int forwardToSink(void * context, const void * data, size_t length)
 	{
-		free(encodedCommands);
-		return false;
+		auto * serializer = (BSDiffSerializer *) context;
+
+		serializer->compressedLength += length;
+		return serializer->sink(serializer->sinkContext, data, length);
 	}
-	free(encodedCommands);
 
-	//Write the magic value
-	const uint32_t bsdiffMagicValue = BSDIFF_MAGIC;
-	if(fwrite(&bsdiffMagicValue, 1, sizeof(uint32_t), (FILE*) output) != sizeof(uint32_t))
-		return false;
+	void flush()
+	{
+		if(!failed && bufferLength)
+			failed = lzfx_stream_write(&stream, buffer, bufferLength) != 0;
 
-	//Write the offset
-	if(fwrite(&patch.startAddress, 1, sizeof(uint32_t), (FILE*) output) != sizeof(uint32_t))
-		return false;
+		bufferLength = 0;
+	}
 
-	size_t fullUncompressedLength = sizeof(uint32_t) + sizeof(uint16_t);	//Number of BSDiff segments and number of validation ranges
+public:
+	BSDiffSerializer(lzfx_sink sink, void * sinkContext) : sink(sink), sinkContext(sinkContext)
+	{
+		failed = lzfx_stream_init(&stream, COMPRESSION_LEVEL, forwardToSink, this) != 0;
+	}
 
-	for(const auto & command : patch.bsdiff)
+	BSDiffSerializer(const BSDiffSerializer &) = delete;
+	BSDiffSerializer & operator=(const BSDiffSerializer &) = delete;
+
+	~BSDiffSerializer()
 	{
-		assert(command.delta.length > 0 && command.delta.length < UINT32_MAX);
-		assert(command.extra.length < UINT32_MAX);
+		lzfx_stream_free(&stream);
+	}
+
+	void write(uint8_t byte)
+	{
+		if(bufferLength == sizeof(buffer))
+			flush();
 
-		fullUncompressedLength += 2 * sizeof(uint32_t) + command.delta.length + command.extra.length;
+		buffer[bufferLength++] = byte;
 	}
 
-	//Add the space necessary for validation
-	fullUncompressedLength += patch.newRanges.size() * sizeof(UpdateFinalHash);
+	void write(const uint8_t * data, size_t length)
+	{
+		if(bufferLength + length <= sizeof(buffer))
+		{
+			memcpy(&buffer[bufferLength], data, length);
+			bufferLength += length;
+			return;
+		}
 
-	auto * uncompressedBuffer = (uint8_t*) malloc(fullUncompressedLength);
-	if(uncompressedBuffer == nullptr)
-		return false;
+		flush();
+
+		if(!failed)
+			failed = lzfx_stream_write(&stream, data, length) != 0;
+	}
+
+	void writeWord(uint32_t value)
+	{
+		uint8_t word[sizeof(uint32_t)];
+		offtout(value, word);
+		write(word, sizeof(word));
+	}
+
+	//The data written afterwards can be decompressed without what came before. Returns the offset of this point in the compressed stream
+	size_t restart()
+	{
+		flush();
+
+		if(!failed)
+			failed = lzfx_stream_restart(&stream) != 0;
+
+		return compressedLength;
+	}
+
+	bool finish()
+	{
+		flush();
+
+		if(!failed)
+			failed = lzfx_stream_finish(&stream) != 0;
+
+		return !failed;
+	}
+};
+
+//Thumb BL pairs are 11110 S imm10 / 11J11 imm11, the immediate being relative to the instruction address + 4
+static bool isThumbBranch(const uint8_t * instruction)
+{
+	return (instruction[1] & 0xF8u) == 0xF0u && (instruction[3] & 0xF8u) == 0xF8u;
+}
+
+//Make the branches absolute so that the calls to a function that moved all change in the same way
+//	The branches straddling two pages are left alone, as Munin may start decoding from the second one
+static void writeThumbFiltered(const uint8_t * data, size_t length, size_t address, BSDiffSerializer & output)
+{
+	size_t offset = 0;
+
+	//Must stay in sync with consumeExtraByte in Munin
+	while(offset < length)
+	{
+		if(((address + offset) & 1u) == 0 && offset + 4 <= length && ((address + offset) & BLOCK_OFFSET_MASK) <= BLOCK_SIZE - 4)
+		{
+			const uint8_t * instruction = &data[offset];
+
+			if(isThumbBranch(instruction))
+			{
+				uint32_t value = ((instruction[1] & 0x7u) << 19u) | (instruction[0] << 11u) | ((instruction[3] & 0x7u) << 8u) | instruction[2];
+				value = ((value << 1u) + (uint32_t) (address + offset + 4)) >> 1u;
+
+				output.write((uint8_t) (value >> 11u));
+				output.write((uint8_t) (0xF0u | ((value >> 19u) & 0x7u)));
+				output.write((uint8_t) value);
+				output.write((uint8_t) (0xF8u | ((value >> 8u) & 0x7u)));
+
+				offset += 4;
+			}
+			else
+			{
+				output.write(instruction, 2);
+				offset += 2;
+			}
+		}
+		else
+			output.write(data[offset++]);
+	}
+}
+
+//Delta data is mostly made of zeros: each zero is followed by the number of zeros following it (up to 255)
+static void writeZeroRunEncoded(const uint8_t * data, size_t length, BSDiffSerializer & output)
+{
+	for(size_t offset = 0; offset < length;)
+	{
+		output.write(data[offset]);
+
+		if(data[offset++] == 0)
+		{
+			uint8_t run = 0;
+			while(offset < length && data[offset] == 0 && run < UINT8_MAX)
+			{
+				offset += 1;
+				run += 1;
+			}
+
+			output.write(run);
+		}
+	}
+}
+
+static bool serializeBSDiff(const SchedulerPatch & patch, uint8_t filters, bool seekable, lzfx_sink sink, void * sinkContext, vector<BSDiffSeekPoint> & seekPoints)
+{
+	BSDiffSerializer output(sink, sinkContext);
+	const size_t startAddress = patch.startAddress << BLOCK_SIZE_BIT, seekInterval = BSDIFF_SEEK_INTERVAL * BLOCK_SIZE;
+	size_t currentAddress = startAddress, nextSeekAddress = seekable ? startAddress + seekInterval : SIZE_MAX;
+
+	seekPoints.clear();
+
+	output.write(filters);
 
 	assert(patch.bsdiff.size() < UINT32_MAX);
+	output.writeWord(static_cast<uint32_t>(patch.bsdiff.size()));
 
-	//Copy the number of segments
-	*((uint32_t*) uncompressedBuffer) = static_cast<uint32_t>(patch.bsdiff.size());
+	//Records the state Munin will be in when it starts patching the page at currentAddress
+	const auto addSeekPoint = [&](size_t segment, bool didDelta, size_t segmentOffset, size_t subsegmentLength)
+	{
+		BSDiffSeekPoint point{};
 
-	size_t index = sizeof(uint32_t);
-	for(const auto & command : patch.bsdiff)
+		point.page = static_cast<uint32_t>((currentAddress - startAddress) >> BLOCK_SIZE_BIT);
+		point.inputOffset = static_cast<uint32_t>(output.restart());
+		point.segment = static_cast<uint32_t>(segment);
+		point.segmentOffset = static_cast<uint32_t>(segmentOffset);
+		point.subsegmentLength = static_cast<uint32_t>(subsegmentLength);
+		point.didDelta = didDelta;
+
+		seekPoints.push_back(point);
+		nextSeekAddress += seekInterval;
+	};
+
+	const auto writeSubsegment = [&](size_t segment, bool didDelta, const uint8_t * data, size_t length)
 	{
-		offtout(static_cast<uint32_t>(command.delta.length), &uncompressedBuffer[index]);
-		index += sizeof(uint32_t);
+		//The lengths are always the ones of the unfiltered data
+		output.writeWord(static_cast<uint32_t>(length));
+
+		//Munin reads the length of a subsegment as soon as the previous one is over, before moving to the next page
+		if(currentAddress == nextSeekAddress)
+			addSeekPoint(segment, didDelta, 0, length);
+
+		//A zero run can't be carried over a seek point, so the data is cut there
+		for(size_t offset = 0; offset < length;)
+		{
+			const size_t chunk = min(length - offset, nextSeekAddress - currentAddress);
+
+			if(!didDelta && filters & BSDIFF_FILTER_ZERO_RUN)
+				writeZeroRunEncoded(&data[offset], chunk, output);
+			else if(didDelta && filters & BSDIFF_FILTER_THUMB_BRANCH)
+				writeThumbFiltered(&data[offset], chunk, currentAddress, output);
+			else
+				output.write(&data[offset], chunk);
+
+			offset += chunk;
+			currentAddress += chunk;
+
+			if(offset < length && currentAddress == nextSeekAddress)
+				addSeekPoint(segment, didDelta, offset, length);
+		}
+	};
 
-		memcpy(&uncompressedBuffer[index], command.delta.data, command.delta.length);
-		index += command.delta.length;
+	for(size_t segment = 0; segment < patch.bsdiff.size(); ++segment)
+	{
+		const auto & command = patch.bsdiff[segment];
 
-		offtout(static_cast<uint32_t>(command.extra.length), &uncompressedBuffer[index]);
-		index += sizeof(uint32_t);
+		assert(command.delta.length > 0 && command.delta.length < UINT32_MAX);
+		assert(command.extra.length < UINT32_MAX);
 
-		memcpy(&uncompressedBuffer[index], command.extra.data, command.extra.length);
-		index += command.extra.length;
+		writeSubsegment(segment, false, command.delta.data, command.delta.length);
+		writeSubsegment(segment, true, command.extra.data, command.extra.length);
 	}
 
-	uint16_t * newRangesCounter = (uint16_t *) &uncompressedBuffer[index];
-	index += sizeof(uint16_t);
-	
 	assert(patch.newRanges.size() < UINT16_MAX);
-	*newRangesCounter = static_cast<uint16_t>(patch.newRanges.size());
+	const auto numberRanges = static_cast<uint16_t>(patch.newRanges.size());
+	output.write((const uint8_t *) &numberRanges, sizeof(numberRanges));
 
 	//Copy the ranges the bootloader need to verify
 	for(const auto & range : patch.newRanges)
@@ -336,43 +497,143 @@ bool writeBSDiff(const SchedulerPatch & patch, void * output)
 		verif.start = range.start;
 		verif.length = range.length;
 
-		if(hydro_hex2bin(verif.hash, sizeof(verif.hash), range.expectedHash.c_str(), range.expectedHash.size(), nullptr, nullptr) == sizeof(verif.hash))
-		{
-			memcpy(&uncompressedBuffer[index], &verif, sizeof(verif));
-			index += sizeof(verif);
-		}
-		else
+		static_assert(sizeof(verif.hash) == sizeof(range.expectedHash), "Hash length mismatch");
+		memcpy(verif.hash, range.expectedHash, sizeof(verif.hash));
+
+		output.write((const uint8_t *) &verif, sizeof(verif));
+	}
+
+	return output.finish();
+}
+
+//Munin backs a page up before patching it only if a delta applies to it, or if the payload ends in its middle, as the old data then completes it
+static vector<uint8_t> pagesNeedingOldContent(const SchedulerPatch & patch, uint32_t & numberPages)
+{
+	vector<uint8_t> bitmap;
+	size_t address = 0;
+
+	const auto markPages = [&bitmap](size_t start, size_t length)
+	{
+		for(size_t page = start >> BLOCK_SIZE_BIT; page <= (start + length - 1) >> BLOCK_SIZE_BIT; ++page)
 		{
-			std::cerr << "[WARNING]: Skipping range starting at 0x" << std::hex << range.start << " of length 0x" << range.length << " due to libHydrogen's hydro_hex2bin failing on " << std::dec << range.expectedHash.c_str() << std::endl;
-			assert(*newRangesCounter > 0);
-			*newRangesCounter -= 1;
+			if(bitmap.size() <= page / 8)
+				bitmap.resize(page / 8 + 1);
+
+			bitmap[page / 8] |= 1u << (page % 8);
 		}
-	}
+	};
 
-	size_t compressedLength = fullUncompressedLength + 200;
-	auto * compressedBuffer = (uint8_t*) malloc(compressedLength);
-	if(compressedBuffer == nullptr)
+	for(const auto & command : patch.bsdiff)
 	{
-		free(uncompressedBuffer);
-		return false;
+		markPages(address, command.delta.length);
+		address += command.delta.length + command.extra.length;
 	}
 
-	int retValue = lzfx_compress(uncompressedBuffer, index - 1, compressedBuffer, &compressedLength);
+	if(address & BLOCK_OFFSET_MASK)
+		markPages(address, 1);
+
+	assert(((address + BLOCK_SIZE - 1) >> BLOCK_SIZE_BIT) < UINT32_MAX);
+	numberPages = static_cast<uint32_t>((address + BLOCK_SIZE - 1) >> BLOCK_SIZE_BIT);
+	bitmap.resize((numberPages + 7) / 8);
+
+	return bitmap;
+}
+
+static int countingSink(void * context, const void *, size_t length)
+{
+	*(size_t *) context += length;
+	return 0;
+}
+
+static int fileSink(void * context, const void * data, size_t length)
+{
+	return fwrite(data, length, 1, (FILE *) context) == 1 ? 0 : -1;
+}
+
+static int bufferSink(void * context, const void * data, size_t length)
+{
+	auto & buffer = *(vector<uint8_t> *) context;
+	buffer.insert(buffer.end(), (const uint8_t *) data, (const uint8_t *) data + length);
+	return 0;
+}
+
+static bool writeBSDiff(const SchedulerPatch & patch, lzfx_sink sink, void * sinkContext)
+{
+	size_t length;
+	uint8_t * encodedCommands = nullptr;
+	Encoder encoder;
+	encoder.encode(patch.commands, encodedCommands, length);
 
-	free(uncompressedBuffer);
+	if(encodedCommands == nullptr)
+		return false;
 
-	if(retValue != 0)
+	if(sink(sinkContext, encodedCommands, length) != 0)
 	{
-		free(compressedBuffer);
+		free(encodedCommands);
 		return false;
 	}
+	free(encodedCommands);
+
+	//Large payloads get points Munin can resume from, instead of replaying everything before
+	size_t payloadLength = 0;
+	for(const auto & command : patch.bsdiff)
+		payloadLength += command.delta.length + command.extra.length;
 
-	if(fwrite(compressedBuffer, compressedLength, 1, (FILE*) output) != 1)
+	const bool seekable = payloadLength > BSDIFF_SEEK_INTERVAL * BLOCK_SIZE;
+
+	//The filters only pay off on some payloads, so we measure every combination before streaming the smallest to the output
+	uint8_t bestFilters = 0;
+	size_t bestLength = SIZE_MAX;
+	vector<BSDiffSeekPoint> seekPoints;
+
+	for(uint8_t filters = 0; filters <= (BSDIFF_FILTER_ZERO_RUN | BSDIFF_FILTER_THUMB_BRANCH); ++filters)
 	{
-		free(compressedBuffer);
-		return false;
+		size_t compressedLength = 0;
+		vector<BSDiffSeekPoint> candidateSeekPoints;
+
+		if(!serializeBSDiff(patch, filters, seekable, countingSink, &compressedLength, candidateSeekPoints))
+			return false;
+
+		if(compressedLength < bestLength)
+		{
+			bestLength = compressedLength;
+			bestFilters = filters;
+			seekPoints = candidateSeekPoints;
+		}
 	}
 
-	free(compressedBuffer);
-	return true;
+	//Write the magic value
+	const uint32_t bsdiffMagicValue = BSDIFF_INDEXED_MAGIC;
+	if(sink(sinkContext, &bsdiffMagicValue, sizeof(uint32_t)) != 0)
+		return false;
+
+	//Write the offset
+	if(sink(sinkContext, &patch.startAddress, sizeof(uint32_t)) != 0)
+		return false;
+
+	//The index is needed before decompressing anything, so it is left uncompressed
+	const auto numberSeekPoints = static_cast<uint32_t>(seekPoints.size());
+	if(sink(sinkContext, &numberSeekPoints, sizeof(uint32_t)) != 0
+	   || (numberSeekPoints && sink(sinkContext, seekPoints.data(), numberSeekPoints * sizeof(BSDiffSeekPoint)) != 0))
+		return false;
+
+	uint32_t numberPages;
+	const vector<uint8_t> oldContentNeeded = pagesNeedingOldContent(patch, numberPages);
+	if(sink(sinkContext, &numberPages, sizeof(uint32_t)) != 0
+	   || (!oldContentNeeded.empty() && sink(sinkContext, oldContentNeeded.data(), oldContentNeeded.size()) != 0))
+		return false;
+
+	//The compression being deterministic, this pass lands on the same seek points
+	return serializeBSDiff(patch, bestFilters, seekable, sink, sinkContext, seekPoints);
+}
+
+bool writeBSDiff(const SchedulerPatch & patch, void * output)
+{
+	return writeBSDiff(patch, fileSink, output);
+}
+
+bool writeBSDiff(const SchedulerPatch & patch, vector<uint8_t> & output)
+{
+	output.clear();
+	return writeBSDiff(patch, bufferSink, &output);
 }
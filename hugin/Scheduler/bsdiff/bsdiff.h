@@ -42,6 +42,7 @@ extern "C" uint8_t * readFile(const char * file, size_t * fileSize);
 	void bsdiff(const char * oldFile, const char * newFile, std::vector<BSDiffPatch> & patch);
 	void bsdiff(const uint8_t * old, size_t oldSize, const uint8_t * newer, size_t newSize, std::vector<BSDiffPatch> & patch);
 	bool writeBSDiff(const SchedulerPatch & patch, void * output);
+	bool writeBSDiff(const SchedulerPatch & patch, std::vector<uint8_t> & output);
 
 	bool validateBSDiff(const uint8_t * original, size_t originalLength, const uint8_t * newer, size_t newLength, const std::vector<BSDiffPatch> & patch, size_t earlySkip);
 #endif
@@ -64,12 +64,30 @@
 //BSDiff delta removal threshold, in order to save on unecessary instructions
 #define BSDIFF_DELTA_REMOVAL_THRESHOLD 10
 
+//Pages between two points the BSDiff decompression can restart from, so that Munin doesn't have to replay the whole payload when resuming
+//	Each point makes the compressor forget its 4 KiB of history, and costs a BSDiffSeekPoint
+#define BSDIFF_SEEK_INTERVAL 16u
+
 //Encoder related config
 #define FLASH_SIZE_BIT_DEFAULT	20u		//How many bits should be used to encode addresses
 #define BLOCK_SIZE_BIT_DEFAULT	12u		// 4096, 0x1000
 
+//Cost of an extra verification range, expressed as the number of bytes the device could hash instead
+//	Each range costs the device a SHA-256 finalization and the server 38 bytes of request and response
+//	Gaps between the ranges read by the update smaller than that are hashed rather than split in two ranges
+#define VERIFICATION_RANGE_OVERHEAD_DEFAULT	256u
+
+//lzfx effort used to compress the BSDiff payload, from LZFX_LEVEL_FAST (1) to LZFX_LEVEL_MAX (9)
+//	Anything above 1 uses optimal parsing, the output remains readable by Munin
+#define COMPRESSION_LEVEL_DEFAULT	9u
+
 extern size_t _realBlockSizeBit;
 extern size_t _realFullAddressSpace;
+extern size_t _realVerificationRangeOverhead;
+extern size_t _realCompressionLevel;
+
+#define VERIFICATION_RANGE_OVERHEAD _realVerificationRangeOverhead
+#define COMPRESSION_LEVEL ((int) _realCompressionLevel)
 
 #define BLOCK_SIZE_BIT ((const uint8_t) _realBlockSizeBit)
 #define FLASH_SIZE_BIT ((const uint8_t) _realFullAddressSpace)
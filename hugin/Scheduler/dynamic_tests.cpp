@@ -13,13 +13,16 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <random>
 #include <vector>
 
 #include "public_command.h"
 #include "bsdiff/bsdiff.h"
 #include "Encoding/encoder.h"
 #include "validation.h"
+#include "../../munin/integration/drivers/Host/flash_simulator.h"
 
 using namespace std;
 
@@ -47,6 +50,14 @@ bool runDynamicTest(const uint8_t * original, size_t originalLength, const uint8
 			goto cleanup;
 		}
 
+		//The fast validation must reach the same conclusion
+		if(!validateSchedulerPatch(original, originalLength, newer, newLength, patch, VALIDATION_FAST))
+		{
+			cerr << "Fast validation rejected a valid patch!" << endl;
+			output = false;
+			goto cleanup;
+		}
+
 		//We can then generate the real file
 		FILE *file = tmpfile();
 		if(file == nullptr)
@@ -130,3 +141,110 @@ bool runDynamicTestWithFiles(const char * original, const char * newFile)
 
 	return output;
 }
+
+//Moves chunks of the old image around, which goes through the cache, then edits a few bytes left to the BSDiff
+static void generatePowerCutScenario(uint32_t seed, size_t pages, vector<uint8_t> & original, vector<uint8_t> & newer)
+{
+	minstd_rand generator(seed);
+
+	original.resize(pages * BLOCK_SIZE);
+	for(auto & byte : original)
+		byte = static_cast<uint8_t>(generator() >> 8u);
+
+	newer = original;
+
+	for(size_t moves = 1 + generator() % 6; moves > 0; --moves)
+	{
+		const size_t length = 200 + generator() % 2800;
+		const size_t source = generator() % (original.size() - length);
+		const size_t destination = generator() % (original.size() - length);
+
+		memcpy(&newer[destination], &original[source], length);
+	}
+
+	for(size_t edits = 1 + generator() % 40; edits > 0; --edits)
+		newer[generator() % newer.size()] = static_cast<uint8_t>(generator() >> 8u);
+}
+
+/*
+ * Cut the power before every flash operation of the update, resume it and check the result.
+ * The updates mix commands and a BSDiff, so that the cuts cross from one to the other.
+ */
+
+bool runPowerCutTest()
+{
+	_realFullAddressSpace = simulatedFlashSizeBit();
+	if(BLOCK_SIZE_BIT != simulatedBlockSizeBit())
+	{
+		cout << "The simulator doesn't support the page size, skipping the power loss test" << endl;
+		return true;
+	}
+
+	//Among them, some skip the backup of a clean cache right before the BSDiff starts
+	static const uint32_t seeds[] = {19, 48, 104, 252};
+	uint64_t numberCuts = 0;
+
+	//Munin polls the flash instead of blocking when it erases in the background
+	const FlashTimingModel defaultTiming = simulatedTimingModel();
+	for(const bool backgroundErase : {false, true})
+	{
+		FlashTimingModel timing = defaultTiming;
+		timing.backgroundErase = backgroundErase;
+		setSimulatedTimingModel(&timing);
+
+		for(const uint32_t seed : seeds)
+		{
+			vector<uint8_t> original, newer, manifest;
+			generatePowerCutScenario(seed, 4 + seed % 5, original, newer);
+
+			SchedulerPatch patch;
+			if(!generatePatch(original.data(), original.size(), newer.data(), newer.size(), patch, false) || !writeBSDiff(patch, manifest))
+			{
+				cerr << "Couldn't generate the update of the power loss scenario " << seed << endl;
+				return false;
+			}
+
+			patch.clear(true);
+
+			FlashSimulatorReport report{};
+			if(!simulateUpdate(original.data(), original.size(), manifest.data(), manifest.size(), &report))
+			{
+				cerr << "The update of the power loss scenario " << seed << " failed" << endl;
+				return false;
+			}
+
+			//A truncated manifest must be rejected, not leave Munin waiting on data that will never come
+			for(const size_t truncatedLength : {manifest.size() / 2, 3 * manifest.size() / 4, manifest.size() - 16, manifest.size() - 1})
+			{
+				if(simulateUpdate(original.data(), original.size(), manifest.data(), truncatedLength, nullptr))
+				{
+					cerr << "The update of the power loss scenario " << seed << " accepted a manifest truncated to " << truncatedLength << " bytes" << endl;
+					return false;
+				}
+			}
+
+			uint64_t operations = 0;
+			for(const auto & region : report.regions)
+				operations += region.erasedPages + region.programCalls;
+
+			for(uint64_t cut = 0; cut < operations; ++cut, ++numberCuts)
+			{
+				if(!simulateUpdateUntilPowerCut(original.data(), original.size(), manifest.data(), manifest.size(), cut))
+				{
+					cerr << "The update of the power loss scenario " << seed << " completed before the operation " << cut << endl;
+					return false;
+				}
+
+				if(!resumeSimulatedUpdate(manifest.data(), manifest.size()) || memcmp(simulatedFlash(), newer.data(), newer.size()) != 0)
+				{
+					cerr << "The update of the power loss scenario " << seed << " didn't recover from a power loss before the operation " << cut << endl;
+					return false;
+				}
+			}
+		}
+	}
+
+	setSimulatedTimingModel(&defaultTiming);
+	cout << "Power loss test successful (" << numberCuts << " cuts)" << endl;
+	return true;
+}
@@ -24,6 +24,12 @@ enum INSTR
 
 	LOAD_AND_FLUSH,
 
+	/*
+	 * Erase then copy full pages, one after the other: mainAddress is the first source page, secondaryAddress the first destination page and length the number of pages
+	 * This let us encode layout shuffles without a pair of ERASE/COPY per page and without backing up the cache before every erase
+	 */
+	MOVE_PAGES,
+
 	COPY,
 	CHAINED_COPY,
 	CHAINED_COPY_SKIP,
@@ -86,10 +92,14 @@ struct VerificationRange
 	uint32_t start;
 	uint16_t length;
 
-	std::string expectedHash;
+	//Raw SHA-256 of the range, only converted to hex when written to a text format
+	uint8_t expectedHash[32];
 
 	VerificationRange(uint32_t _start, uint16_t _length) : start(_start), length(_length), expectedHash() {}
 
+	std::string hexHash() const;
+	bool setHashFromHex(const char * hex, size_t hexLength);
+
 	static const size_t maxLength = (1u << (sizeof(VerificationRange::length) * 8)) - 1;
 };
 
@@ -128,7 +138,8 @@ void schedule(const std::vector<BSDiffMoves> & input, std::vector<PublicCommand>
 bool generatePatch(const uint8_t *original, size_t originalLength, const uint8_t *newer, size_t newLength, SchedulerPatch &outputPatch, bool printStats);
 
 bool runDynamicTestWithFiles(const char * original, const char * newFile);
-bool virtualMachine(const std::vector<PublicCommand> & commands, uint8_t * flash, size_t flashLength);
+bool runPowerCutTest();
+bool virtualMachine(const std::vector<PublicCommand> & commands, uint8_t * flash, size_t flashLength, std::vector<bool> * dirtyPages = nullptr);
 
 void dumpCommands(const std::vector<PublicCommand> & commands, const char *path = nullptr);
 
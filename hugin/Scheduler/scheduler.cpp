@@ -16,6 +16,8 @@
 
 size_t _realBlockSizeBit = BLOCK_SIZE_BIT_DEFAULT;
 size_t _realFullAddressSpace = FLASH_SIZE_BIT_DEFAULT;
+size_t _realVerificationRangeOverhead = VERIFICATION_RANGE_OVERHEAD_DEFAULT;
+size_t _realCompressionLevel = COMPRESSION_LEVEL_DEFAULT;
 
 void schedule(const vector<BSDiffMoves> & input, vector<PublicCommand> & output, bool printStats)
 {
@@ -33,6 +35,8 @@ void schedule(const vector<BSDiffMoves> & input, vector<PublicCommand> & output,
 
 	Scheduler::removeUnidirectionnalReferences(blockStructure, scheduler);
 
+	Scheduler::removePagePermutations(blockStructure, scheduler);
+
 	Scheduler::removeNetworks(blockStructure, scheduler);
 
 	scheduler.generateInstructions(output);
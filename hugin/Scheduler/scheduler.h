@@ -68,6 +68,11 @@ struct Command
 		assert(command == FLUSH_AND_PARTIAL_COMMIT || command == REBASE);
 	}
 
+	Command(INSTR _command, const BlockID &sourceBlock, const BlockID &destBlock, size_t numberOfPages) : command(_command), mainBlock(sourceBlock), mainBlockOffset(0), length(numberOfPages), secondaryBlock(destBlock), secondaryOffset(0), transactionID(0)
+	{
+		assert(command == MOVE_PAGES);
+	}
+
 	Command(INSTR _command, const BlockID &coreBlock, size_t coreBlockOffset, size_t length, const BlockID &secBlock, size_t secBlockOffset)
 			: command(_command), mainBlock(coreBlock), mainBlockOffset(coreBlockOffset),  length(length), secondaryBlock(secBlock), secondaryOffset(secBlockOffset), transactionID(0)
 	{
@@ -128,6 +133,15 @@ struct Command
 				fprintf(file, "{FLUSH_AND_PARTIAL_COMMIT, 0x%x, 0x%x},\n", static_cast<unsigned int>(mainBlock.value), static_cast<unsigned  int>(length));
 #else
 				fprintf(file, "Wipping 0x%x then writting TMP (0x%x)\n", static_cast<unsigned int>(mainBlock.value | mainBlockOffset), static_cast<unsigned int>(CACHE_BUF.getAddress()));
+#endif
+				break;
+			}
+			case MOVE_PAGES:
+			{
+#ifdef PRINT_REAL_INSTRUCTIONS
+				fprintf(file, "{MOVE_PAGES, 0x%x, 0x%x, 0x%x},\n", static_cast<unsigned int>(mainBlock.value), static_cast<unsigned int>(secondaryBlock.value), static_cast<unsigned int>(length));
+#else
+				fprintf(file, "Moving %zu pages from 0x%x to 0x%x\n", length, static_cast<unsigned int>(mainBlock.value), static_cast<unsigned int>(secondaryBlock.value));
 #endif
 				break;
 			}
@@ -235,6 +249,19 @@ struct Command
 			   && mainBlock != CACHE_BUF && secondaryBlock == CACHE_BUF;
 	}
 
+	bool isFullPageCopy() const
+	{
+		return command == COPY && length == BLOCK_SIZE
+			   && mainBlockOffset == 0 && secondaryOffset == 0
+			   && mainBlock != CACHE_BUF && secondaryBlock != CACHE_BUF;
+	}
+
+	bool canAppendPageMove(const Command & next) const
+	{
+		return command == MOVE_PAGES && next.command == MOVE_PAGES
+			   && mainBlock + length == next.mainBlock && secondaryBlock + length == next.secondaryBlock;
+	}
+
 	bool isCommitLike() const
 	{
 		return command == COMMIT || command == FLUSH_AND_PARTIAL_COMMIT;
@@ -378,6 +405,7 @@ namespace Scheduler
 	//Passes
 	void removeSelfReferencesOnly(vector <Block> & blocks, SchedulerData & commands);
 	void removeUnidirectionnalReferences(vector<Block> & blocks, SchedulerData & commands);
+	void removePagePermutations(vector<Block> & blocks, SchedulerData & commands);
 	void removeNetworks(vector<Block> & blocks, SchedulerData & commands);
 
 	typedef function<void(const BlockID&, bool, VirtualMemory&, SchedulerData&)> PerformCopy;
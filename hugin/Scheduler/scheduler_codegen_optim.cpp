@@ -84,6 +84,33 @@ void SchedulerData::insertCommand(Command command)
 		if(command.isEraseLike() && prev.isEraseLike(true))
 			assert(command.mainBlock == prev.mainBlock);
 
+		//ERASE followed by a full page copy to the erased page is a page move
+		if(command.isFullPageCopy() && prev.command == ERASE && prev.mainBlock == command.secondaryBlock)
+		{
+			Command move(MOVE_PAGES, command.mainBlock, command.secondaryBlock, 1);
+
+			//We reinsert the move so it can be merged with a previous one
+			if(&prev == &commands.back())
+			{
+				commands.pop_back();
+				insertCommand(move);
+			}
+			else
+			{
+				move.transactionID = prev.transactionID;
+				prev = move;
+			}
+
+			return;
+		}
+
+		//Consecutive page moves are merged, as long as no REBASE separate them
+		else if(&prev == &commands.back() && prev.canAppendPageMove(command))
+		{
+			prev.length += command.length;
+			return;
+		}
+
 		//Do we really need to insert a new command?
 		if(prev.mainBlock == command.mainBlock)
 		{
@@ -323,6 +350,22 @@ void SchedulerData::addUseBlocks()
 				break;
 			}
 
+			case MOVE_PAGES:
+			{
+				//Both BlockIDs are always encoded, but we need to be part of a section in order to be copied to newCommands
+				if(!hasBlockChain)
+				{
+					startChain = iter;
+					isStart = false;
+					hasBlockChain = true;
+					blockChain = iter->secondaryBlock;
+					instructionIgnore = 0;
+				}
+
+				instructionIgnore += 1;
+				break;
+			}
+
 				//Aren't supposed to exist at this point
 			case END_OF_STREAM:
 			case USE_BLOCK:
@@ -385,6 +428,21 @@ void SchedulerData::updateLastRebase()
 				break;
 			}
 
+			//Both ranges of pages must fit in the REBASE
+			case MOVE_PAGES:
+			{
+				const BlockID lowestBlock = MIN(iter->mainBlock, iter->secondaryBlock);
+				const BlockID highestBlock = MAX(iter->mainBlock, iter->secondaryBlock) + (iter->length - 1);
+
+				if(lowestBlock < smallestBlock)
+					smallestBlock = lowestBlock;
+
+				if(highestBlock > largestBlock)
+					largestBlock = highestBlock;
+
+				break;
+			}
+
 			case REBASE:
 			{
 				//Configure the new rebase
@@ -419,7 +477,7 @@ void SchedulerData::updateLastRebase()
 						{
 							//Merge both REBASE if that wouldn't use an additional bit to store BlockID
 							BlockID min = MIN(iter->mainBlock, newIter->mainBlock);
-							BlockID max = MAX(iter->mainBlock + (iter->length - 1), newIter->mainBlock + (newIter->length - 1));
+							BlockID max = MAX(iter->mainBlock + iter->length, newIter->mainBlock + newIter->length);
 							size_t necessaryLength = (max.value - min.value) >> BLOCK_SIZE_BIT;
 
 							if(numberOfBitsNecessary(iter->length) == numberOfBitsNecessary(necessaryLength))
@@ -95,6 +95,82 @@ namespace Scheduler
 		commands.updateLastRebase();
 	}
 
+	static bool isPageMove(const Block & block)
+	{
+		if(block.blockNeedSwap || block.data.size() != 1)
+			return false;
+
+		const Token & token = block.data.front();
+		return token.length == BLOCK_SIZE && token.origin.getOffset() == 0 && token.finalAddress.getOffset() == 0 && token.origin.getBlock() != block.blockID;
+	}
+
+	void removePagePermutations(vector<Block> & blocks, SchedulerData & commands)
+	{
+		//Layout shuffles generate cycles of pages moved as a whole (A <- B <- C <- A)
+		//	They can be resolved with a single load to the cache followed by page moves, instead of going through the network solver
+		const size_t length = blocks.size();
+		vector<size_t> cycle;
+
+		for(size_t i = 0; i < length; ++i)
+		{
+			if(blocks[i].blockFinished || !isPageMove(blocks[i]))
+				continue;
+
+			//We follow the data until we either get back to the first block, or meet a block that isn't exclusively part of the cycle
+			cycle.clear();
+			size_t current = i;
+			bool isCycle = false;
+
+			do
+			{
+				cycle.push_back(current);
+
+				const BlockID origin = blocks[current].data.front().origin;
+				const size_t next = indexOfBlockID(blocks, origin);
+				if(next >= length || blocks[next].blockID != origin || blocks[next].blockFinished || !isPageMove(blocks[next]))
+					break;
+
+				//The page we're about to overwrite must only be read by the previous block of the cycle
+				const auto & requesters = blocks[next].blocksRequestingData;
+				if(find_if(requesters.begin(), requesters.end(), [&](const BlockLink & link) { return link != blocks[current].blockID; }) != requesters.end())
+					break;
+
+				isCycle = next == i;
+				current = next;
+
+			} while(!isCycle && cycle.size() < length);
+
+			if(!isCycle)
+				continue;
+
+			commands.insertCommand({REBASE, 0x0, 0});
+			commands.newTransaction();
+
+			//We save the first page to the cache then move every page to its final location
+			commands.insertCommand({COPY, blocks[i].blockID, 0, BLOCK_SIZE, CACHE_BUF});
+
+			for(const size_t index : cycle)
+			{
+				const Block & block = blocks[index];
+
+				if(index == cycle.back())
+					commands.insertCommand({FLUSH_AND_PARTIAL_COMMIT, block.blockID, BLOCK_SIZE});
+				else
+					commands.insertCommand(Command(MOVE_PAGES, block.data.front().origin.getBlock(), block.blockID, 1));
+			}
+
+			commands.finishTransaction();
+
+			for(const size_t index : cycle)
+			{
+				blocks[index].blocksRequestingData.clear();
+				blocks[index].blockFinished = true;
+			}
+
+			commands.updateLastRebase();
+		}
+	}
+
 	void removeNetworks(vector<Block> & blocks, SchedulerData & commands)
 	{
 		const size_t length = blocks.size();
@@ -12,6 +12,7 @@
 
 #include <cstring>
 #include "scheduler.h"
+#include "validation.h"
 
 bool dynamicallyCheckStaticTest(const vector<PublicCommand> & real, const vector<BSDiffMoves> &input)
 {
@@ -779,6 +780,77 @@ bool forthPassTestWithCompetitiveReadOnReusedSpace()
 	return validateStaticResults(output, expected, input);
 }
 
+bool pageMoveTest()
+{
+#ifdef VERBOSE_STATIC_TESTS
+	cout << "Testing the page move pass" << endl;
+#endif
+
+	//A section was removed: the following pages are shifted
+	const vector<BSDiffMoves> input = {{BLOCK_SIZE, 3 * BLOCK_SIZE, 0}};
+
+	const vector<Command> expected = {{REBASE, 0x0, 0x3},
+									  Command(MOVE_PAGES, BlockID(0x1000), BlockID(0x0), 3)};
+
+	vector<PublicCommand> output;
+	schedule(input, output);
+	return validateStaticResults(output, expected, input);
+}
+
+bool pagePermutationTest()
+{
+#ifdef VERBOSE_STATIC_TESTS
+	cout << "Testing the page permutation pass" << endl;
+#endif
+
+	//The first page was moved to the end of the section
+	const vector<BSDiffMoves> input = {{BLOCK_SIZE, 2 * BLOCK_SIZE, 0},
+										{0, BLOCK_SIZE, 2 * BLOCK_SIZE}};
+
+	const vector<Command> expected = {{REBASE, 0x0, 0x3},
+									  {COPY, 0x0, 0x0, BLOCK_SIZE, CACHE_BUF},
+									  Command(MOVE_PAGES, BlockID(0x1000), BlockID(0x0), 2),
+									  {FLUSH_AND_PARTIAL_COMMIT, 0x2000, BLOCK_SIZE}};
+
+	vector<PublicCommand> output;
+	schedule(input, output);
+	return validateStaticResults(output, expected, input);
+}
+
+bool parallelRangeHashingTest()
+{
+#ifdef VERBOSE_STATIC_TESTS
+	cout << "Testing the parallel range hashing" << endl;
+#endif
+
+	//Enough data for the hashing to be split between threads
+	const size_t dataLength = 8u << 20u;
+	vector<uint8_t> data(dataLength);
+	for(size_t i = 0; i < dataLength; ++i)
+		data[i] = static_cast<uint8_t>((i * 2654435761u) >> 13u);
+
+	vector<VerificationRange> ranges;
+	for(size_t start = 0; start + VerificationRange::maxLength <= dataLength; start += VerificationRange::maxLength + 17)
+		ranges.emplace_back(static_cast<uint32_t>(start), static_cast<uint16_t>(VerificationRange::maxLength - (start & 0xff)));
+
+	computeExpectedHashForRanges(ranges, data.data(), dataLength);
+
+	//Hashing the ranges one at a time never spawns a thread
+	for(const auto & range : ranges)
+	{
+		vector<VerificationRange> reference = {VerificationRange(range.start, range.length)};
+		computeExpectedHashForRanges(reference, data.data(), dataLength);
+
+		if(memcmp(reference.front().expectedHash, range.expectedHash, sizeof(range.expectedHash)) != 0)
+		{
+			cerr << "Parallel hashing mismatch on the range starting at 0x" << hex << range.start << dec << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool performStaticTests()
 {
 	bool output = true;
@@ -792,6 +864,9 @@ bool performStaticTests()
 	output &= forthPassTestWithCompetitiveRead();
 	output &= forthPassTestWithHarderCompetitiveRead();
 	output &= forthPassTestWithCompetitiveReadOnReusedSpace();
+	output &= pageMoveTest();
+	output &= pagePermutationTest();
+	output &= parallelRangeHashingTest();
 
 #ifndef VERBOSE_STATIC_TESTS
 	if(output)
@@ -15,6 +15,12 @@
 #include <iostream>
 #include <ostream>
 #include <cstring>
+#include <new>
+#include <map>
+#include <iterator>
+#include <thread>
+#include <string>
+#include <cassert>
 #include <vector>
 #include <sys/param.h>
 
@@ -26,29 +32,103 @@ using namespace std;
 #include "scheduler.h"
 #include <crypto_utils.h>
 
+//Sorted set of disjoint, non-adjacent [start, end) intervals
 struct VerificationRangeCollector
 {
-	map<BlockID, DetailedBlock> data;
+	map<size_t, size_t> data;
 
 	void tag(size_t address, size_t length)
 	{
 		if(length == 0)
 			return;
 
-		const size_t spaceLeftInTag = BLOCK_SIZE - (address & BLOCK_OFFSET_MASK);
-		const size_t lengthToTag = MIN(spaceLeftInTag, length);
+		size_t end = address + length;
 
-		BlockID blockID(address);
-		if(data.find(blockID) == data.end())
-			data[blockID].segments.emplace_back(blockID);
+		//Find the first interval that could touch us
+		auto iter = data.upper_bound(address);
+		if(iter != data.begin() && prev(iter)->second >= address)
+			--iter;
 
-		data[blockID].insertNewSegment(DetailedBlockMetadata(Address(address), lengthToTag, true));
+		//Absorb every interval we touch
+		while(iter != data.end() && iter->first <= end)
+		{
+			address = MIN(address, iter->first);
+			end = MAX(end, iter->second);
+			iter = data.erase(iter);
+		}
+
+		data.emplace_hint(iter, address, end);
+	}
+
+	//Tag the part of [address, address + length) not covered by `mask`
+	void tagExcluding(const VerificationRangeCollector & mask, size_t address, size_t length)
+	{
+		const size_t end = address + length;
+
+		auto iter = mask.data.upper_bound(address);
+		if(iter != mask.data.begin() && prev(iter)->second > address)
+			--iter;
+
+		for(; iter != mask.data.end() && iter->first < end && address < end; ++iter)
+		{
+			if(iter->first > address)
+				tag(address, iter->first - address);
+
+			address = MAX(address, iter->second);
+		}
+
+		if(address < end)
+			tag(address, end - address);
+	}
+
+	static size_t rangesNeeded(size_t length)
+	{
+		return (length + VerificationRange::maxLength - 1) / VerificationRange::maxLength;
+	}
 
-		if(lengthToTag < length)
-			tag(address + lengthToTag, length - lengthToTag);
+	//Merge neighbouring intervals when hashing the gap is cheaper than checking an extra range
+	void coalesce(size_t rangeOverhead)
+	{
+		if(data.empty())
+			return;
+
+		auto current = data.begin();
+		for(auto next = std::next(current); next != data.end(); next = std::next(current))
+		{
+			const size_t gap = next->first - current->second;
+			const size_t mergedLength = next->second - current->first;
+			const size_t rangesBefore = rangesNeeded(current->second - current->first) + rangesNeeded(next->second - next->first);
+
+			if(gap + rangesNeeded(mergedLength) * rangeOverhead <= rangesBefore * rangeOverhead)
+			{
+				current->second = next->second;
+				data.erase(next);
+			}
+			else
+				current = next;
+		}
+	}
+
+	//Visit every interval, split to fit in a VerificationRange
+	template<typename Callback>
+	void forEachRange(Callback callback) const
+	{
+		for(const auto & interval : data)
+		{
+			for(size_t address = interval.first; address < interval.second; )
+			{
+				const size_t length = MIN(interval.second - address, VerificationRange::maxLength);
+
+				callback(address, length);
+				address += length;
+			}
+		}
 	}
 };
 
+//The virtual flash is kept around so that batch jobs don't pay for a fresh allocation on every patch
+static vector<uint8_t> virtualFlashBuffer;
+
 uint8_t * generateVirtualFlash(size_t & flashLength)
 {
 	//Craft the virtual flash
@@ -58,52 +138,95 @@ uint8_t * generateVirtualFlash(size_t & flashLength)
 		flashLength &= BLOCK_MASK;
 	}
 
-	auto *virtualFlash = (uint8_t *) malloc(flashLength);
-	if(virtualFlash != nullptr)
-		memset(virtualFlash, 0xff, flashLength);
+	try
+	{
+		virtualFlashBuffer.assign(flashLength, 0xff);
+	}
+	catch(const bad_alloc &)
+	{
+		return nullptr;
+	}
+
+	return virtualFlashBuffer.data();
+}
+
+bool parseValidationMode(const char * mode, ValidationMode & output)
+{
+	if(!strcmp(mode, "full"))
+		output = VALIDATION_FULL;
+	else if(!strcmp(mode, "fast"))
+		output = VALIDATION_FAST;
+	else if(!strcmp(mode, "off"))
+		output = VALIDATION_OFF;
+	else
+		return false;
 
-	return virtualFlash;
+	return true;
 }
 
-bool validateSchedulerPatch(const uint8_t * original, size_t originalLength, const uint8_t * newer, size_t newLength, const SchedulerPatch & patch)
+bool compareDirtyPages(const uint8_t * virtualFlash, const uint8_t * newer, size_t newLength, const vector<bool> & dirtyPages)
 {
+	//Pages the update didn't touch are either part of the identical prefix or were already checked by validateBSDiff
+	for(size_t page = 0; page < dirtyPages.size(); ++page)
+	{
+		const size_t pageAddress = page << BLOCK_SIZE_BIT;
+		if(pageAddress >= newLength)
+			break;
+
+		if(dirtyPages[page] && memcmp(&virtualFlash[pageAddress], &newer[pageAddress], MIN(BLOCK_SIZE, newLength - pageAddress)) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+bool validateSchedulerPatch(const uint8_t * original, size_t originalLength, const uint8_t * newer, size_t newLength, const SchedulerPatch & patch, ValidationMode mode)
+{
+	if(mode == VALIDATION_OFF)
+		return true;
+
 	//We make sure the payload is properly encoded and decoded
-	if(Encoder().validate(patch.commands) == 0)
+	if(mode == VALIDATION_FULL && Encoder().validate(patch.commands) == 0)
 	{
 		cerr << "Couldn't validate the bytecode!" << endl;
 		return false;
 	}
 
-	uint8_t *virtualFlash = nullptr;
-
 	//Craft the virtual flash
 	size_t flashLength = MAX(originalLength, newLength);
-	virtualFlash = generateVirtualFlash(flashLength);
+	uint8_t * virtualFlash = generateVirtualFlash(flashLength);
 	if(virtualFlash == nullptr)
 	{
 		cerr << "Couldn't allocate memory for the virtual flash!" << endl;
 		return false;
 	}
 
+	vector<bool> dirtyPages;
+	vector<bool> * dirtyPagesPtr = nullptr;
+	if(mode == VALIDATION_FAST)
+	{
+		dirtyPages.resize(flashLength >> BLOCK_SIZE_BIT, false);
+		dirtyPagesPtr = &dirtyPages;
+	}
+
 	//Copy the old buffer to the "flash"
 	memcpy(virtualFlash, original, originalLength);
-	if(!virtualMachine(patch.commands, virtualFlash, flashLength))
+	if(!virtualMachine(patch.commands, virtualFlash, flashLength, dirtyPagesPtr))
 	{
 		cerr << "Preimage virtual machine error!" << endl;
-		free(virtualFlash);
 		return false;
 	}
 
 	//Execute the patch
-	if(!executeBSDiffPatch(patch, virtualFlash, flashLength))
+	if(!executeBSDiffPatch(patch, virtualFlash, flashLength, dirtyPagesPtr))
 	{
 		cerr << "BSDiff virtual machine error!" << endl;
-		free(virtualFlash);
 		return false;
 	}
 
 	//Check the result
-	if(memcmp(virtualFlash, newer, newLength) != 0)
+	const bool valid = mode == VALIDATION_FAST ? compareDirtyPages(virtualFlash, newer, newLength, dirtyPages) : memcmp(virtualFlash, newer, newLength) == 0;
+	if(!valid)
 	{
 		cerr << "Couldn't produce the proper final image!" << endl;
 
@@ -115,100 +238,12 @@ bool validateSchedulerPatch(const uint8_t * original, size_t originalLength, con
 		}
 
 		dumpCommands(patch.commands, "commands.txt");
-
-		free(virtualFlash);
 		return false;
 	}
 
-	free(virtualFlash);
 	return true;
 }
 
-void addReadRange(VerificationRangeCollector & readRange, const VerificationRangeCollector & writeRange, size_t baseAddress, size_t realLength)
-{
-	Address address(baseAddress);
-	const size_t spaceLeftInTag = BLOCK_SIZE - (baseAddress & BLOCK_OFFSET_MASK);
-	size_t length = MIN(spaceLeftInTag, realLength);
-
-	auto blockRange = writeRange.data.find(address.getBlock());
-
-	if(blockRange != writeRange.data.end())
-	{
-		Address endBase(address + length);
-		const auto & segments = blockRange->second.segments;
-
-		auto wRange = lower_bound(segments.begin(), segments.end(), address, [](const DetailedBlockMetadata & meta, const Address & add) { return (meta.source + meta.length) < add; });
-		for(; wRange != segments.end(); ++wRange)
-		{
-			if(!wRange->tagged)
-				continue;
-
-			//Block start after we end. We can stop
-			if(wRange->source > endBase)
-				break;
-
-			//The segment end before we start
-			const Address endSegment(wRange->source + wRange->length);
-			if(endSegment < address)
-				continue;
-
-			///This is _expensive_
-			if(wRange->overlapWith(address, length))
-			{
-				//The intersecting segment start before the range we're trying to insert
-				if(wRange->source <= address)
-				{
-					//No segment left
-					if(endSegment >= endBase)
-						return;
-
-					//We shrink the segment and keep going
-					address = endSegment;
-					length = endBase.value - endSegment.value;
-					endBase = address + length;
-				}
-				//The intersection starts within us. Does it finish after the end of our segment?
-				else if(endSegment >= endBase)
-				{
-					//We shrink the segment and keep going
-					length = endBase.value - wRange->source.value;
-					endBase = address + length;
-				}
-				//This split our segment in two parts. Awesome.
-				else
-				{
-					//We shrink the first half
-					length = endBase.value - wRange->source.value;
-
-					const Address secHalf(endSegment);
-					const size_t secHalfLength = endBase.value - endSegment.value;
-
-					//We make a recursive call with the smallest of the two halves
-					if(length > secHalfLength)
-					{
-						addReadRange(readRange, writeRange, secHalf.value, secHalfLength);
-					}
-					else
-					{
-						addReadRange(readRange, writeRange, address.value, length);
-						address = secHalf;
-						length = secHalfLength;
-					}
-
-					endBase = address + length;
-				}
-			}
-		}
-	}
-
-	if(length != 0)
-		readRange.tag(address.value, length);
-
-	//If we tried adding a range beyond the end of the block, we recursively call ourselves
-	if(spaceLeftInTag < realLength)
-		addReadRange(readRange, writeRange, baseAddress + spaceLeftInTag, realLength - spaceLeftInTag);
-}
-
 void generateVerificationRangesPrePatch(SchedulerPatch &patch, size_t initialOffset)
 {
 	//We need to collect all reads
@@ -237,15 +272,26 @@ void generateVerificationRangesPrePatch(SchedulerPatch &patch, size_t initialOff
 
 			case LOAD_AND_FLUSH:
 			{
-				addReadRange(readRanges, writtenRanges, command.mainAddress, command.length);
+				readRanges.tagExcluding(writtenRanges, command.mainAddress, command.length);
 				writtenRanges.tag(command.mainAddress, BLOCK_SIZE);
 				break;
 			}
 
+			case MOVE_PAGES:
+			{
+				//Pages are moved one after the other, a page may thus be read after a previous move overwrote it
+				for(size_t page = 0; page < command.length; ++page)
+				{
+					readRanges.tagExcluding(writtenRanges, command.mainAddress + (page << BLOCK_SIZE_BIT), BLOCK_SIZE);
+					writtenRanges.tag(command.secondaryAddress + (page << BLOCK_SIZE_BIT), BLOCK_SIZE);
+				}
+				break;
+			}
+
 			case COPY:
 			{
 				if(!isCache(command.mainAddress))
-					addReadRange(readRanges, writtenRanges, command.mainAddress, command.length);
+					readRanges.tagExcluding(writtenRanges, command.mainAddress, command.length);
 
 				if(!isCache(command.secondaryAddress))
 					writtenRanges.tag(command.secondaryAddress, command.length);
@@ -257,7 +303,7 @@ void generateVerificationRangesPrePatch(SchedulerPatch &patch, size_t initialOff
 			case CHAINED_COPY:
 			{
 				if(!isCache(command.mainAddress))
-					addReadRange(readRanges, writtenRanges, command.mainAddress, command.length);
+					readRanges.tagExcluding(writtenRanges, command.mainAddress, command.length);
 
 				if(!isCache(endAddressCopy))
 					writtenRanges.tag(endAddressCopy, command.length);
@@ -284,7 +330,7 @@ void generateVerificationRangesPrePatch(SchedulerPatch &patch, size_t initialOff
 	size_t readHeadBeforeExtra = initialOffset;
 	for(const auto & bsdiff : patch.bsdiff)
 	{
-		addReadRange(readRanges, writtenRanges, initialOffset, bsdiff.delta.length);
+		readRanges.tagExcluding(writtenRanges, initialOffset, bsdiff.delta.length);
 
 		initialOffset += bsdiff.delta.length;
 		readHeadBeforeExtra = initialOffset;
@@ -296,52 +342,24 @@ void generateVerificationRangesPrePatch(SchedulerPatch &patch, size_t initialOff
 	if(readHeadBeforeExtra == initialOffset && initialOffset & BLOCK_OFFSET_MASK)
 	{
 		const size_t aditionnalLengthToCheck = BLOCK_SIZE - (initialOffset & BLOCK_OFFSET_MASK);
-		addReadRange(readRanges, writtenRanges, initialOffset, aditionnalLengthToCheck);
+		readRanges.tagExcluding(writtenRanges, initialOffset, aditionnalLengthToCheck);
 	}
 
-	//Compact, then add to the oldRange vector in small enough chunks. We start by counting the space we need to allocate in oldRanges
+	//Hashing a few bytes the update doesn't need is cheaper than having the device check many small ranges
+	readRanges.coalesce(VERIFICATION_RANGE_OVERHEAD);
+
+	//Add to the oldRange vector in small enough chunks. We start by counting the space we need to allocate in oldRanges
 	size_t lengthToAllocate = 0;
-	for(auto & readRange : readRanges.data)
-	{
-		readRange.second.compactSegments();
-		for (const auto &segment : readRange.second.segments)
-		{
-			if (segment.tagged)
-			{
-				if (segment.length > VerificationRange::maxLength)
-					lengthToAllocate += segment.length / VerificationRange::maxLength + (segment.length % VerificationRange::maxLength != 0);
-				else
-					lengthToAllocate += 1;
-			}
-		}
-	}
+	readRanges.forEachRange([&lengthToAllocate](size_t, size_t) { lengthToAllocate += 1; });
 
 	//Grab the memory
 	patch.oldRanges.reserve(lengthToAllocate);
 
 	//Actually fill the data in the buffer
-	for(auto & readRange : readRanges.data)
+	readRanges.forEachRange([&patch](size_t address, size_t length)
 	{
-		for (const auto &segment : readRange.second.segments)
-		{
-			if (segment.tagged)
-			{
-				size_t patchLength = segment.length;
-				initialOffset = segment.source.getAddress();
-
-				while(patchLength)
-				{
-					const size_t rangeLength = (patchLength > VerificationRange::maxLength ? VerificationRange::maxLength : patchLength);
-
-					patch.oldRanges.emplace_back(VerificationRange(static_cast<uint32_t>(initialOffset), rangeLength));
-
-					patchLength -= rangeLength;
-					initialOffset += rangeLength;
-				}
-			}
-		}
-
-	}
+		patch.oldRanges.emplace_back(VerificationRange(static_cast<uint32_t>(address), static_cast<uint16_t>(length)));
+	});
 }
 
 void generateVerificationRangesPostPatch(SchedulerPatch & patch, size_t initialOffset, const size_t fileLength)
@@ -372,19 +390,69 @@ void generateVerificationRangesPostPatch(SchedulerPatch & patch, size_t initialO
 	}
 }
 
+string VerificationRange::hexHash() const
+{
+	char hex[sizeof(expectedHash) * 2 + 1];
+	hydro_bin2hex(hex, sizeof(hex), expectedHash, sizeof(expectedHash));
+	return string(hex);
+}
+
+bool VerificationRange::setHashFromHex(const char * hex, size_t hexLength)
+{
+	return hydro_hex2bin(expectedHash, sizeof(expectedHash), hex, hexLength, nullptr, nullptr) == sizeof(expectedHash);
+}
+
+//Below this amount of data, spawning threads costs more than it saves
+#define MIN_HASHED_BYTES_PER_THREAD (1u << 20u)
+
 void computeExpectedHashForRanges(vector<VerificationRange> &ranges, const uint8_t * data, size_t dataLength)
 {
-	for(auto & range : ranges)
+	size_t totalLength = 0;
+	for(const auto & range : ranges)
 	{
 		assert(range.start + range.length <= dataLength);
+		totalLength += range.length;
+	}
 
-		uint8_t hash[HASH_LENGTH];
-		char hex[HASH_LENGTH * 2 + 1];
+	static_assert(sizeof(ranges[0].expectedHash) == HASH_LENGTH, "Hash length mismatch");
 
-		hashMemory(&data[range.start], range.length, hash);
+	//Each worker hashes a contiguous slice of the ranges
+	auto hashSlice = [&ranges, data](size_t begin, size_t end)
+	{
+		for(size_t i = begin; i < end; ++i)
+			hashMemory(&data[ranges[i].start], ranges[i].length, ranges[i].expectedHash);
+	};
 
-		hydro_bin2hex(hex, sizeof(hex), hash, sizeof(hash));
+	const size_t hardwareThreads = MAX(thread::hardware_concurrency(), 1u);
+	const size_t threadCount = MIN(MIN(hardwareThreads, totalLength / MIN_HASHED_BYTES_PER_THREAD), ranges.size());
 
-		range.expectedHash = string(hex);
+	if(threadCount <= 1)
+	{
+		hashSlice(0, ranges.size());
+		return;
 	}
+
+	//Split the ranges so that every thread gets roughly the same amount of data
+	vector<thread> workers;
+	workers.reserve(threadCount - 1);
+
+	const size_t targetLength = totalLength / threadCount;
+	size_t begin = 0, sliceLength = 0;
+
+	for(size_t i = 0; i < ranges.size() && workers.size() < threadCount - 1; ++i)
+	{
+		sliceLength += ranges[i].length;
+		if(sliceLength >= targetLength)
+		{
+			workers.emplace_back(hashSlice, begin, i + 1);
+			begin = i + 1;
+			sliceLength = 0;
+		}
+	}
+
+	//The calling thread takes the remainder
+	hashSlice(begin, ranges.size());
+
+	for(auto & worker : workers)
+		worker.join();
 }
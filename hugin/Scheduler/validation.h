@@ -13,8 +13,16 @@
 #ifndef RAVENS_VALIDATION_H
 #define RAVENS_VALIDATION_H
 
-bool executeBSDiffPatch(const SchedulerPatch & commands, uint8_t * flash, size_t flashLength);
-bool validateSchedulerPatch(const uint8_t * original, size_t originalLength, const uint8_t * newer, size_t newLength, const SchedulerPatch & patch);
+enum ValidationMode
+{
+	VALIDATION_FULL,	//Re-encode the bytecode and compare the whole image
+	VALIDATION_FAST,	//Only compare the pages the update actually wrote to
+	VALIDATION_OFF
+};
+
+bool executeBSDiffPatch(const SchedulerPatch & commands, uint8_t * flash, size_t flashLength, std::vector<bool> * dirtyPages = nullptr);
+bool validateSchedulerPatch(const uint8_t * original, size_t originalLength, const uint8_t * newer, size_t newLength, const SchedulerPatch & patch, ValidationMode mode = VALIDATION_FULL);
+bool parseValidationMode(const char * mode, ValidationMode & output);
 
 void generateVerificationRangesPrePatch(SchedulerPatch &patch, size_t initialOffset);
 void generateVerificationRangesPostPatch(SchedulerPatch & patch, size_t initialOffset, const size_t fileLength);
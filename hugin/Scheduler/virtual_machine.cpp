@@ -90,7 +90,17 @@ void performCopy(uint8_t * flash, size_t flashLength, uint8_t * cache, size_t so
 	}
 }
 
-bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, size_t flashLength)
+//Record the pages a command wrote to, so the validation only has to compare those
+static void markDirty(vector<bool> * dirtyPages, size_t address, size_t length)
+{
+	if(dirtyPages == nullptr || length == 0 || isCache(address))
+		return;
+
+	for(size_t page = address >> BLOCK_SIZE_BIT, lastPage = (address + length - 1) >> BLOCK_SIZE_BIT; page <= lastPage && page < dirtyPages->size(); ++page)
+		(*dirtyPages)[page] = true;
+}
+
+bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, size_t flashLength, vector<bool> * dirtyPages)
 {
 	if(flash == nullptr || flashLength == 0 || (flashLength & BLOCK_OFFSET_MASK) != 0)
 		return false;
@@ -117,6 +127,7 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 			{
 				checkAligned(command.mainAddress);
 				memcpy(&flash[command.mainAddress], cache, BLOCK_SIZE);
+				markDirty(dirtyPages, command.mainAddress, BLOCK_SIZE);
 				break;
 			}
 
@@ -124,6 +135,7 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 			{
 				checkAligned(command.mainAddress);
 				memset(&flash[command.mainAddress], DEFAULT_NAND_VALUE, BLOCK_SIZE);
+				markDirty(dirtyPages, command.mainAddress, BLOCK_SIZE);
 				break;
 			}
 
@@ -132,6 +144,25 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 				checkAligned(command.mainAddress);
 				memcpy(cache, &flash[command.mainAddress], BLOCK_SIZE);
 				memset(&flash[command.mainAddress], DEFAULT_NAND_VALUE, BLOCK_SIZE);
+				markDirty(dirtyPages, command.mainAddress, BLOCK_SIZE);
+				break;
+			}
+
+			case MOVE_PAGES:
+			{
+				for(size_t page = 0; page < command.length; ++page)
+				{
+					const size_t source = command.mainAddress + (page << BLOCK_SIZE_BIT);
+					const size_t dest = command.secondaryAddress + (page << BLOCK_SIZE_BIT);
+
+					checkAligned(source);
+					checkAligned(dest);
+					assert(source != dest);
+
+					memset(&flash[dest], DEFAULT_NAND_VALUE, BLOCK_SIZE);
+					writeFlash(&flash[dest], &flash[source], BLOCK_SIZE);
+					markDirty(dirtyPages, dest, BLOCK_SIZE);
+				}
 				break;
 			}
 
@@ -145,6 +176,7 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 
 				memset(&flash[command.mainAddress], DEFAULT_NAND_VALUE, BLOCK_SIZE);
 				writeFlash(&flash[command.mainAddress], cache, command.length);
+				markDirty(dirtyPages, command.mainAddress, BLOCK_SIZE);
 				break;
 			}
 
@@ -153,6 +185,7 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 				assert(previousWriteWasCopy);
 
 				performCopy(flash, flashLength, cache, command.mainAddress, command.length, endPreviousCopy);
+				markDirty(dirtyPages, endPreviousCopy, command.length);
 
 				isChainCompatibleOperation = true;
 				endPreviousCopy += command.length;
@@ -162,6 +195,7 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 			case COPY:
 			{
 				performCopy(flash, flashLength, cache, command.mainAddress, command.length, command.secondaryAddress);
+				markDirty(dirtyPages, command.secondaryAddress, command.length);
 
 				isChainCompatibleOperation = true;
 				endPreviousCopy = command.secondaryAddress + command.length;
@@ -210,21 +244,48 @@ bool virtualMachine(const vector<PublicCommand> & commands, uint8_t * flash, siz
 	return true;
 }
 
-bool executeBSDiffPatch(const SchedulerPatch & commands, uint8_t * flash, size_t flashLength)
+//Add the delta eight bytes at a time, without letting the carry spill over the neighbouring byte
+static void applyDelta(uint8_t * flash, const uint8_t * delta, size_t length)
+{
+	const uint64_t highBits = 0x8080808080808080ull;
+
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+	{
+		uint64_t flashWord, deltaWord;
+		memcpy(&flashWord, &flash[i], sizeof(flashWord));
+		memcpy(&deltaWord, &delta[i], sizeof(deltaWord));
+
+		flashWord = ((flashWord & ~highBits) + (deltaWord & ~highBits)) ^ ((flashWord ^ deltaWord) & highBits);
+		memcpy(&flash[i], &flashWord, sizeof(flashWord));
+	}
+
+	for(; i < length; ++i)
+		flash[i] += delta[i];
+}
+
+bool executeBSDiffPatch(const SchedulerPatch & commands, uint8_t * flash, size_t flashLength, vector<bool> * dirtyPages)
 {
 	if(flash == nullptr || flashLength == 0 || (flashLength & BLOCK_OFFSET_MASK) != 0)
 		return false;
 
-	size_t currentPos = commands.startAddress << BLOCK_SIZE_BIT;
+	const size_t startAddress = commands.startAddress << BLOCK_SIZE_BIT;
+	size_t currentPos = startAddress;
 	for(const auto &patch : commands.bsdiff)
 	{
+		if(currentPos + patch.delta.length + patch.extra.length > flashLength)
+			return false;
+
 		//Apply delta
-		for(size_t i = 0; i < patch.delta.length; ++i)
-			flash[currentPos++] += patch.delta.data[i];
+		applyDelta(&flash[currentPos], patch.delta.data, patch.delta.length);
+		currentPos += patch.delta.length;
 
-		for(size_t i = 0; i < patch.extra.length; ++i)
-			flash[currentPos++] = patch.extra.data[i];
+		if(patch.extra.length != 0)
+			memcpy(&flash[currentPos], patch.extra.data, patch.extra.length);
+		currentPos += patch.extra.length;
 	}
 
+	markDirty(dirtyPages, startAddress, currentPos - startAddress);
+
 	return true;
 }
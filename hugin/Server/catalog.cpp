@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <rapidjson/document.h>
+#include <rapidjson/error/en.h>
+#include "server.h"
+
+extern "C" uint8_t * readFile(const char * file, size_t * fileSize);
+
+using namespace std;
+
+ServerCatalog::~ServerCatalog()
+{
+	for(auto & device : devices)
+	{
+		for(auto & version : device.second.payload)
+			clearMemory(version.second.privateKey, sizeof(version.second.privateKey));
+	}
+}
+
+//The importer may have stored the versions either as numbers or as strings
+static bool readVersion(const rapidjson::Value & value, uint32_t & output)
+{
+	if(value.IsUint())
+	{
+		output = value.GetUint();
+		return true;
+	}
+
+	if(!value.IsString() || value.GetStringLength() == 0)
+		return false;
+
+	char * end;
+	const unsigned long version = strtoul(value.GetString(), &end, 10);
+	if(*end != '\0' || version > UINT32_MAX)
+		return false;
+
+	output = (uint32_t) version;
+	return true;
+}
+
+static bool loadVersion(ServerCatalog & catalog, const string & deviceName, const string & versionName, const rapidjson::Value & entry, ServedVersion & version)
+{
+	const string context(deviceName + "/" + versionName);
+
+	if(!entry.IsObject() || !entry.HasMember("publicKey") || !entry["publicKey"].IsString()
+	   || !entry.HasMember("privateKey") || !entry["privateKey"].IsString()
+	   || !entry.HasMember("manifest1") || !entry["manifest1"].IsString()
+	   || !entry.HasMember("manifest2") || !entry["manifest2"].IsString())
+	{
+		cerr << "Invalid entry for " << context << endl;
+		return false;
+	}
+
+	const auto & publicKey = entry["publicKey"];
+	if(hydro_hex2bin(version.publicKey, sizeof(version.publicKey), publicKey.GetString(), publicKey.GetStringLength(), nullptr, nullptr) != sizeof(version.publicKey))
+	{
+		cerr << "Invalid public key for " << context << endl;
+		return false;
+	}
+
+	//The challenges are signed in-process, so the update keys stay loaded
+	version.privateKeyPath = entry["privateKey"].GetString();
+	if(!loadKey(version.privateKeyPath.c_str(), true, version.privateKey))
+	{
+		cerr << "Couldn't load the private key of " << context << endl;
+		return false;
+	}
+
+	if(!catalog.mapManifest(entry["manifest1"].GetString(), version.manifest1) || !catalog.mapManifest(entry["manifest2"].GetString(), version.manifest2))
+	{
+		cerr << "Couldn't map the manifests of " << context << endl;
+		return false;
+	}
+
+	version.haveVerificationIndex = entry.HasMember("verificationIndex");
+	if(version.haveVerificationIndex)
+	{
+		if(!entry["verificationIndex"].IsUint() || entry["verificationIndex"].GetUint() > version.manifest1.size())
+		{
+			cerr << "Invalid verification index for " << context << endl;
+			return false;
+		}
+
+		version.verificationIndex = entry["verificationIndex"].GetUint();
+	}
+
+	if(entry.HasMember("verification"))
+	{
+		if(!entry["verification"].IsArray())
+		{
+			cerr << "Invalid verification array for " << context << endl;
+			return false;
+		}
+
+		for(const auto & hash : entry["verification"].GetArray())
+		{
+			array<uint8_t, HASH_LENGTH> rawHash{};
+
+			if(!hash.IsString() || hydro_hex2bin(rawHash.data(), rawHash.size(), hash.GetString(), hash.GetStringLength(), nullptr, nullptr) != HASH_LENGTH)
+			{
+				cerr << "Invalid verification hash for " << context << endl;
+				return false;
+			}
+
+			version.verification.push_back(rawHash);
+		}
+	}
+
+	return true;
+}
+
+bool ServerCatalog::loadFromJson(const char * path)
+{
+	size_t configSize;
+	uint8_t * configContent = readFile(path, &configSize);
+	if(configContent == nullptr)
+	{
+		cerr << "Couldn't load " << path << endl;
+		return false;
+	}
+
+	rapidjson::Document config;
+	rapidjson::ParseResult ok = config.Parse((const char *) configContent, configSize);
+	free(configContent);
+
+	if(!ok)
+	{
+		cerr << "Invalid update file: couldn't parse the JSON format: " << rapidjson::GetParseError_En(ok.Code()) << " Offset " << to_string(ok.Offset()) << endl;
+		return false;
+	}
+
+	if(!config.IsObject())
+	{
+		cerr << "Invalid update file format" << endl;
+		return false;
+	}
+
+	for(const auto & deviceEntry : config.GetObject())
+	{
+		const string deviceName(deviceEntry.name.GetString(), deviceEntry.name.GetStringLength());
+		const auto & deviceValue = deviceEntry.value;
+
+		//Filled in place so that the keys loaded so far are cleared by our destructor, even if we fail
+		ServedDevice & device = devices[deviceName];
+
+		if(!deviceValue.IsObject() || !deviceValue.HasMember("currentVersion") || !readVersion(deviceValue["currentVersion"], device.currentVersion)
+		   || !deviceValue.HasMember("payload") || !deviceValue["payload"].IsObject())
+		{
+			cerr << "Invalid entry for device " << deviceName << endl;
+			return false;
+		}
+
+		for(const auto & versionEntry : deviceValue["payload"].GetObject())
+		{
+			const string versionName(versionEntry.name.GetString(), versionEntry.name.GetStringLength());
+
+			if(!loadVersion(*this, deviceName, versionName, versionEntry.value, device.payload[versionName]))
+				return false;
+		}
+	}
+
+	prepareReplies();
+	return true;
+}
+
+bool ServerCatalog::mapManifest(const string & path, ManifestView & view)
+{
+	mappings.emplace_back();
+	MappedFile & file = mappings.back();
+
+	if(!file.map(path))
+		return false;
+
+	view = ManifestView(file.bytes(), file.size(), file.fd(), 0);
+	return true;
+}
+
+bool ServerCatalog::loadFromBinaryCatalog(const char * path)
+{
+	if(!binaryCatalog.open(path))
+		return false;
+
+	for(const UpdateCatalogEntry * entry : binaryCatalog.entries())
+	{
+		//Cells only generated by the batch command lack what we need to sign the challenge
+		if((entry->flags & (UPDATE_CATALOG_HAS_MANIFEST1 | UPDATE_CATALOG_HAS_KEYS)) != (UPDATE_CATALOG_HAS_MANIFEST1 | UPDATE_CATALOG_HAS_KEYS))
+			continue;
+
+		const string deviceName = binaryCatalog.device(*entry), versionName = to_string(entry->fromVersion);
+		const bool newDevice = devices.find(deviceName) == devices.end();
+		ServedDevice & device = devices[deviceName];
+
+		if(!newDevice && device.currentVersion != entry->toVersion)
+		{
+			cerr << "Inconsistent target version for device " << deviceName << " in " << path << endl;
+			return false;
+		}
+
+		device.currentVersion = entry->toVersion;
+		ServedVersion & version = device.payload[versionName];
+
+		memcpy(version.publicKey, entry->publicKey, sizeof(version.publicKey));
+		version.privateKeyPath = binaryCatalog.privateKeyPath(*entry);
+		if(!loadKey(version.privateKeyPath.c_str(), true, version.privateKey))
+		{
+			cerr << "Couldn't load the private key of " << deviceName << "/" << versionName << endl;
+			return false;
+		}
+
+		//Served straight from the catalog mapping
+		version.manifest1 = ManifestView(binaryCatalog.bytes(entry->manifest1Offset), entry->manifest1Size, binaryCatalog.fd(), (off_t) entry->manifest1Offset);
+		version.manifest2 = ManifestView(binaryCatalog.bytes(entry->manifest2Offset), entry->manifest2Size, binaryCatalog.fd(), (off_t) entry->manifest2Offset);
+
+		version.haveVerificationIndex = entry->verificationIndex != UPDATE_CATALOG_NO_INDEX;
+		version.verificationIndex = entry->verificationIndex;
+
+		const UpdateCatalogRange * ranges = binaryCatalog.ranges(*entry);
+		for(uint32_t i = 0; i < entry->verificationCount; ++i)
+		{
+			array<uint8_t, HASH_LENGTH> hash{};
+			memcpy(hash.data(), ranges[i].hash, HASH_LENGTH);
+			version.verification.push_back(hash);
+		}
+	}
+
+	prepareReplies();
+	return true;
+}
+
+bool ServerCatalog::writeBinaryCatalog(const char * path) const
+{
+	//update.json doesn't record what the manifests were generated with, so the batch command will never reuse those cells
+	UpdateCatalogWriter writer(UpdateCatalogParameters{});
+
+	for(const auto & device : devices)
+	{
+		for(const auto & version : device.second.payload)
+		{
+			char * end;
+			const unsigned long parsedVersion = strtoul(version.first.c_str(), &end, 10);
+
+			if(version.first.empty() || *end != '\0' || parsedVersion > UINT32_MAX)
+			{
+				cerr << "The binary catalog only supports numeric versions, not " << device.first << "/" << version.first << endl;
+				return false;
+			}
+
+			const ServedVersion & served = version.second;
+			UpdateCatalogCell cell;
+
+			cell.device = device.first;
+			cell.fromVersion = (uint32_t) parsedVersion;
+			cell.toVersion = device.second.currentVersion;
+
+			cell.manifest1 = served.manifest1.bytes();
+			cell.manifest1Size = served.manifest1.size();
+			cell.manifest2 = served.manifest2.bytes();
+			cell.manifest2Size = served.manifest2.size();
+
+			if(served.haveVerificationIndex)
+				cell.verificationIndex = (uint32_t) served.verificationIndex;
+
+			for(const auto & hash : served.verification)
+			{
+				UpdateCatalogRange range{};
+				memcpy(range.hash, hash.data(), HASH_LENGTH);
+				cell.verification.push_back(range);
+			}
+
+			cell.haveKeys = true;
+			cell.privateKeyPath = served.privateKeyPath;
+			memcpy(cell.publicKey, served.publicKey, sizeof(cell.publicKey));
+
+			writer.add(move(cell));
+		}
+	}
+
+	return writer.write(path);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapped_file.h"
+
+using namespace std;
+
+MappedFile::MappedFile(MappedFile && other) noexcept : data(other.data), length(other.length), descriptor(other.descriptor)
+{
+	other.data = nullptr;
+	other.length = 0;
+	other.descriptor = -1;
+}
+
+MappedFile & MappedFile::operator=(MappedFile && other) noexcept
+{
+	swap(data, other.data);
+	swap(length, other.length);
+	swap(descriptor, other.descriptor);
+	return *this;
+}
+
+MappedFile::~MappedFile()
+{
+	if(data != nullptr)
+		munmap((void *) data, length);
+
+	if(descriptor >= 0)
+		close(descriptor);
+}
+
+bool MappedFile::map(const string & path)
+{
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void * mapping = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED)
+	{
+		close(fd);
+		return false;
+	}
+
+	if(data != nullptr)
+		munmap((void *) data, length);
+
+	if(descriptor >= 0)
+		close(descriptor);
+
+	//The descriptor stays open so that the replies can be sent with sendfile
+	data = (const uint8_t *) mapping;
+	length = (size_t) st.st_size;
+	descriptor = fd;
+	return true;
+}
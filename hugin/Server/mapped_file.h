@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#ifndef HUGIN_MAPPED_FILE_H
+#define HUGIN_MAPPED_FILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+//Read-only mapping of a file. The descriptor stays open so that ranges of it can be sent with sendfile
+class MappedFile
+{
+	const uint8_t * data = nullptr;
+	size_t length = 0;
+	int descriptor = -1;
+
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile & operator=(const MappedFile &) = delete;
+	MappedFile(MappedFile && other) noexcept;
+	MappedFile & operator=(MappedFile && other) noexcept;
+	~MappedFile();
+
+	bool map(const std::string & path);
+
+	const uint8_t * bytes() const { return data; }
+	size_t size() const { return length; }
+	int fd() const { return descriptor; }
+};
+
+#endif //HUGIN_MAPPED_FILE_H
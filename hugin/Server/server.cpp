@@ -0,0 +1,1000 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "server.h"
+
+using namespace std;
+
+#define MAX_REQUEST_HEADER	(16u << 10u)
+#define MAX_REQUEST_BODY	(1u << 20u)
+#define CHALLENGE_LENGTH	64u
+#define CHALLENGE_RANDOM	8u
+#define EPOLL_BATCH			64
+#define KEEP_ALIVE_TIMEOUT	chrono::seconds(30)
+
+//Signature followed by the random appended to the challenge, as expected by the device
+#define SIGNED_CHALLENGE_LENGTH	(SIGNATURE_LENGTH + CHALLENGE_RANDOM)
+
+namespace
+{
+	enum class ConnectionState
+	{
+		ReadingHeader,
+		ReadingBody,
+		Writing
+	};
+
+	struct Request
+	{
+		string method;
+		string path;
+		string userAgent;
+		string challenge;
+
+		bool haveContentLength = false;
+		size_t contentLength = 0;
+		bool keepAlive = false;
+	};
+
+	//Part of a reply, either in memory or a range of a manifest sent with sendfile
+	struct ReplySegment
+	{
+		const uint8_t * data;
+		int fd;
+		off_t offset;
+		size_t length;
+	};
+
+	struct Connection
+	{
+		int fd;
+		ConnectionState state = ConnectionState::ReadingHeader;
+		chrono::steady_clock::time_point lastActivity;
+		bool peerClosed = false;
+		bool waitingForOutput = false;
+
+		//May hold the beginning of pipelined requests past the current one
+		string input;
+		size_t headerLength = 0;
+		size_t bodyLength = 0;
+		Request request;
+
+		uint8_t signedChallenge[SIGNED_CHALLENGE_LENGTH];
+		ReplySegment output[4];
+		size_t outputCount = 0;
+		size_t outputIndex = 0;
+		bool closeAfterReply = false;
+
+		explicit Connection(int fd) : fd(fd), lastActivity(chrono::steady_clock::now()) {}
+		~Connection() { close(fd); }
+	};
+
+	const char * statusText(unsigned int code)
+	{
+		switch(code)
+		{
+			case 200:
+				return "200 OK";
+			case 204:
+				return "204 No Content";
+			case 302:
+				return "302 Found";
+			case 400:
+				return "400 Bad Request";
+			default:
+				return "403 Forbidden";
+		}
+	}
+
+	string replyHeader(unsigned int code, size_t contentLength, bool keepAlive)
+	{
+		string header = string("HTTP/1.1 ") + statusText(code) + "\r\nServer: Odin\r\n";
+
+		if(code == 302)
+			header += "Location: http://www.nyan.cat/original\r\n";
+
+		//204 replies can't have a body, and thus no Content-Length
+		if(code != 204)
+			header += "Content-Length: " + to_string(contentLength) + "\r\n";
+
+		return header + (keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+	}
+
+	//Replies without body, built once
+	const string & statusReply(unsigned int code, bool keepAlive)
+	{
+		static const unsigned int codes[] = {204, 302, 400, 403};
+		static const vector<string> replies = []()
+		{
+			vector<string> output;
+			for(const unsigned int replyCode : codes)
+			{
+				output.push_back(replyHeader(replyCode, 0, false));
+				output.push_back(replyHeader(replyCode, 0, true));
+			}
+			return output;
+		}();
+
+		size_t index = 0;
+		while(index + 1 < sizeof(codes) / sizeof(codes[0]) && codes[index] != code)
+			index += 1;
+
+		return replies[2 * index + keepAlive];
+	}
+
+	bool headerNameMatch(const char * line, size_t lineLength, const char * name)
+	{
+		const size_t nameLength = strlen(name);
+		return lineLength > nameLength && line[nameLength] == ':' && strncasecmp(line, name, nameLength) == 0;
+	}
+
+	string headerValue(const char * line, size_t lineLength, size_t nameLength)
+	{
+		size_t start = nameLength + 1, end = lineLength;
+
+		while(start < end && (line[start] == ' ' || line[start] == '\t'))
+			start += 1;
+
+		while(end > start && (line[end - 1] == ' ' || line[end - 1] == '\t'))
+			end -= 1;
+
+		return string(&line[start], end - start);
+	}
+
+	bool parseRequest(const string & raw, size_t headerLength, Request & request)
+	{
+		const char * data = raw.data();
+		const char * lineEnd = (const char *) memmem(data, headerLength, "\r\n", 2);
+
+		//Request line: METHOD PATH VERSION
+		const char * methodEnd = (const char *) memchr(data, ' ', (size_t) (lineEnd - data));
+		if(methodEnd == nullptr)
+			return false;
+
+		const char * pathEnd = (const char *) memchr(methodEnd + 1, ' ', (size_t) (lineEnd - methodEnd - 1));
+		if(pathEnd == nullptr)
+			return false;
+
+		request.method.assign(data, methodEnd);
+		request.path.assign(methodEnd + 1, pathEnd);
+
+		//HTTP/1.1 connections are persistent unless stated otherwise, HTTP/1.0 ones are not
+		request.keepAlive = string(pathEnd + 1, lineEnd) == "HTTP/1.1";
+
+		for(const char * line = lineEnd + 2; line < data + headerLength - 2; line = lineEnd + 2)
+		{
+			lineEnd = (const char *) memmem(line, (size_t) (data + headerLength - line), "\r\n", 2);
+			const size_t lineLength = (size_t) (lineEnd - line);
+
+			if(headerNameMatch(line, lineLength, "User-Agent"))
+				request.userAgent = headerValue(line, lineLength, sizeof("User-Agent") - 1);
+
+			else if(headerNameMatch(line, lineLength, "X-Update-Challenge"))
+				request.challenge = headerValue(line, lineLength, sizeof("X-Update-Challenge") - 1);
+
+			else if(headerNameMatch(line, lineLength, "Connection"))
+			{
+				const string value = headerValue(line, lineLength, sizeof("Connection") - 1);
+
+				if(strcasecmp(value.c_str(), "close") == 0)
+					request.keepAlive = false;
+				else if(strcasecmp(value.c_str(), "keep-alive") == 0)
+					request.keepAlive = true;
+			}
+
+			else if(headerNameMatch(line, lineLength, "Content-Length"))
+			{
+				const string value = headerValue(line, lineLength, sizeof("Content-Length") - 1);
+				char * end;
+
+				request.contentLength = strtoul(value.c_str(), &end, 10);
+				request.haveContentLength = true;
+
+				if(value.empty() || *end != '\0' || request.contentLength > MAX_REQUEST_BODY)
+					return false;
+			}
+		}
+
+		return true;
+	}
+
+	//Lenient like Python's base64.decodebytes: characters outside of the alphabet are skipped
+	size_t decodeBase64(const string & input, uint8_t * output, size_t outputLength)
+	{
+		uint32_t accumulator = 0;
+		uint8_t bitsAvailable = 0;
+		size_t written = 0;
+
+		for(const char c : input)
+		{
+			uint8_t value;
+
+			if(c >= 'A' && c <= 'Z')
+				value = (uint8_t) (c - 'A');
+			else if(c >= 'a' && c <= 'z')
+				value = (uint8_t) (c - 'a' + 26);
+			else if(c >= '0' && c <= '9')
+				value = (uint8_t) (c - '0' + 52);
+			else if(c == '+')
+				value = 62;
+			else if(c == '/')
+				value = 63;
+			else if(c == '=')
+				break;
+			else
+				continue;
+
+			accumulator = (accumulator << 6u) | value;
+			bitsAvailable += 6;
+
+			if(bitsAvailable >= 8)
+			{
+				bitsAvailable -= 8;
+
+				if(written == outputLength)
+					break;
+
+				output[written++] = (uint8_t) (accumulator >> bitsAvailable);
+			}
+		}
+
+		return written;
+	}
+
+	void writeLittleEndian32(uint8_t * output, uint32_t value)
+	{
+		output[0] = (uint8_t) value;
+		output[1] = (uint8_t) (value >> 8u);
+		output[2] = (uint8_t) (value >> 16u);
+		output[3] = (uint8_t) (value >> 24u);
+	}
+
+	void setReply(Connection & connection, const string & header)
+	{
+		connection.output[0] = {(const uint8_t *) header.data(), -1, 0, header.size()};
+		connection.outputCount = 1;
+		connection.outputIndex = 0;
+		connection.state = ConnectionState::Writing;
+	}
+
+	void setStatusReply(Connection & connection, unsigned int code)
+	{
+		//Malformed requests may leave unread data behind, so the connection can't be reused
+		if(code == 400)
+			connection.closeAfterReply = true;
+
+		setReply(connection, statusReply(code, !connection.closeAfterReply));
+	}
+
+	void appendMemory(Connection & connection, const uint8_t * data, size_t length)
+	{
+		if(length != 0)
+			connection.output[connection.outputCount++] = {data, -1, 0, length};
+	}
+
+	void appendFile(Connection & connection, const ManifestView & manifest, size_t offset, size_t length)
+	{
+		if(length != 0)
+			connection.output[connection.outputCount++] = {nullptr, manifest.fd(), manifest.offset() + (off_t) offset, length};
+	}
+
+	void setCork(int fd, bool enable)
+	{
+		const int value = enable;
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+	}
+
+	class ServerWorker
+	{
+		const ServerCatalog & catalog;
+		const int listenSocket;
+		const int stopEvent;
+		int epollFD = -1;
+
+		unordered_map<int, unique_ptr<Connection>> connections;
+		chrono::steady_clock::time_point lastSweep;
+
+		//Resolve the User-Agent. Returns the HTTP code to reply with, or 200 with the version to update
+		unsigned int lookupVersion(const Request & request, const ServedDevice *& device, const ServedVersion *& version, uint32_t & versionNumber) const
+		{
+			const size_t separator = request.userAgent.find('/');
+			if(separator == string::npos)
+				return 403;
+
+			const auto deviceIter = catalog.devices.find(request.userAgent.substr(0, separator));
+			if(deviceIter == catalog.devices.end())
+				return 403;
+
+			const string versionString = request.userAgent.substr(separator + 1);
+			if(versionString.empty())
+				return 403;
+
+			char * end;
+			const unsigned long parsedVersion = strtoul(versionString.c_str(), &end, 10);
+			if(*end != '\0' || parsedVersion > UINT32_MAX)
+				return 403;
+
+			device = &deviceIter->second;
+			versionNumber = (uint32_t) parsedVersion;
+
+			//Up-to-date, or we have nothing to update it with
+			if(versionNumber >= device->currentVersion)
+				return 204;
+
+			const auto versionIter = device->payload.find(versionString);
+			if(versionIter == device->payload.end())
+				return 204;
+
+			version = &versionIter->second;
+			return 200;
+		}
+
+		void processManifest(Connection & connection)
+		{
+			const Request & request = connection.request;
+			const ServedDevice * device;
+			const ServedVersion * version;
+			uint32_t versionNumber;
+
+			const unsigned int code = lookupVersion(request, device, version, versionNumber);
+			if(code != 200)
+				return setStatusReply(connection, code);
+
+			//challenge || version || currentVersion || publicKey || random
+			uint8_t rawChallenge[CHALLENGE_LENGTH + 2 * sizeof(uint32_t) + PUBLIC_KEY_LENGTH + CHALLENGE_RANDOM];
+			if(decodeBase64(request.challenge, rawChallenge, CHALLENGE_LENGTH) != CHALLENGE_LENGTH)
+				return setStatusReply(connection, 403);
+
+			uint8_t * cursor = &rawChallenge[CHALLENGE_LENGTH];
+			writeLittleEndian32(cursor, versionNumber);
+			writeLittleEndian32(cursor + sizeof(uint32_t), device->currentVersion);
+			cursor += 2 * sizeof(uint32_t);
+
+			memcpy(cursor, version->publicKey, PUBLIC_KEY_LENGTH);
+			cursor += PUBLIC_KEY_LENGTH;
+
+			uint8_t * random = &connection.signedChallenge[SIGNATURE_LENGTH];
+			hydro_random_buf(random, CHALLENGE_RANDOM);
+			memcpy(cursor, random, CHALLENGE_RANDOM);
+
+			if(!signBuffer(rawChallenge, sizeof(rawChallenge), connection.signedChallenge, version->privateKey))
+				return setStatusReply(connection, 403);
+
+			//The manifest is sent from the page cache, with the challenge spliced in
+			const size_t manifestLength = version->manifest1.size();
+			const size_t split = version->haveVerificationIndex ? version->verificationIndex : manifestLength;
+
+			setReply(connection, version->manifest1Header[!connection.closeAfterReply]);
+			appendFile(connection, version->manifest1, 0, split);
+			appendMemory(connection, connection.signedChallenge, sizeof(connection.signedChallenge));
+			appendFile(connection, version->manifest1, split, manifestLength - split);
+		}
+
+		void processPayload(Connection & connection)
+		{
+			const ServedDevice * device;
+			const ServedVersion * version;
+			uint32_t versionNumber;
+
+			const unsigned int code = lookupVersion(connection.request, device, version, versionNumber);
+			if(code != 200)
+				return setStatusReply(connection, code);
+
+			//The device must first prove the state of its flash
+			if(connection.bodyLength < version->verification.size() * HASH_LENGTH)
+				return setStatusReply(connection, 403);
+
+			//Constant time compares, so that the expected hashes can't be guessed byte by byte
+			const uint8_t * body = (const uint8_t *) &connection.input[connection.headerLength];
+			bool valid = true;
+
+			for(const auto & hash : version->verification)
+			{
+				valid &= hydro_equal(body, hash.data(), HASH_LENGTH);
+				body += HASH_LENGTH;
+			}
+
+			if(!valid)
+				return setStatusReply(connection, 403);
+
+			setReply(connection, version->manifest2Header[!connection.closeAfterReply]);
+			appendFile(connection, version->manifest2, 0, version->manifest2.size());
+		}
+
+		//Without Content-Length, the Python server reads exactly the hashes it expects
+		size_t expectedBodyLength(const Request & request) const
+		{
+			if(request.haveContentLength)
+				return request.contentLength;
+
+			const ServedDevice * device;
+			const ServedVersion * version;
+			uint32_t versionNumber;
+
+			if(request.method == "POST" && request.path == "/payload" && lookupVersion(request, device, version, versionNumber) == 200)
+				return version->verification.size() * HASH_LENGTH;
+
+			return 0;
+		}
+
+		void dispatchRequest(Connection & connection)
+		{
+			const Request & request = connection.request;
+
+			if(request.method == "GET" && request.path == "/manifest")
+				processManifest(connection);
+
+			else if(request.method == "POST" && request.path == "/payload")
+				processPayload(connection);
+
+			else
+				setStatusReply(connection, 302);
+		}
+
+		//Parse what was received so far, until a reply is ready. Returns false if the connection must be dropped
+		bool processInput(Connection & connection)
+		{
+			if(connection.state == ConnectionState::ReadingHeader)
+			{
+				const size_t headerEnd = connection.input.find("\r\n\r\n");
+				if(headerEnd == string::npos)
+				{
+					if(connection.input.size() > MAX_REQUEST_HEADER)
+					{
+						setStatusReply(connection, 400);
+						return true;
+					}
+
+					return !connection.peerClosed;
+				}
+
+				connection.headerLength = headerEnd + 4;
+				connection.request = Request();
+
+				if(!parseRequest(connection.input, connection.headerLength, connection.request))
+				{
+					setStatusReply(connection, 400);
+					return true;
+				}
+
+				connection.closeAfterReply = !connection.request.keepAlive;
+				connection.bodyLength = expectedBodyLength(connection.request);
+				connection.state = ConnectionState::ReadingBody;
+			}
+
+			if(connection.state == ConnectionState::ReadingBody)
+			{
+				if(connection.input.size() - connection.headerLength >= connection.bodyLength)
+					dispatchRequest(connection);
+
+				//Missing or incomplete hashes
+				else if(connection.peerClosed)
+				{
+					connection.closeAfterReply = true;
+					connection.bodyLength = connection.input.size() - connection.headerLength;
+					setStatusReply(connection, 403);
+				}
+			}
+
+			return true;
+		}
+
+		//Returns false if the peer closed the connection or on error
+		bool readInput(Connection & connection)
+		{
+			char buffer[4096];
+
+			while(!connection.peerClosed)
+			{
+				const ssize_t bytesRead = read(connection.fd, buffer, sizeof(buffer));
+
+				if(bytesRead < 0)
+				{
+					if(errno == EINTR)
+						continue;
+
+					return errno == EAGAIN || errno == EWOULDBLOCK;
+				}
+
+				if(bytesRead == 0)
+					connection.peerClosed = true;
+
+				connection.input.append(buffer, (size_t) bytesRead);
+
+				//Stop buffering once a request is complete, pipelined ones wait for the reply to be sent
+				if(connection.input.size() > MAX_REQUEST_HEADER + MAX_REQUEST_BODY)
+					break;
+			}
+
+			return true;
+		}
+
+		void waitForOutput(Connection & connection, bool enable)
+		{
+			if(connection.waitingForOutput == enable)
+				return;
+
+			epoll_event event{};
+			event.events = enable ? EPOLLOUT : EPOLLIN;
+			event.data.fd = connection.fd;
+			epoll_ctl(epollFD, EPOLL_CTL_MOD, connection.fd, &event);
+			connection.waitingForOutput = enable;
+		}
+
+		//Returns false on error. The reply is complete once outputIndex reaches outputCount
+		bool writeReply(Connection & connection)
+		{
+			//Keep the header, manifest and challenge in full packets
+			const bool corked = connection.outputCount > 1;
+			if(corked && connection.outputIndex == 0)
+				setCork(connection.fd, true);
+
+			while(connection.outputIndex < connection.outputCount)
+			{
+				ReplySegment & segment = connection.output[connection.outputIndex];
+				ssize_t bytesWritten;
+
+				if(segment.fd >= 0)
+				{
+					bytesWritten = sendfile(connection.fd, segment.fd, &segment.offset, segment.length);
+					if(bytesWritten > 0)
+						segment.length -= (size_t) bytesWritten;
+
+					//The manifest shrank since we mapped it, so we can't finish the reply
+					else if(bytesWritten == 0)
+						return false;
+				}
+				else
+				{
+					//Gather the consecutive memory segments
+					iovec vectors[4];
+					size_t numberVectors = 0;
+
+					for(size_t i = connection.outputIndex; i < connection.outputCount && connection.output[i].fd < 0; ++i)
+						vectors[numberVectors++] = {(void *) connection.output[i].data, connection.output[i].length};
+
+					msghdr message{};
+					message.msg_iov = vectors;
+					message.msg_iovlen = numberVectors;
+
+					bytesWritten = sendmsg(connection.fd, &message, MSG_NOSIGNAL);
+
+					//Skip what the kernel accepted
+					for(size_t progress = bytesWritten > 0 ? (size_t) bytesWritten : 0; progress != 0;)
+					{
+						ReplySegment & current = connection.output[connection.outputIndex];
+						const size_t consumed = min(progress, current.length);
+
+						current.data += consumed;
+						current.length -= consumed;
+						progress -= consumed;
+
+						if(current.length == 0)
+							connection.outputIndex += 1;
+					}
+				}
+
+				if(bytesWritten < 0)
+				{
+					if(errno == EINTR)
+						continue;
+
+					if(errno == EAGAIN || errno == EWOULDBLOCK)
+					{
+						waitForOutput(connection, true);
+						return true;
+					}
+
+					return false;
+				}
+
+				if(segment.fd >= 0 && segment.length == 0)
+					connection.outputIndex += 1;
+			}
+
+			if(corked)
+				setCork(connection.fd, false);
+
+			waitForOutput(connection, false);
+			return true;
+		}
+
+		//Forget the request that was just answered, and keep what the client pipelined after it
+		void resetConnection(Connection & connection)
+		{
+			connection.input.erase(0, connection.headerLength + connection.bodyLength);
+			connection.headerLength = connection.bodyLength = 0;
+			connection.outputCount = connection.outputIndex = 0;
+			connection.state = ConnectionState::ReadingHeader;
+		}
+
+		void acceptConnections()
+		{
+			while(true)
+			{
+				const int clientFD = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if(clientFD < 0)
+				{
+					if(errno == EINTR || errno == ECONNABORTED)
+						continue;
+
+					if(errno != EAGAIN && errno != EWOULDBLOCK)
+						cerr << "Couldn't accept a connection: " << strerror(errno) << endl;
+
+					return;
+				}
+
+				//Replies are corked while being assembled, so small ones can go out right away
+				const int yes = 1;
+				setsockopt(clientFD, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+				epoll_event event{};
+				event.events = EPOLLIN;
+				event.data.fd = clientFD;
+
+				if(epoll_ctl(epollFD, EPOLL_CTL_ADD, clientFD, &event) != 0)
+				{
+					close(clientFD);
+					continue;
+				}
+
+				connections[clientFD] = unique_ptr<Connection>(new Connection(clientFD));
+			}
+		}
+
+		//Returns false once the connection can be released
+		bool serviceConnection(Connection & connection)
+		{
+			connection.lastActivity = chrono::steady_clock::now();
+
+			if(connection.state != ConnectionState::Writing && !readInput(connection))
+				return false;
+
+			while(true)
+			{
+				if(connection.state != ConnectionState::Writing)
+				{
+					if(!processInput(connection))
+						return false;
+
+					if(connection.state != ConnectionState::Writing)
+						return true;
+				}
+
+				if(!writeReply(connection))
+					return false;
+
+				if(connection.outputIndex < connection.outputCount)
+					return true;
+
+				if(connection.closeAfterReply)
+					return false;
+
+				//Process the requests already buffered, the socket will signal the others
+				resetConnection(connection);
+
+				if(connection.input.empty() && connection.peerClosed)
+					return false;
+			}
+		}
+
+		void processConnection(int fd)
+		{
+			const auto iter = connections.find(fd);
+			if(iter == connections.end())
+				return;
+
+			//Closing the socket also removes it from the epoll set
+			if(!serviceConnection(*iter->second))
+				connections.erase(iter);
+		}
+
+		//Drop the keep-alive connections devices didn't reuse
+		void closeIdleConnections()
+		{
+			const auto now = chrono::steady_clock::now();
+			if(now - lastSweep < chrono::seconds(1))
+				return;
+
+			lastSweep = now;
+
+			for(auto iter = connections.begin(); iter != connections.end();)
+			{
+				if(now - iter->second->lastActivity > KEEP_ALIVE_TIMEOUT)
+					iter = connections.erase(iter);
+				else
+					++iter;
+			}
+		}
+
+	public:
+		ServerWorker(const ServerCatalog & catalog, int listenSocket, int stopEvent) : catalog(catalog), listenSocket(listenSocket), stopEvent(stopEvent), lastSweep(chrono::steady_clock::now()) {}
+
+		~ServerWorker()
+		{
+			connections.clear();
+
+			if(epollFD >= 0)
+				close(epollFD);
+		}
+
+		bool setup()
+		{
+			epollFD = epoll_create1(EPOLL_CLOEXEC);
+			if(epollFD < 0)
+				return false;
+
+			//Only one of the idle workers is woken up per incoming connection
+			epoll_event event{};
+			event.events = EPOLLIN | EPOLLEXCLUSIVE;
+			event.data.fd = listenSocket;
+			if(epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocket, &event) != 0)
+				return false;
+
+			//The stop event is never read so that it keeps waking up every worker
+			event.events = EPOLLIN;
+			event.data.fd = stopEvent;
+			return epoll_ctl(epollFD, EPOLL_CTL_ADD, stopEvent, &event) == 0;
+		}
+
+		void run()
+		{
+			epoll_event events[EPOLL_BATCH];
+
+			while(true)
+			{
+				const int numberEvents = epoll_wait(epollFD, events, EPOLL_BATCH, 1000);
+				if(numberEvents < 0)
+				{
+					if(errno == EINTR)
+						continue;
+
+					cerr << "epoll_wait failed: " << strerror(errno) << endl;
+					return;
+				}
+
+				for(int i = 0; i < numberEvents; ++i)
+				{
+					const int fd = events[i].data.fd;
+
+					if(fd == stopEvent)
+						return;
+
+					if(fd == listenSocket)
+						acceptConnections();
+					else
+						processConnection(fd);
+				}
+
+				closeIdleConnections();
+			}
+		}
+	};
+
+	OdinServer * activeServer = nullptr;
+
+	void stopActiveServer(int)
+	{
+		if(activeServer != nullptr)
+			activeServer->stop();
+	}
+}
+
+void ServerCatalog::prepareReplies()
+{
+	for(auto & device : devices)
+	{
+		for(auto & entry : device.second.payload)
+		{
+			ServedVersion & version = entry.second;
+
+			for(const bool keepAlive : {false, true})
+			{
+				version.manifest1Header[keepAlive] = replyHeader(200, version.manifest1.size() + SIGNED_CHALLENGE_LENGTH, keepAlive);
+				version.manifest2Header[keepAlive] = replyHeader(200, version.manifest2.size(), keepAlive);
+			}
+		}
+	}
+}
+
+OdinServer::~OdinServer()
+{
+	if(listenSocket >= 0)
+		close(listenSocket);
+
+	if(stopEvent >= 0)
+		close(stopEvent);
+}
+
+bool OdinServer::listen(uint16_t port)
+{
+	listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listenSocket < 0)
+	{
+		cerr << "Couldn't create the server socket: " << strerror(errno) << endl;
+		return false;
+	}
+
+	const int yes = 1;
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	//Same binding as the Python server
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+
+	socklen_t addressLength = sizeof(address);
+	if(bind(listenSocket, (const sockaddr *) &address, sizeof(address)) != 0
+	   || ::listen(listenSocket, SOMAXCONN) != 0
+	   || getsockname(listenSocket, (sockaddr *) &address, &addressLength) != 0)
+	{
+		cerr << "Couldn't listen on port " << port << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	boundPort = ntohs(address.sin_port);
+
+	stopEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(stopEvent < 0)
+	{
+		cerr << "Couldn't create the stop event: " << strerror(errno) << endl;
+		return false;
+	}
+
+	return true;
+}
+
+void OdinServer::workerLoop()
+{
+	//libhydrogen's random state is thread local
+	hydro_init();
+
+	ServerWorker worker(catalog, listenSocket, stopEvent);
+	if(!worker.setup())
+	{
+		cerr << "Couldn't set up a server worker: " << strerror(errno) << endl;
+		return;
+	}
+
+	worker.run();
+}
+
+void OdinServer::run(size_t numberThreads)
+{
+	//Unlike sendmsg, sendfile can't be told not to raise SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	if(numberThreads == 0)
+		numberThreads = 1;
+
+	vector<thread> workers;
+	workers.reserve(numberThreads - 1);
+
+	for(size_t i = 1; i < numberThreads; ++i)
+		workers.emplace_back(&OdinServer::workerLoop, this);
+
+	workerLoop();
+
+	for(auto & worker : workers)
+		worker.join();
+}
+
+void OdinServer::stop()
+{
+	const uint64_t increment = 1;
+	if(write(stopEvent, &increment, sizeof(increment)) < 0)
+		return;
+}
+
+void printServerHelp()
+{
+	cout << "Usage: serve [options]" << endl;
+	cout << "Serve the updates described by Odin's update.json (see hugin/webserver)" << endl << endl;
+	cout << "Options:" << endl;
+	cout << "	--config/-c <file>: update description (default: update/update.json)" << endl;
+	cout << "	--port/-p <port>: port to listen on (default: " << ODIN_DEFAULT_PORT << ")" << endl;
+	cout << "	--threads/-j <count>: number of event loops (default: one per core)" << endl;
+	cout << "	--catalog/-C <file>: serve a binary catalog instead of the update description" << endl;
+	cout << "	--compile <file>: write the update description as a binary catalog then exit" << endl;
+}
+
+bool processServer(int argc, char *argv[])
+{
+	const char * configFile = "update/update.json";
+	const char * binaryCatalog = nullptr;
+	const char * compileOutput = nullptr;
+	unsigned long port = ODIN_DEFAULT_PORT;
+	size_t numberThreads = thread::hardware_concurrency();
+
+	for(int i = 1; i < argc; ++i)
+	{
+		if(i + 1 < argc && (!strcmp(argv[i], "--config") || !strcmp(argv[i], "-c")))
+			configFile = argv[++i];
+
+		else if(i + 1 < argc && (!strcmp(argv[i], "--catalog") || !strcmp(argv[i], "-C")))
+			binaryCatalog = argv[++i];
+
+		else if(i + 1 < argc && !strcmp(argv[i], "--compile"))
+			compileOutput = argv[++i];
+
+		else if(i + 1 < argc && (!strcmp(argv[i], "--port") || !strcmp(argv[i], "-p")))
+		{
+			char * end;
+			port = strtoul(argv[++i], &end, 10);
+			if(*end != '\0' || port > UINT16_MAX)
+			{
+				cerr << "Invalid port " << argv[i] << endl;
+				return false;
+			}
+		}
+
+		else if(i + 1 < argc && (!strcmp(argv[i], "--threads") || !strcmp(argv[i], "-j")))
+		{
+			char * end;
+			numberThreads = strtoul(argv[++i], &end, 10);
+			if(*end != '\0' || numberThreads == 0)
+			{
+				cerr << "Invalid thread count " << argv[i] << endl;
+				return false;
+			}
+		}
+
+		else
+		{
+			cerr << "Unknown argument " << argv[i] << endl;
+			return false;
+		}
+	}
+
+	ServerCatalog catalog;
+	if(binaryCatalog != nullptr ? !catalog.loadFromBinaryCatalog(binaryCatalog) : !catalog.loadFromJson(configFile))
+		return false;
+
+	if(compileOutput != nullptr)
+		return catalog.writeBinaryCatalog(compileOutput);
+
+	OdinServer server(catalog);
+	if(!server.listen((uint16_t) port))
+		return false;
+
+	activeServer = &server;
+	signal(SIGINT, stopActiveServer);
+	signal(SIGTERM, stopActiveServer);
+
+	cout << "Odin listening on port " << server.port() << endl;
+	server.run(numberThreads);
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	activeServer = nullptr;
+
+	cout << "Odin stopped" << endl;
+	return true;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * Purpose: Native implementation of the Odin update server (see webserver/server.py)
+ * @author Emile-Hugo Spir
+ */
+
+#ifndef HUGIN_SERVER_H
+#define HUGIN_SERVER_H
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <sys/types.h>
+#include <crypto_utils.h>
+#include "mapped_file.h"
+#include "update_catalog.h"
+
+#define ODIN_DEFAULT_PORT 8080
+
+//Manifest served from a mapping owned by the ServerCatalog, either its own file or a range of the binary catalog
+class ManifestView
+{
+	const uint8_t * data = nullptr;
+	size_t length = 0;
+	int descriptor = -1;
+	off_t fileOffset = 0;
+
+public:
+	ManifestView() = default;
+	ManifestView(const uint8_t * data, size_t length, int descriptor, off_t fileOffset) : data(data), length(length), descriptor(descriptor), fileOffset(fileOffset) {}
+
+	const uint8_t * bytes() const { return data; }
+	size_t size() const { return length; }
+
+	//Where the manifest starts in fd, for sendfile
+	int fd() const { return descriptor; }
+	off_t offset() const { return fileOffset; }
+};
+
+struct ServedVersion
+{
+	ManifestView manifest1;
+	ManifestView manifest2;
+
+	uint8_t publicKey[PUBLIC_KEY_LENGTH];
+	uint8_t privateKey[hydro_sign_SECRETKEYBYTES];
+	std::string privateKeyPath;
+
+	//Raw hashes the device must send before receiving the manifest 2
+	std::vector<std::array<uint8_t, HASH_LENGTH>> verification;
+
+	//Where the signed challenge is inserted in the manifest 1. Appended if missing
+	bool haveVerificationIndex;
+	size_t verificationIndex;
+
+	//Status line and headers of the 200 replies, indexed by whether the connection is kept alive
+	std::string manifest1Header[2];
+	std::string manifest2Header[2];
+};
+
+struct ServedDevice
+{
+	uint32_t currentVersion;
+
+	//Keyed by the version string the device sends in its User-Agent
+	std::unordered_map<std::string, ServedVersion> payload;
+};
+
+class ServerCatalog
+{
+	//Stable addresses, the views point into them
+	std::deque<MappedFile> mappings;
+	UpdateCatalog binaryCatalog;
+
+public:
+	std::unordered_map<std::string, ServedDevice> devices;
+
+	ServerCatalog() = default;
+	ServerCatalog(const ServerCatalog &) = delete;
+	ServerCatalog & operator=(const ServerCatalog &) = delete;
+	~ServerCatalog();
+
+	//Parse Odin's update.json and map every manifest it references
+	bool loadFromJson(const char * path);
+
+	//Serve the cells of a binary catalog written by writeBinaryCatalog, without parsing any JSON
+	bool loadFromBinaryCatalog(const char * path);
+	bool writeBinaryCatalog(const char * path) const;
+
+	bool mapManifest(const std::string & path, ManifestView & view);
+
+	//Precompute the reply headers once the manifests are mapped. Called by loadFromJson
+	void prepareReplies();
+};
+
+class OdinServer
+{
+	const ServerCatalog & catalog;
+	int listenSocket = -1;
+	int stopEvent = -1;
+	uint16_t boundPort = 0;
+
+	void workerLoop();
+
+public:
+	explicit OdinServer(const ServerCatalog & catalog) : catalog(catalog) {}
+	OdinServer(const OdinServer &) = delete;
+	OdinServer & operator=(const OdinServer &) = delete;
+	~OdinServer();
+
+	//Port 0 picks any free port, reported by port()
+	bool listen(uint16_t port);
+	uint16_t port() const { return boundPort; }
+
+	//Serve until stop() is called, on numberThreads event loops
+	void run(size_t numberThreads);
+
+	//Safe to call from a signal handler
+	void stop();
+};
+
+void printServerHelp();
+bool processServer(int argc, char *argv[]);
+
+bool runServerLoadTest();
+
+#endif //HUGIN_SERVER_H
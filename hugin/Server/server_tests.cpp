@@ -0,0 +1,563 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * Purpose: Load generator checking the replies of the native Odin server
+ * @author Emile-Hugo Spir
+ */
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "server.h"
+
+using namespace std;
+
+#define TEST_CURRENT_VERSION	3u
+#define TEST_CLIENT_THREADS		8
+#define TEST_ROUNDS_PER_CLIENT	100
+
+namespace
+{
+	struct TestVersion
+	{
+		uint32_t number;
+		const ServedVersion * served;
+	};
+
+	string encodeBase64(const uint8_t * data, size_t length)
+	{
+		static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		string output;
+
+		for(size_t i = 0; i < length; i += 3)
+		{
+			const uint32_t block = (uint32_t) data[i] << 16u
+								   | (i + 1 < length ? (uint32_t) data[i + 1] << 8u : 0u)
+								   | (i + 2 < length ? (uint32_t) data[i + 2] : 0u);
+
+			output += alphabet[(block >> 18u) & 0x3fu];
+			output += alphabet[(block >> 12u) & 0x3fu];
+			output += i + 1 < length ? alphabet[(block >> 6u) & 0x3fu] : '=';
+			output += i + 2 < length ? alphabet[block & 0x3fu] : '=';
+		}
+
+		return output;
+	}
+
+	int connectToServer(uint16_t port)
+	{
+		const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0)
+			return -1;
+
+		sockaddr_in address{};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+
+		if(connect(fd, (const sockaddr *) &address, sizeof(address)) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+
+		return fd;
+	}
+
+	bool sendAll(int fd, const string & data)
+	{
+		for(size_t written = 0; written < data.size();)
+		{
+			const ssize_t bytesWritten = send(fd, &data[written], data.size() - written, MSG_NOSIGNAL);
+			if(bytesWritten <= 0)
+				return false;
+
+			written += (size_t) bytesWritten;
+		}
+
+		return true;
+	}
+
+	//Read one reply, delimited by its Content-Length. pending keeps what was received past it
+	bool readReply(int fd, string & pending, unsigned int & code, string & body)
+	{
+		char buffer[16384];
+		size_t headerEnd;
+
+		while((headerEnd = pending.find("\r\n\r\n")) == string::npos)
+		{
+			const ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
+			if(bytesRead <= 0)
+				return false;
+
+			pending.append(buffer, (size_t) bytesRead);
+		}
+
+		if(pending.compare(0, 9, "HTTP/1.1 ") != 0)
+			return false;
+
+		code = (unsigned int) strtoul(&pending[9], nullptr, 10);
+
+		//Only the 204 replies don't carry a Content-Length
+		size_t contentLength = 0;
+		const size_t lengthHeader = pending.find("Content-Length: ");
+		if(lengthHeader < headerEnd)
+			contentLength = strtoul(&pending[lengthHeader + sizeof("Content-Length: ") - 1], nullptr, 10);
+		else if(code != 204)
+			return false;
+
+		while(pending.size() < headerEnd + 4 + contentLength)
+		{
+			const ssize_t bytesRead = read(fd, buffer, sizeof(buffer));
+			if(bytesRead <= 0)
+				return false;
+
+			pending.append(buffer, (size_t) bytesRead);
+		}
+
+		body = pending.substr(headerEnd + 4, contentLength);
+		pending.erase(0, headerEnd + 4 + contentLength);
+		return true;
+	}
+
+	//Send a full request, read the reply and check that the server then closes the connection
+	bool exchange(uint16_t port, const string & request, unsigned int & code, string & body)
+	{
+		const int fd = connectToServer(port);
+		if(fd < 0)
+			return false;
+
+		string pending;
+		bool output = sendAll(fd, request) && shutdown(fd, SHUT_WR) == 0 && readReply(fd, pending, code, body);
+
+		char trailing;
+		output = output && pending.empty() && read(fd, &trailing, 1) == 0;
+
+		close(fd);
+		return output;
+	}
+
+	string userAgentHeader(const char * device, const string & version)
+	{
+		return string("User-Agent: ") + device + "/" + version + "\r\n";
+	}
+
+	bool expectCode(uint16_t port, const string & request, unsigned int expectedCode, const char * description)
+	{
+		unsigned int code;
+		string body;
+
+		if(!exchange(port, request, code, body) || code != expectedCode)
+		{
+			cerr << "Server test failure: " << description << " didn't reply with " << expectedCode << endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	//Fetch the manifest 1 and check the signed challenge spliced in it
+	bool checkManifest(uint16_t port, const TestVersion & version)
+	{
+		uint8_t challenge[64];
+		hydro_random_buf(challenge, sizeof(challenge));
+
+		const string request = "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", to_string(version.number))
+							   + "X-Update-Challenge: " + encodeBase64(challenge, sizeof(challenge)) + "\r\n\r\n";
+
+		unsigned int code;
+		string body;
+		if(!exchange(port, request, code, body) || code != 200)
+		{
+			cerr << "Server test failure: no manifest for version " << version.number << endl;
+			return false;
+		}
+
+		const ServedVersion & served = *version.served;
+		const size_t manifestLength = served.manifest1.size();
+		const size_t split = served.haveVerificationIndex ? served.verificationIndex : manifestLength;
+		const uint8_t * reply = (const uint8_t *) body.data();
+
+		if(body.size() != manifestLength + SIGNATURE_LENGTH + 8
+		   || memcmp(reply, served.manifest1.bytes(), split) != 0
+		   || memcmp(&reply[split + SIGNATURE_LENGTH + 8], served.manifest1.bytes() + split, manifestLength - split) != 0)
+		{
+			cerr << "Server test failure: the manifest of version " << version.number << " is corrupted" << endl;
+			return false;
+		}
+
+		//Rebuild what the server signed: challenge || version || currentVersion || publicKey || random
+		uint8_t rawChallenge[sizeof(challenge) + 8 + PUBLIC_KEY_LENGTH + 8];
+		memcpy(rawChallenge, challenge, sizeof(challenge));
+
+		for(uint8_t i = 0; i < 4; ++i)
+		{
+			rawChallenge[sizeof(challenge) + i] = (uint8_t) (version.number >> (8u * i));
+			rawChallenge[sizeof(challenge) + 4 + i] = (uint8_t) (TEST_CURRENT_VERSION >> (8u * i));
+		}
+
+		memcpy(&rawChallenge[sizeof(challenge) + 8], served.publicKey, PUBLIC_KEY_LENGTH);
+		memcpy(&rawChallenge[sizeof(challenge) + 8 + PUBLIC_KEY_LENGTH], &reply[split + SIGNATURE_LENGTH], 8);
+
+		if(!validateSignature(rawChallenge, sizeof(rawChallenge), &reply[split], served.publicKey))
+		{
+			cerr << "Server test failure: invalid challenge signature for version " << version.number << endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	//Send the verification hashes, possibly corrupted, and check the manifest 2
+	bool checkPayload(uint16_t port, const TestVersion & version, bool corrupt)
+	{
+		string hashes;
+		for(const auto & hash : version.served->verification)
+			hashes.append((const char *) hash.data(), hash.size());
+
+		if(corrupt && !hashes.empty())
+			hashes[hashes.size() / 2] ^= 0x20;
+
+		const string request = "POST /payload HTTP/1.1\r\n" + userAgentHeader("testDevice", to_string(version.number))
+							   + "Content-Length: " + to_string(hashes.size()) + "\r\n\r\n" + hashes;
+
+		unsigned int code;
+		string body;
+		if(!exchange(port, request, code, body))
+		{
+			cerr << "Server test failure: no reply to the payload request of version " << version.number << endl;
+			return false;
+		}
+
+		const bool rejected = corrupt && !hashes.empty();
+		if(rejected)
+		{
+			if(code == 403)
+				return true;
+
+			cerr << "Server test failure: invalid hashes were accepted for version " << version.number << endl;
+			return false;
+		}
+
+		const ManifestView & manifest = version.served->manifest2;
+		if(code != 200 || body.size() != manifest.size() || memcmp(body.data(), manifest.bytes(), manifest.size()) != 0)
+		{
+			cerr << "Server test failure: invalid manifest 2 for version " << version.number << endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	//Several requests on the same connection, first one at a time, then pipelined
+	bool checkKeepAlive(uint16_t port, const TestVersion & interlaced)
+	{
+		const int fd = connectToServer(port);
+		if(fd < 0)
+			return false;
+
+		string hashes;
+		for(const auto & hash : interlaced.served->verification)
+			hashes.append((const char *) hash.data(), hash.size());
+
+		const string userAgent = userAgentHeader("testDevice", to_string(interlaced.number));
+		const string payloadRequest = "POST /payload HTTP/1.1\r\n" + userAgent + "Content-Length: " + to_string(hashes.size()) + "\r\n\r\n" + hashes;
+		const string upToDateRequest = "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", to_string(TEST_CURRENT_VERSION)) + "\r\n";
+
+		struct
+		{
+			string request;
+			unsigned int code;
+			size_t bodyLength;
+		} const steps[] =
+		{
+			{payloadRequest, 200, interlaced.served->manifest2.size()},
+			{"GET / HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello", 302, 0},
+			{payloadRequest, 200, interlaced.served->manifest2.size()},
+			{upToDateRequest, 204, 0},
+			{"POST /elsewhere HTTP/1.1\r\n\r\n", 302, 0},
+			{"GET /manifest HTTP/1.1\r\nConnection: close\r\n" + userAgent + "X-Update-Challenge: AAAA\r\n\r\n", 403, 0},
+		};
+
+		const size_t numberSteps = sizeof(steps) / sizeof(steps[0]);
+		string pending, body;
+		unsigned int code;
+		bool output = true;
+
+		//The first two wait for their reply, the others are sent at once
+		string pipeline;
+		for(size_t i = 0; i < numberSteps; ++i)
+		{
+			if(i < 2)
+				output &= sendAll(fd, steps[i].request);
+			else if(i == 2)
+			{
+				for(size_t j = i; j < numberSteps; ++j)
+					pipeline += steps[j].request;
+
+				output &= sendAll(fd, pipeline);
+			}
+
+			if(!output || !readReply(fd, pending, code, body) || code != steps[i].code || body.size() != steps[i].bodyLength)
+			{
+				cerr << "Server test failure: unexpected reply to request #" << i << " of a persistent connection" << endl;
+				close(fd);
+				return false;
+			}
+		}
+
+		//The last request asked for the connection to be closed
+		char trailing;
+		output = pending.empty() && read(fd, &trailing, 1) == 0;
+		close(fd);
+
+		if(!output)
+			cerr << "Server test failure: the persistent connection wasn't closed when asked" << endl;
+
+		return output;
+	}
+
+	bool checkEdgeCases(uint16_t port)
+	{
+		const string validChallenge = "X-Update-Challenge: " + string(88, 'A') + "\r\n";
+		bool output = true;
+
+		output &= expectCode(port, "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", to_string(TEST_CURRENT_VERSION)) + validChallenge + "\r\n", 204, "an up-to-date device");
+		output &= expectCode(port, "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", "0") + validChallenge + "\r\n", 204, "a version without payload");
+		output &= expectCode(port, "GET /manifest HTTP/1.1\r\n" + userAgentHeader("unknownDevice", "1") + validChallenge + "\r\n", 403, "an unknown device");
+		output &= expectCode(port, "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", "one") + validChallenge + "\r\n", 403, "an invalid version");
+		output &= expectCode(port, "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", "1") + "X-Update-Challenge: AAAA\r\n\r\n", 403, "a short challenge");
+		output &= expectCode(port, "GET /manifest HTTP/1.1\r\n" + userAgentHeader("testDevice", "1") + "\r\n", 403, "a missing challenge");
+		output &= expectCode(port, "POST /payload HTTP/1.1\r\n" + userAgentHeader("testDevice", "1") + "\r\n" + string(HASH_LENGTH, '\0'), 403, "truncated hashes");
+		output &= expectCode(port, "GET / HTTP/1.1\r\n\r\n", 302, "an unknown path");
+		output &= expectCode(port, "garbage\r\n\r\n", 400, "a malformed request");
+
+		return output;
+	}
+
+	bool writeTestFile(const string & path, size_t length, uint8_t seed)
+	{
+		string content(length, '\0');
+		for(size_t i = 0; i < length; ++i)
+			content[i] = (char) (seed + i * 7 + (i >> 9u));
+
+		FILE * file = fopen(path.c_str(), "wb");
+		if(file == nullptr)
+			return false;
+
+		const bool success = fwrite(content.data(), 1, length, file) == length;
+		fclose(file);
+		return success;
+	}
+
+	bool setupVersion(ServerCatalog & catalog, const string & directory, const char * name, ServedVersion & version, size_t manifest1Length, size_t manifest2Length, size_t numberHashes)
+	{
+		const string manifest1 = directory + "/manifest1_" + name, manifest2 = directory + "/manifest2_" + name;
+
+		if(!writeTestFile(manifest1, manifest1Length, (uint8_t) name[0]) || !writeTestFile(manifest2, manifest2Length, (uint8_t) ~name[0]))
+			return false;
+
+		const bool mapped = catalog.mapManifest(manifest1, version.manifest1) && catalog.mapManifest(manifest2, version.manifest2);
+		remove(manifest1.c_str());
+		remove(manifest2.c_str());
+
+		if(!mapped)
+			return false;
+
+		generateKeyMemory(version.privateKey, version.publicKey);
+
+		for(size_t i = 0; i < numberHashes; ++i)
+		{
+			array<uint8_t, HASH_LENGTH> hash{};
+			hydro_random_buf(hash.data(), hash.size());
+			version.verification.push_back(hash);
+		}
+
+		version.haveVerificationIndex = numberHashes != 0;
+		version.verificationIndex = manifest1Length / 3;
+		return true;
+	}
+
+	bool sameVersion(const ServedVersion & reference, const ServedVersion & loaded)
+	{
+		return loaded.manifest1.size() == reference.manifest1.size() && memcmp(loaded.manifest1.bytes(), reference.manifest1.bytes(), reference.manifest1.size()) == 0
+			   && loaded.manifest2.size() == reference.manifest2.size() && memcmp(loaded.manifest2.bytes(), reference.manifest2.bytes(), reference.manifest2.size()) == 0
+			   && loaded.haveVerificationIndex == reference.haveVerificationIndex && (!reference.haveVerificationIndex || loaded.verificationIndex == reference.verificationIndex)
+			   && loaded.verification == reference.verification
+			   && memcmp(loaded.publicKey, reference.publicKey, sizeof(reference.publicKey)) == 0
+			   && memcmp(loaded.privateKey, reference.privateKey, sizeof(reference.privateKey)) == 0;
+	}
+
+	//Compile the catalog to the binary format, reload it and serve a check-in from the catalog mapping
+	bool checkBinaryCatalog(const string & directory, ServerCatalog & catalog)
+	{
+		ServedDevice & device = catalog.devices["testDevice"];
+		for(auto & version : device.payload)
+		{
+			version.second.privateKeyPath = directory + "/key_" + version.first;
+			if(!writeKey(version.second.privateKey, true, version.second.privateKeyPath.c_str()))
+				return false;
+		}
+
+		const string path = directory + "/catalog.bin", bogusPath = directory + "/bogus.bin";
+		ServerCatalog binary;
+		UpdateCatalog index, bogus;
+
+		bool output = catalog.writeBinaryCatalog(path.c_str()) && binary.loadFromBinaryCatalog(path.c_str()) && index.open(path);
+
+		//Our mappings outlive the files
+		remove(path.c_str());
+		for(const auto & version : device.payload)
+			remove(version.second.privateKeyPath.c_str());
+
+		if(!output)
+		{
+			cerr << "Server test failure: couldn't round-trip the binary catalog" << endl;
+			return false;
+		}
+
+		if(index.find("testDevice", 1) == nullptr || index.find("testDevice", 2) == nullptr || index.find("testDevice", TEST_CURRENT_VERSION) != nullptr
+		   || index.find("otherDevice", 1) != nullptr || index.entries().size() != 2 || index.find("testDevice", 1)->toVersion != TEST_CURRENT_VERSION)
+		{
+			cerr << "Server test failure: invalid lookups in the binary catalog" << endl;
+			return false;
+		}
+
+		output = writeTestFile(bogusPath, 4096, 'R');
+		output = output && !bogus.open(bogusPath);
+		remove(bogusPath.c_str());
+
+		if(!output)
+		{
+			cerr << "Server test failure: a corrupted binary catalog was accepted" << endl;
+			return false;
+		}
+
+		const ServedDevice & loaded = binary.devices["testDevice"];
+		if(binary.devices.size() != 1 || loaded.currentVersion != TEST_CURRENT_VERSION || loaded.payload.size() != device.payload.size())
+		{
+			cerr << "Server test failure: the binary catalog lost devices" << endl;
+			return false;
+		}
+
+		for(const auto & version : device.payload)
+		{
+			const auto loadedVersion = loaded.payload.find(version.first);
+			if(loadedVersion == loaded.payload.end() || !sameVersion(version.second, loadedVersion->second))
+			{
+				cerr << "Server test failure: version " << version.first << " changed in the binary catalog" << endl;
+				return false;
+			}
+		}
+
+		OdinServer server(binary);
+		if(!server.listen(0))
+			return false;
+
+		thread serverThread(&OdinServer::run, &server, 1);
+
+		for(const auto & version : loaded.payload)
+		{
+			const TestVersion testVersion = {(uint32_t) stoul(version.first), &version.second};
+			output = output && checkManifest(server.port(), testVersion) && checkPayload(server.port(), testVersion, false) && checkPayload(server.port(), testVersion, true);
+		}
+
+		server.stop();
+		serverThread.join();
+		return output;
+	}
+}
+
+bool runServerLoadTest()
+{
+	cout << "Testing the update server..." << endl;
+
+	char directory[] = "/tmp/huginServerXXXXXX";
+	if(mkdtemp(directory) == nullptr)
+	{
+		cerr << "Couldn't create a temporary directory" << endl;
+		return false;
+	}
+
+	//Version 1 is interlaced and checks the device state, version 2 appends the challenge and skips the check
+	ServerCatalog catalog;
+	ServedDevice & device = catalog.devices["testDevice"];
+	device.currentVersion = TEST_CURRENT_VERSION;
+
+	const bool setup = setupVersion(catalog, directory, "1", device.payload["1"], 3000, 300000, 2)
+					   && setupVersion(catalog, directory, "2", device.payload["2"], 1500, 70000, 0);
+	catalog.prepareReplies();
+
+	if(!setup)
+	{
+		cerr << "Couldn't set up the test catalog" << endl;
+		rmdir(directory);
+		return false;
+	}
+
+	const TestVersion versions[] = {{1, &device.payload["1"]}, {2, &device.payload["2"]}};
+
+	OdinServer server(catalog);
+	if(!server.listen(0))
+		return false;
+
+	thread serverThread(&OdinServer::run, &server, 4);
+	bool output = checkEdgeCases(server.port());
+	output &= checkKeepAlive(server.port(), versions[0]);
+	output &= checkBinaryCatalog(directory, catalog);
+	rmdir(directory);
+
+	//Concurrent check-ins: each round fetches both manifests then tries both payloads, once with bad hashes
+	atomic<bool> failed(false);
+	atomic<size_t> requests(0);
+	vector<thread> clients;
+
+	const auto start = chrono::steady_clock::now();
+	for(size_t i = 0; i < TEST_CLIENT_THREADS; ++i)
+	{
+		clients.emplace_back([&]()
+		{
+			hydro_init();
+
+			for(size_t round = 0; round < TEST_ROUNDS_PER_CLIENT && !failed; ++round)
+			{
+				for(const TestVersion & version : versions)
+				{
+					if(!checkManifest(server.port(), version) || !checkPayload(server.port(), version, false) || !checkPayload(server.port(), version, true))
+						failed = true;
+
+					requests += 3;
+				}
+			}
+		});
+	}
+
+	for(auto & client : clients)
+		client.join();
+
+	const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	server.stop();
+	serverThread.join();
+
+	output &= !failed;
+	if(output)
+		cout << "Server test successful! (" << requests << " requests, " << (size_t) (requests / elapsed) << " requests/s)" << endl << endl;
+	else
+		cout << "Server test failure!" << endl << endl;
+
+	return output;
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include "update_catalog.h"
+
+using namespace std;
+
+//FNV-1a over the device name then the version
+static uint64_t hashKey(const char * device, size_t deviceLength, uint32_t fromVersion)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for(size_t i = 0; i < deviceLength; ++i)
+		hash = (hash ^ (uint8_t) device[i]) * 0x100000001b3ull;
+
+	for(uint8_t i = 0; i < 4; ++i)
+		hash = (hash ^ (uint8_t) (fromVersion >> (8u * i))) * 0x100000001b3ull;
+
+	return hash;
+}
+
+static bool inBounds(uint64_t offset, uint64_t length, uint64_t start, uint64_t end)
+{
+	return offset >= start && offset <= end && length <= end - offset;
+}
+
+bool UpdateCatalog::validateEntry(const UpdateCatalogEntry & entry) const
+{
+	const uint64_t stringsStart = header->stringsOffset, fileSize = header->fileSize;
+
+	if(!inBounds(stringsStart + entry.deviceOffset, entry.deviceLength, stringsStart, fileSize))
+		return false;
+
+	if((entry.flags & UPDATE_CATALOG_HAS_MANIFEST1) && !inBounds(entry.manifest1Offset, entry.manifest1Size, stringsStart, fileSize))
+		return false;
+
+	if((entry.flags & UPDATE_CATALOG_HAS_KEYS) && !inBounds(stringsStart + entry.privateKeyOffset, entry.privateKeyLength, stringsStart, fileSize))
+		return false;
+
+	if(entry.verificationIndex != UPDATE_CATALOG_NO_INDEX && entry.verificationIndex > entry.manifest1Size)
+		return false;
+
+	return inBounds(entry.manifest2Offset, entry.manifest2Size, stringsStart, fileSize)
+		   && entry.verificationOffset % alignof(UpdateCatalogRange) == 0
+		   && inBounds(entry.verificationOffset, (uint64_t) entry.verificationCount * sizeof(UpdateCatalogRange), stringsStart, fileSize);
+}
+
+bool UpdateCatalog::open(const string & path)
+{
+	header = nullptr;
+	slots = nullptr;
+
+	if(!file.map(path))
+	{
+		cerr << "Couldn't map the catalog " << path << endl;
+		return false;
+	}
+
+	const auto * candidate = (const UpdateCatalogHeader *) file.bytes();
+	if(file.size() < sizeof(UpdateCatalogHeader) || memcmp(candidate->magic, UPDATE_CATALOG_MAGIC, sizeof(candidate->magic)) != 0
+	   || candidate->formatVersion != UPDATE_CATALOG_FORMAT_VERSION || candidate->fileSize != file.size()
+	   || candidate->slotCount == 0 || (candidate->slotCount & (candidate->slotCount - 1)) != 0 || candidate->entryCount > candidate->slotCount
+	   || candidate->stringsOffset != sizeof(UpdateCatalogHeader) + (uint64_t) candidate->slotCount * sizeof(UpdateCatalogEntry)
+	   || candidate->stringsOffset > candidate->fileSize)
+	{
+		cerr << "Invalid catalog " << path << endl;
+		return false;
+	}
+
+	header = candidate;
+	slots = (const UpdateCatalogEntry *) &file.bytes()[sizeof(UpdateCatalogHeader)];
+
+	size_t used = 0;
+	for(uint32_t i = 0; i < header->slotCount; ++i)
+	{
+		if((slots[i].flags & UPDATE_CATALOG_USED) == 0)
+			continue;
+
+		used += 1;
+		if(!validateEntry(slots[i]))
+		{
+			cerr << "Invalid catalog " << path << ": entry " << i << " is out of bounds" << endl;
+			header = nullptr;
+			return false;
+		}
+	}
+
+	//The lookups rely on at least one empty slot to stop probing
+	if(used != header->entryCount || used == header->slotCount)
+	{
+		cerr << "Invalid catalog " << path << ": inconsistent entry count" << endl;
+		header = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+const UpdateCatalogEntry * UpdateCatalog::find(const string & device, uint32_t fromVersion) const
+{
+	const uint32_t mask = header->slotCount - 1;
+	const char * strings = (const char *) bytes(header->stringsOffset);
+
+	for(uint32_t slot = (uint32_t) hashKey(device.data(), device.size(), fromVersion) & mask;; slot = (slot + 1) & mask)
+	{
+		const UpdateCatalogEntry & entry = slots[slot];
+
+		if((entry.flags & UPDATE_CATALOG_USED) == 0)
+			return nullptr;
+
+		if(entry.fromVersion == fromVersion && entry.deviceLength == device.size() && memcmp(&strings[entry.deviceOffset], device.data(), device.size()) == 0)
+			return &entry;
+	}
+}
+
+vector<const UpdateCatalogEntry *> UpdateCatalog::entries() const
+{
+	vector<const UpdateCatalogEntry *> output;
+
+	for(uint32_t i = 0; i < header->slotCount; ++i)
+	{
+		if(slots[i].flags & UPDATE_CATALOG_USED)
+			output.push_back(&slots[i]);
+	}
+
+	return output;
+}
+
+string UpdateCatalog::device(const UpdateCatalogEntry & entry) const
+{
+	return string((const char *) bytes(header->stringsOffset + entry.deviceOffset), entry.deviceLength);
+}
+
+string UpdateCatalog::privateKeyPath(const UpdateCatalogEntry & entry) const
+{
+	return string((const char *) bytes(header->stringsOffset + entry.privateKeyOffset), entry.privateKeyLength);
+}
+
+static uint64_t alignData(uint64_t offset)
+{
+	return (offset + 7u) & ~(uint64_t) 7u;
+}
+
+bool UpdateCatalogWriter::write(const string & path) const
+{
+	//Keep the load factor under 50%
+	uint32_t slotCount = 2;
+	while(slotCount < 2 * cells.size())
+		slotCount <<= 1u;
+
+	vector<UpdateCatalogEntry> slots(slotCount);
+	string strings;
+	const uint64_t stringsOffset = sizeof(UpdateCatalogHeader) + (uint64_t) slotCount * sizeof(UpdateCatalogEntry);
+
+	//First pass: place the entries and the strings
+	vector<UpdateCatalogEntry *> placed;
+	for(const auto & cell : cells)
+	{
+		if(cell.device.size() > UINT16_MAX || cell.privateKeyPath.size() > UINT16_MAX || cell.manifest1Size > UINT32_MAX || cell.manifest2Size > UINT32_MAX)
+		{
+			cerr << "Catalog cell " << cell.device << "/" << cell.fromVersion << " is too large" << endl;
+			return false;
+		}
+
+		uint32_t slot = (uint32_t) hashKey(cell.device.data(), cell.device.size(), cell.fromVersion) & (slotCount - 1);
+		while(slots[slot].flags & UPDATE_CATALOG_USED)
+		{
+			const UpdateCatalogEntry & other = slots[slot];
+			if(other.fromVersion == cell.fromVersion && other.deviceLength == cell.device.size() && strings.compare(other.deviceOffset, other.deviceLength, cell.device) == 0)
+			{
+				cerr << "Duplicate catalog cell " << cell.device << "/" << cell.fromVersion << endl;
+				return false;
+			}
+
+			slot = (slot + 1) & (slotCount - 1);
+		}
+
+		UpdateCatalogEntry & entry = slots[slot];
+		memset(&entry, 0, sizeof(entry));
+
+		entry.flags = UPDATE_CATALOG_USED;
+		entry.deviceOffset = (uint32_t) strings.size();
+		entry.deviceLength = (uint16_t) cell.device.size();
+		strings += cell.device;
+
+		entry.fromVersion = cell.fromVersion;
+		entry.toVersion = cell.toVersion;
+		entry.manifest1Size = (uint32_t) cell.manifest1Size;
+		entry.manifest2Size = (uint32_t) cell.manifest2Size;
+		entry.verificationCount = (uint32_t) cell.verification.size();
+		entry.verificationIndex = cell.verificationIndex;
+
+		if(cell.manifest1 != nullptr)
+			entry.flags |= UPDATE_CATALOG_HAS_MANIFEST1;
+
+		if(cell.haveKeys)
+		{
+			entry.flags |= UPDATE_CATALOG_HAS_KEYS;
+			entry.privateKeyOffset = (uint32_t) strings.size();
+			entry.privateKeyLength = (uint16_t) cell.privateKeyPath.size();
+			strings += cell.privateKeyPath;
+			memcpy(entry.publicKey, cell.publicKey, sizeof(entry.publicKey));
+		}
+
+		if(cell.haveSources)
+		{
+			entry.flags |= UPDATE_CATALOG_HAS_SOURCES;
+			memcpy(entry.sourceHash, cell.sourceHash, sizeof(entry.sourceHash));
+			memcpy(entry.targetHash, cell.targetHash, sizeof(entry.targetHash));
+		}
+
+		placed.push_back(&entry);
+	}
+
+	if(strings.size() > UINT32_MAX)
+	{
+		cerr << "The catalog string pool is too large" << endl;
+		return false;
+	}
+
+	//Second pass: lay the data out
+	uint64_t offset = stringsOffset + strings.size();
+	for(size_t i = 0; i < cells.size(); ++i)
+	{
+		UpdateCatalogEntry & entry = *placed[i];
+
+		entry.manifest1Offset = offset = alignData(offset);
+		offset += cells[i].manifest1Size;
+
+		entry.manifest2Offset = offset = alignData(offset);
+		offset += cells[i].manifest2Size;
+
+		entry.verificationOffset = offset = alignData(offset);
+		offset += cells[i].verification.size() * sizeof(UpdateCatalogRange);
+	}
+
+	UpdateCatalogHeader header{};
+	memcpy(header.magic, UPDATE_CATALOG_MAGIC, sizeof(header.magic));
+	header.formatVersion = UPDATE_CATALOG_FORMAT_VERSION;
+	header.slotCount = slotCount;
+	header.entryCount = (uint32_t) cells.size();
+	header.parameters = parameters;
+	header.stringsOffset = stringsOffset;
+	header.fileSize = offset;
+
+	const string temporaryPath = path + ".tmp";
+	FILE * output = fopen(temporaryPath.c_str(), "wb");
+	if(output == nullptr)
+	{
+		cerr << "Couldn't write the catalog " << temporaryPath << endl;
+		return false;
+	}
+
+	const uint8_t padding[8] = {0};
+	bool success = fwrite(&header, sizeof(header), 1, output) == 1
+				   && fwrite(slots.data(), sizeof(UpdateCatalogEntry), slots.size(), output) == slots.size()
+				   && fwrite(strings.data(), 1, strings.size(), output) == strings.size();
+
+	uint64_t written = stringsOffset + strings.size();
+	const auto writeAligned = [&](const void * data, size_t length)
+	{
+		const uint64_t aligned = alignData(written);
+		success = success && fwrite(padding, 1, aligned - written, output) == aligned - written;
+		success = success && (length == 0 || fwrite(data, 1, length, output) == length);
+		written = aligned + length;
+	};
+
+	for(const auto & cell : cells)
+	{
+		writeAligned(cell.manifest1, cell.manifest1Size);
+		writeAligned(cell.manifest2, cell.manifest2Size);
+		writeAligned(cell.verification.data(), cell.verification.size() * sizeof(UpdateCatalogRange));
+	}
+
+	success = success && written == offset;
+	success = fclose(output) == 0 && success;
+
+	if(!success || rename(temporaryPath.c_str(), path.c_str()) != 0)
+	{
+		cerr << "Couldn't write the catalog " << path << endl;
+		remove(temporaryPath.c_str());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * Purpose: Memory-mappable index of the delta matrix, keyed by (device, fromVersion)
+ * @author Emile-Hugo Spir
+ *
+ * Layout, every integer in little endian:
+ *
+ *	UpdateCatalogHeader
+ *	UpdateCatalogEntry[slotCount]	Open addressing table, slotCount is a power of two
+ *	String pool						Device names and private key paths
+ *	Data							Manifests and UpdateCatalogRange arrays, each aligned on 8 bytes
+ *
+ * The batch command fills the manifest 2 of the cells, Hugin serve --compile the whole entries from Odin's update.json.
+ */
+
+#ifndef HUGIN_UPDATE_CATALOG_H
+#define HUGIN_UPDATE_CATALOG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+#define UPDATE_CATALOG_MAGIC			"RAVC"
+#define UPDATE_CATALOG_FORMAT_VERSION	1u
+#define UPDATE_CATALOG_NO_INDEX			UINT32_MAX
+
+#define UPDATE_CATALOG_USED				0x1u
+#define UPDATE_CATALOG_HAS_MANIFEST1	0x2u
+#define UPDATE_CATALOG_HAS_KEYS			0x4u
+#define UPDATE_CATALOG_HAS_SOURCES		0x8u	//sourceHash and targetHash are set
+
+//What the cells were generated with. Cells produced with other parameters can't be reused
+struct UpdateCatalogParameters
+{
+	uint8_t manifestFormat;
+	uint8_t flashSizeBit;
+	uint8_t pageSizeBit;
+	uint8_t compressionLevel;
+	uint32_t rangeOverhead;
+
+	bool operator==(const UpdateCatalogParameters & other) const
+	{
+		return manifestFormat == other.manifestFormat && flashSizeBit == other.flashSizeBit && pageSizeBit == other.pageSizeBit
+			   && compressionLevel == other.compressionLevel && rangeOverhead == other.rangeOverhead;
+	}
+};
+
+struct UpdateCatalogHeader
+{
+	char magic[4];
+	uint16_t formatVersion;
+	uint16_t reserved;
+	uint32_t slotCount;
+	uint32_t entryCount;
+	UpdateCatalogParameters parameters;
+	uint64_t stringsOffset;
+	uint64_t fileSize;
+};
+
+struct UpdateCatalogEntry
+{
+	uint32_t deviceOffset;
+	uint16_t deviceLength;
+	uint16_t flags;
+	uint32_t fromVersion;
+	uint32_t toVersion;
+
+	uint64_t manifest1Offset;
+	uint64_t manifest2Offset;
+	uint32_t manifest1Size;
+	uint32_t manifest2Size;
+
+	//Ranges the device must prove the state of before receiving the manifest 2
+	uint64_t verificationOffset;
+	uint32_t verificationCount;
+	uint32_t verificationIndex;
+
+	uint32_t privateKeyOffset;
+	uint16_t privateKeyLength;
+	uint16_t reserved;
+	uint8_t publicKey[32];
+
+	//SHA-256 of the binaries the cell was generated from
+	uint8_t sourceHash[32];
+	uint8_t targetHash[32];
+};
+
+struct UpdateCatalogRange
+{
+	uint32_t start;
+	uint16_t length;
+	uint16_t reserved;
+	uint8_t hash[32];
+};
+
+static_assert(sizeof(UpdateCatalogHeader) == 40, "The catalog header must be packed");
+static_assert(sizeof(UpdateCatalogEntry) == 160, "The catalog entries must be packed");
+static_assert(sizeof(UpdateCatalogRange) == 40, "The catalog ranges must be packed");
+
+class UpdateCatalog
+{
+	MappedFile file;
+	const UpdateCatalogHeader * header = nullptr;
+	const UpdateCatalogEntry * slots = nullptr;
+
+	bool validateEntry(const UpdateCatalogEntry & entry) const;
+
+public:
+	//Map and validate the whole catalog, so that lookups don't have to check bounds
+	bool open(const std::string & path);
+
+	bool isOpen() const { return header != nullptr; }
+	const UpdateCatalogParameters & parameters() const { return header->parameters; }
+	int fd() const { return file.fd(); }
+
+	//O(1) on average, nullptr if the cell is missing
+	const UpdateCatalogEntry * find(const std::string & device, uint32_t fromVersion) const;
+
+	//Every used slot, in table order
+	std::vector<const UpdateCatalogEntry *> entries() const;
+
+	std::string device(const UpdateCatalogEntry & entry) const;
+	std::string privateKeyPath(const UpdateCatalogEntry & entry) const;
+	const uint8_t * bytes(uint64_t offset) const { return file.bytes() + offset; }
+	const UpdateCatalogRange * ranges(const UpdateCatalogEntry & entry) const { return (const UpdateCatalogRange *) bytes(entry.verificationOffset); }
+};
+
+//Cell to write. The data pointers must stay valid until UpdateCatalogWriter::write returns
+struct UpdateCatalogCell
+{
+	std::string device;
+	uint32_t fromVersion;
+	uint32_t toVersion;
+
+	const uint8_t * manifest1 = nullptr;
+	size_t manifest1Size = 0;
+	const uint8_t * manifest2 = nullptr;
+	size_t manifest2Size = 0;
+
+	std::vector<UpdateCatalogRange> verification;
+	uint32_t verificationIndex = UPDATE_CATALOG_NO_INDEX;
+
+	bool haveKeys = false;
+	std::string privateKeyPath;
+	uint8_t publicKey[32] = {};
+
+	bool haveSources = false;
+	uint8_t sourceHash[32] = {};
+	uint8_t targetHash[32] = {};
+};
+
+class UpdateCatalogWriter
+{
+	UpdateCatalogParameters parameters;
+	std::vector<UpdateCatalogCell> cells;
+
+public:
+	explicit UpdateCatalogWriter(const UpdateCatalogParameters & parameters) : parameters(parameters) {}
+
+	void add(UpdateCatalogCell && cell) { cells.emplace_back(std::move(cell)); }
+
+	//Written next to path then renamed, so that servers mapping the previous catalog keep a consistent view
+	bool write(const std::string & path) const;
+};
+
+#endif //HUGIN_UPDATE_CATALOG_H
@@ -16,6 +16,7 @@
 #include <vector>
 #include <crypto/crypto_utils.h>
 #include "CLI/scheduler_cli.h"
+#include "Server/server.h"
 
 extern "C"
 {
@@ -29,6 +30,7 @@ bool processCrypto(int argc, char const *argv[]);
 
 bool performStaticTests();
 bool runDynamicTestWithFiles(const char * original, const char * newFile);
+bool runPowerCutTest();
 bool testCrypto();
 
 int main(int argc, char *argv[])
@@ -58,6 +60,14 @@ int main(int argc, char *argv[])
 
 			return 0;
 		}
+
+		else if(!strcmp(argv[1], "serve"))
+		{
+			if(!processServer(argc - 1, &argv[1]))
+				printServerHelp();
+
+			return 0;
+		}
 		else if(!strcmp(argv[1], "test"))
 		{
 			cout << "Validating the code generation..." << endl << "	";
@@ -65,13 +75,17 @@ int main(int argc, char *argv[])
 			output &= runDynamicTestWithFiles("/bin/ls", "/bin/cat");
 			output &= runDynamicTestWithFiles("test1_v1.bin", "test1_v2.bin");
 			output &= runDynamicTestWithFiles("test2_v1.bin", "test2_v2.bin");
+			output &= runPowerCutTest();
 
 			cout << endl << "Validation cryptographic primitives" << endl;
 			output &= testCrypto();
+
+			cout << endl;
+			output &= runServerLoadTest();
 			return !output;
 		}
 	}
 
-	cerr << "Expected syntax: " << argv[0] << " [crypto | diff | authenticate | test]" << endl;
+	cerr << "Expected syntax: " << argv[0] << " [crypto | diff | authenticate | serve | test]" << endl;
 	return -1;
 }
@@ -9,6 +9,7 @@ or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
 import base64
 import binascii
 import subprocess
+import threading
 
 
 def sendFileContent(handler, filename):
@@ -93,14 +94,68 @@ def replyChallenge(deviceData, ver, challenge):
 	except IOError:
 		return False, ""
 
-	process = subprocess.Popen((deviceData['sign_util'], 'crypto', '--signString', rawChallenge.hex(), deviceData['payload'][ver]['privateKey']), stdout=subprocess.PIPE)
-	process.wait()
-	outputRaw = process.stdout.read().decode("utf-8").split(' ')
-
-	if outputRaw[0] != 'Signature:':
-		return False
+	status, signature = getSigningDaemon(deviceData['sign_util']).sign(deviceData['payload'][ver]['privateKey'], rawChallenge)
+	if not status:
+		return False, ""
 
-	signedChallenge = binascii.unhexlify(outputRaw[1])
+	signedChallenge = signature
 	signedChallenge += random
 
 	return True, signedChallenge
+
+
+class SigningDaemon:
+	"""Long-lived `Hugin crypto --signDaemon`, which keeps the update keys loaded between challenges"""
+
+	def __init__(self, signUtil):
+		self.signUtil = signUtil
+		self.process = None
+		self.lock = threading.Lock()
+
+	def readExactly(self, length):
+		data = self.process.stdout.read(length)
+		if data is None or len(data) != length:
+			raise IOError("The signing daemon stopped")
+		return data
+
+	def signBatch(self, requests):
+		"""Sign a list of (privateKeyPath, message). Returns a list of (status, signature)"""
+
+		frame = bytearray(len(requests).to_bytes(2, 'little'))
+		for keyPath, message in requests:
+			path = keyPath.encode()
+			frame += len(path).to_bytes(2, 'little') + path
+			frame += len(message).to_bytes(4, 'little') + message
+
+		with self.lock:
+			try:
+				if self.process is None or self.process.poll() is not None:
+					self.process = subprocess.Popen((self.signUtil, 'crypto', '--signDaemon'), stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+				self.process.stdin.write(len(frame).to_bytes(4, 'little') + frame)
+				self.process.stdin.flush()
+
+				reply = self.readExactly(int.from_bytes(self.readExactly(4), 'little'))
+			except (IOError, OSError):
+				self.process = None
+				return [(False, b"")] * len(requests)
+
+		output = []
+		for i in range(int.from_bytes(reply[:2], 'little')):
+			entry = reply[2 + i * 65: 2 + (i + 1) * 65]
+			output.append((entry[0] == 1, bytes(entry[1:])))
+
+		return output
+
+	def sign(self, keyPath, message):
+		return self.signBatch([(keyPath, message)])[0]
+
+
+signingDaemons = {}
+
+
+def getSigningDaemon(signUtil):
+	if signUtil not in signingDaemons:
+		signingDaemons[signUtil] = SigningDaemon(signUtil)
+
+	return signingDaemons[signUtil]
@@ -16,6 +16,7 @@
 #include "execution.h"
 #include "../core.h"
 #include <memory.h>
+#include <sys/param.h>
 
 typedef struct
 {
@@ -23,96 +24,80 @@ typedef struct
 	size_t chainAddress : 31;
 } ChainAddress;
 
-static uint8_t writeCache[WRITE_GRANULARITY] = {0};
-static uint8_t currentWriteCachePos = 0;
-static size_t prevDest = 0;
+//Counter value at which we stop fast forwarding
+static size_t fastForwardTarget = 0;
 
-RAVENS_CRITICAL void performCopyWithCache(size_t dest, const uint8_t * source, size_t length)
+//Whether cacheRAM changed since its last backup, and which space holds that backup. Both only depend on the commands, so fast forwarding replays them
+static bool cacheDirty = true;
+static bool backupInSecondSpace = true;
+
+RAVENS_CRITICAL void performCopy(const DecodedCommand decodedCommand)
 {
-	//The previous write was misaligned
-	if(currentWriteCachePos != 0)
+	if(decodedCommand.command == OPCODE_COPY_CC)
 	{
-		//Next write doesn't follow the previous one, we need to flush the cache
-		if(dest <= prevDest || prevDest + WRITE_GRANULARITY <= dest)
-		{
-			writeToNAND(dest, currentWriteCachePos, writeCache);
-			currentWriteCachePos = 0;
-		}
+		memmove(&cacheRAM[decodedCommand.secondaryAddress], &cacheRAM[decodedCommand.mainAddress], decodedCommand.length);
+	}
+	else if(decodedCommand.command == OPCODE_COPY_CN)
+	{
+		bufferedWriteToNAND(decodedCommand.secondaryAddress, decodedCommand.length, &cacheRAM[decodedCommand.mainAddress]);
+	}
+	else if(decodedCommand.command == OPCODE_COPY_NC)
+	{
+		readThroughWriteBuffer(&cacheRAM[decodedCommand.secondaryAddress], decodedCommand.mainAddress, decodedCommand.length);
+	}
+	else if(decodedCommand.command == OPCODE_COPY_NN)
+	{
+		const size_t source = decodedCommand.mainAddress;
+
+		if(!writeBufferOverlaps(source, decodedCommand.length))
+			bufferedWriteToNAND(decodedCommand.secondaryAddress, decodedCommand.length, FLASH_READ_POINTER(source));
+
+		//Part of the source is still in the write buffer, so we go through a bounce buffer
 		else
 		{
-			//The next write isn't stricly following the previous one. We pad the write cache
-			if(prevDest + currentWriteCachePos != dest)
-			{
-				memset(&writeCache[currentWriteCachePos], 0xff, WRITE_GRANULARITY - (dest & WRITE_GRANULARITY_MASK));
-				currentWriteCachePos += dest & WRITE_GRANULARITY_MASK;
-			}
+			uint8_t buffer[WRITE_GRANULARITY];
 
-			const uint8_t lengthLeft = (const uint8_t) (WRITE_GRANULARITY - currentWriteCachePos);
-
-			//don't have enough data to fill the buffer
-			if(length < lengthLeft)
-			{
-				memcpy(&writeCache[currentWriteCachePos], source, length);
-				currentWriteCachePos += length;
-				return;
-			}
-			else
+			for(size_t offset = 0; offset < decodedCommand.length; offset += sizeof(buffer))
 			{
-				memcpy(&writeCache[currentWriteCachePos], source, lengthLeft);
-				writeToNAND(prevDest, WRITE_GRANULARITY, writeCache);
+				const size_t length = MIN(sizeof(buffer), decodedCommand.length - offset);
 
-				//Move the read/write head forward
-				source += lengthLeft;
-				dest += lengthLeft;
-				length -= lengthLeft;
-
-				currentWriteCachePos = 0;
+				readThroughWriteBuffer(buffer, source + offset, length);
+				bufferedWriteToNAND(decodedCommand.secondaryAddress + offset, length, buffer);
 			}
 		}
 	}
-
-	//Perform the aligned write
-	writeToNAND(dest, length & ~WRITE_GRANULARITY_MASK, source);
-
-	//The end of the write isn't aligned
-	if(length & WRITE_GRANULARITY_MASK)
-	{
-		const size_t lengthWritten = length & ~WRITE_GRANULARITY_MASK;
-
-		currentWriteCachePos = (uint8_t) (length - lengthWritten);
-		memcpy(writeCache, &source[lengthWritten], currentWriteCachePos);
-		prevDest = dest + lengthWritten;
-	}
 }
 
-RAVENS_CRITICAL void flushCopyCache()
+//Space holding the last cache backup of the commands, which the BSDiff must not reuse for its first page
+RAVENS_CRITICAL bool lastBackupInSecondSpace()
 {
-	if(currentWriteCachePos != 0)
-	{
-		memset(&writeCache[currentWriteCachePos], 0xff, WRITE_GRANULARITY - currentWriteCachePos);
-		writeToNAND(prevDest, WRITE_GRANULARITY, writeCache);
-		currentWriteCachePos = 0;
-	}
+	return backupInSecondSpace;
 }
 
-RAVENS_CRITICAL void performCopy(const DecodedCommand decodedCommand)
+//Signal we're about to erase something, backing up the cache first if it changed
+RAVENS_CRITICAL void prepareErase(size_t * stepCount, bool * fastForward)
 {
-	if(decodedCommand.command == OPCODE_COPY_CC)
-	{
-		memmove(&cacheRAM[decodedCommand.secondaryAddress], &cacheRAM[decodedCommand.mainAddress], decodedCommand.length);
-	}
-	else if(decodedCommand.command == OPCODE_COPY_CN)
-	{
-		performCopyWithCache(decodedCommand.secondaryAddress, &cacheRAM[decodedCommand.mainAddress], decodedCommand.length);
-	}
-	else if(decodedCommand.command == OPCODE_COPY_NC)
-	{
-		memcpy(&cacheRAM[decodedCommand.secondaryAddress], (uint8_t *) decodedCommand.mainAddress, decodedCommand.length);
-	}
-	else if(decodedCommand.command == OPCODE_COPY_NN)
+	//Increase the counter signaling we're about to back up our cache
+	incrementCounter(stepCount, fastForwardTarget, fastForward);
+
+	if(cacheDirty)
 	{
-		performCopyWithCache(decodedCommand.secondaryAddress, (const uint8_t *) decodedCommand.mainAddress, decodedCommand.length);
+		backupInSecondSpace = !backupInSecondSpace;
+		cacheDirty = false;
+
+		//Backup the cache if not fast forwarding
+		if(!*fastForward)
+			backupCache(backupInSecondSpace);
 	}
+
+	const bool wasFastForwarding = *fastForward;
+
+	//Increase the counter signaling we backed up our cache before erasing something
+	incrementCounter(stepCount, fastForwardTarget, fastForward);
+
+	//We resume right before this erase, with the cache as it was last backed up
+	if(wasFastForwarding && !*fastForward)
+		restoreCache(backupInSecondSpace);
 }
 
 RAVENS_CRITICAL bool processInstruction(const DecodedCommand decodedCommand, size_t * stepCount, ChainAddress *chainAddress, bool * fastForward)
@@ -229,25 +214,40 @@ RAVENS_CRITICAL bool processInstruction(const DecodedCommand decodedCommand, siz
 		case OPCODE_ERASE:
 		{
 			//Dry run
-			if(stepCount == NULL)
+			if(fastForward == NULL)
 				break;
 
-			flushCopyCache();
+			flushWriteBuffer();
+			prepareErase(stepCount, fastForward);
+
+			if(!*fastForward)
+				erasePage(decodedCommand.mainAddress);
 
-			const size_t oldCounter = getCurrentCounter();
+			break;
+		}
 
-			//Increase the counter signaling we're about to back up our cache
-			incrementCounter(stepCount, oldCounter, fastForward);
+		case OPCODE_MOVE_PAGES:
+		{
+			//Dry run
+			if(fastForward == NULL)
+				break;
 
-			//Backup the cache if not fast forwarding
-			if(!*fastForward)
-				backupCache(*stepCount);
+			flushWriteBuffer();
 
-			//Increase the counter signaling we backed up our cache before erasing something
-			incrementCounter(stepCount, oldCounter, fastForward);
+			for(size_t page = 0; page < decodedCommand.length; ++page)
+			{
+				const size_t source = decodedCommand.mainAddress + page * BLOCK_SIZE;
+				const size_t dest = decodedCommand.secondaryAddress + page * BLOCK_SIZE;
 
-			if(!*fastForward)
-				erasePage(decodedCommand.mainAddress);
+				//The cache doesn't change while moving pages, so it's backed up at most once
+				prepareErase(stepCount, fastForward);
+
+				if(!*fastForward)
+				{
+					erasePage(dest);
+					bufferedWriteToNAND(dest, BLOCK_SIZE, FLASH_READ_POINTER(source));
+				}
+			}
 
 			break;
 		}
@@ -255,11 +255,12 @@ RAVENS_CRITICAL bool processInstruction(const DecodedCommand decodedCommand, siz
 		case OPCODE_COPY_NC:
 		case OPCODE_COPY_CC:
 		{
+			cacheDirty = true;
 			chainAddress->isCache = true;
 			chainAddress->chainAddress = decodedCommand.secondaryAddress + decodedCommand.length;
 
 			//Dry run/fast forwarding
-			if(stepCount != NULL && !*fastForward)
+			if(fastForward != NULL && !*fastForward)
 				performCopy(decodedCommand);
 
 			break;
@@ -271,7 +272,7 @@ RAVENS_CRITICAL bool processInstruction(const DecodedCommand decodedCommand, siz
 			chainAddress->chainAddress = decodedCommand.secondaryAddress + decodedCommand.length;
 
 			//Dry run/fast forwarding
-			if(stepCount != NULL && !*fastForward)
+			if(fastForward != NULL && !*fastForward)
 				performCopy(decodedCommand);
 
 			break;
@@ -301,19 +302,28 @@ RAVENS_CRITICAL bool runCommands(const uint8_t * bytes, size_t * currentByteOffs
 			.usingBlock = false,
 			.blockInUse = 0,
 			.blockIDBits = BLOCK_ID_SPACE,
-			.blockBase = BLOCK_ID_SPACE,
+			.blockBase = 0,
 			.blockIDBitsRef = BLOCK_ID_SPACE,
 			.blockSizeBitsRef = BLOCK_SIZE_BIT
 	};
 
+	//A reboot clears the RAM, but we may be called again without one (the dry run, or a simulated power loss)
+	discardWriteBuffer();
+	cacheDirty = true;
+	backupInSecondSpace = true;
+
 	//We first do a dry run to make sure all operations will properly decode.
 	//In this cause, we communicate no writes shall be performed
-	bool needFastForwarding = !dryRun && oldCounter != 0;
+	/*
+	 * An odd counter means we lost power while backing up the cache. The copies to the cache performed since the previous backup
+	 * were skipped while fast forwarding, so the cache we would back up again is stale. We instead resume from the previous erase,
+	 * which replays them on top of the previous backup. prepareErase restores the cache once we reach it.
+	 */
+	fastForwardTarget = oldCounter & ~(size_t) 1u;
+
+	bool needFastForwarding = !dryRun && fastForwardTarget != 0;
 	bool *pNeedFastForwarding = dryRun ? NULL : &needFastForwarding;
 
-	if(needFastForwarding)
-		restoreCache(oldCounter);
-
 	ChainAddress chainAddress;
 	DecodedCommand decodedCommand;
 
@@ -325,6 +335,10 @@ RAVENS_CRITICAL bool runCommands(const uint8_t * bytes, size_t * currentByteOffs
 			return false;
 	}
 
+	//Write whatever misaligned data may be left
+	if(!dryRun)
+		flushWriteBuffer();
+
 	//CurrentByteOffset was used as currentBitOffset. We need to patch it up
 	if(*currentByteOffset & 0x7u)
 		*currentByteOffset += 8;
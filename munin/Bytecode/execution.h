@@ -23,8 +23,9 @@
 
 bool runCommands(const uint8_t * bytes, size_t * currentByteOffset, size_t length, size_t *currentTrace, size_t oldCounter, bool dryRun);
 
-void backupCache(size_t counter);
-void restoreCache(size_t counter);
+void backupCache(bool secondSpace);
+void restoreCache(bool secondSpace);
+bool lastBackupInSecondSpace();
 
 void incrementCounter(size_t *counter, size_t oldCounter, bool *fastForward);
 size_t getCurrentCounter();
@@ -32,16 +32,16 @@ extern const uint8_t backupCache2[BLOCK_SIZE];
  * Counter behavior:
  *
  * 		At this point, the counter is incremented once after saving the cache, and once after erasing a page (which trigger a backup of the cache just prior)
- * 		Hence, the handling of counter is reverted between backup and restore (as the counter indicate the next cache to write to)
  *
- * 		The weakest bit isn't relevant in the choice of the space in which we will save the cache
- * 		If the next weakest is 1, we save to the second space and read from the first. If 0, vice versa.
+ * 		The backups alternate between the two spaces, so that losing power while writing one leaves the previous backup intact.
+ * 		The cache isn't backed up again if it didn't change since the previous backup, so the space isn't derived from the counter.
+ * 		The executor keeps track of it instead, including while fast forwarding.
  *
  */
 
-void backupCache(size_t counter)
+void backupCache(bool secondSpace)
 {
-	if(counter & 2u)
+	if(secondSpace)
 	{
 		erasePage((size_t) &backupCache2);
 		writeToNAND((size_t) &backupCache2, BLOCK_SIZE, cacheRAM);
@@ -53,12 +53,12 @@ void backupCache(size_t counter)
 	}
 }
 
-RAVENS_CRITICAL void restoreCache(size_t counter)
+RAVENS_CRITICAL void restoreCache(bool secondSpace)
 {
-	if(counter & 2u)
-		memcpy(cacheRAM, backupCache1, BLOCK_SIZE);
-	else
+	if(secondSpace)
 		memcpy(cacheRAM, backupCache2, BLOCK_SIZE);
+	else
+		memcpy(cacheRAM, backupCache1, BLOCK_SIZE);
 }
 
 RAVENS_CRITICAL void setMetadataPage(const UpdateMetadata * currentMetadata, const UpdateHeader * updateLocation, uint32_t multiplier)
@@ -105,20 +105,69 @@ RAVENS_CRITICAL void resetMetadataPage(const UpdateMetadata * currentMetadata, u
 	return setMetadataPage(currentMetadata, currentMetadata->location, multiplier);
 }
 
-#if MIN_BIT_WRITE_SIZE & 0x7u
-	#define CURRENT_COUNTER_WIDTH ((MIN_BIT_WRITE_SIZE + 7) / 8)
-#else
-	#define CURRENT_COUNTER_WIDTH (MIN_BIT_WRITE_SIZE / 8)
-#endif
+/*
+ * Each step of the counter clears the next MIN_BIT_WRITE_SIZE bits of the bitfield, starting with the low bits of each byte.
+ * By default, that's a full WRITE_GRANULARITY per step, which any flash can do. If the flash can clear the remaining bits of a word
+ * already programmed, device_config.h can lower MIN_BIT_WRITE_SIZE down to a single bit per step, making the bitfield last longer
+ * before we have to erase and rewrite a metadata page.
+ */
+
+#define USABLE_BIT_FIELD_COUNTER (8 * sizeof(((UpdateMetadata *) 0)->bitField) / MIN_BIT_WRITE_SIZE)
+
+RAVENS_CRITICAL bool isCounterStepSet(volatile const uint8_t * bitField, size_t step)
+{
+	const size_t lastBit = (step + 1) * MIN_BIT_WRITE_SIZE;
+
+	for(size_t bit = step * MIN_BIT_WRITE_SIZE; bit < lastBit;)
+	{
+		//Check whole bytes when we can
+		if((bit & 7u) == 0 && lastBit - bit >= 8)
+		{
+			if(bitField[bit >> 3u] != 0)
+				return false;
+
+			bit += 8;
+		}
+		else
+		{
+			if(bitField[bit >> 3u] & (1u << (bit & 7u)))
+				return false;
 
-#define USABLE_BIT_FIELD_COUNTER (sizeof(((UpdateMetadata *) 0)->bitField) / CURRENT_COUNTER_WIDTH)
+			bit += 1;
+		}
+	}
+
+	return true;
+}
+
+RAVENS_CRITICAL void setCounterStep(volatile const uint8_t * bitField, size_t step)
+{
+	const size_t firstBit = step * MIN_BIT_WRITE_SIZE, lastBit = firstBit + MIN_BIT_WRITE_SIZE;
+
+	//writeToNAND needs us to be aligned on ADDRESSING_GRANULARITY. The bytes we pad with keep their current value
+	const size_t firstByte = (size_t) &bitField[firstBit >> 3u] & ~(size_t) ADDRESSING_GRANULARITY_MASK;
+	const size_t endByte = ((size_t) &bitField[(lastBit + 7) >> 3u] + ADDRESSING_GRANULARITY_MASK) & ~(size_t) ADDRESSING_GRANULARITY_MASK;
+
+	uint8_t bytes[(MIN_BIT_WRITE_SIZE + 7) / 8 + 2 * ADDRESSING_GRANULARITY];
+	memcpy(bytes, FLASH_READ_POINTER(firstByte), endByte - firstByte);
+
+	const size_t bitOffset = 8 * (firstByte - (size_t) bitField);
+	for(size_t bit = firstBit; bit < lastBit; ++bit)
+		bytes[(bit - bitOffset) >> 3u] &= ~(1u << (bit & 7u));
+
+	writeToNAND(firstByte, endByte - firstByte, bytes);
+}
 
 RAVENS_CRITICAL void incrementCounter(size_t *counter, size_t oldCounter, bool *fastForward)
 {
 	*counter += 1;
 
+	//Dry run, nothing is written
+	if(fastForward == NULL)
+		return;
+
 	//If we are fast forwarding, we don't actually perform most of the logic
-	if(fastForward == NULL || !*fastForward)
+	if(!*fastForward)
 	{
 		//Okay, let's determine what kind of write we have to perform
 		volatile const UpdateMetadata * oldMetadata = getMetadata();
@@ -131,12 +180,8 @@ RAVENS_CRITICAL void incrementCounter(size_t *counter, size_t oldCounter, bool *
 		}
 		else
 		{
-			const uint8_t * bytesToWrite = (const uint8_t *) &oldMetadata->bitField[(*counter - 1) * CURRENT_COUNTER_WIDTH];
-
-			uint8_t bytes[CURRENT_COUNTER_WIDTH] = {0};
-
 			//Unset the new bits
-			writeToNAND((size_t) bytesToWrite, CURRENT_COUNTER_WIDTH, bytes);
+			setCounterStep(oldMetadata->bitField, (*counter - 1) % USABLE_BIT_FIELD_COUNTER);
 		}
 	}
 	else if(*counter == oldCounter)
@@ -151,23 +196,11 @@ RAVENS_CRITICAL size_t getCurrentCounter()
 	volatile const UpdateMetadata * metadata = getMetadata();
 	assert(isMetadataValid(*metadata));
 
-	size_t output = metadata->footer.multiplier * (sizeof(metadata->bitField) / CURRENT_COUNTER_WIDTH);
+	size_t output = metadata->footer.multiplier * USABLE_BIT_FIELD_COUNTER;
 
-	for(size_t i = 0; i + CURRENT_COUNTER_WIDTH < sizeof(metadata->bitField); i += CURRENT_COUNTER_WIDTH)
-	{
-		uint8_t posCurChunk = 0;
-		for(; posCurChunk < CURRENT_COUNTER_WIDTH; ++posCurChunk)
-		{
-			const uint8_t byte = metadata->bitField[i + posCurChunk];
-
-			if(byte != 0)
-				break;
-		}
-		if(posCurChunk == CURRENT_COUNTER_WIDTH)
-			output += 1;
-		else
-			break;
-	}
+	//The last step is never written, as reaching it resets the bitfield
+	for(size_t step = 0; step + 1 < USABLE_BIT_FIELD_COUNTER && isCounterStepSet(metadata->bitField, step); ++step)
+		output += 1;
 
 	return output;
 }
@@ -186,12 +219,12 @@ RAVENS_CRITICAL bool writeToNAND(size_t address, size_t length, const uint8_t *
 
 		//We have to pad before and after :( Therefore, to simplify the logic, we over-read a little
 		if(lengthToCopy == length)
-			memcpy(&missing, (const void *) (address - misalignment), WRITE_GRANULARITY);
+			memcpy(&missing, FLASH_READ_POINTER(address - misalignment), WRITE_GRANULARITY);
 		else
-			memcpy(&missing, (const void *) (address - misalignment), WRITE_GRANULARITY - lengthToCopy);
+			memcpy(&missing, FLASH_READ_POINTER(address - misalignment), WRITE_GRANULARITY - lengthToCopy);
 
-		//Copy a little bit of extra data
-		memset(&missing[misalignment], 0xff, lengthToCopy);
+		//Insert the new data
+		memcpy(&missing[misalignment], source, lengthToCopy);
 
 		//Perform the NAND write
 		writeToNAND(address - misalignment, WRITE_GRANULARITY, missing);
@@ -227,8 +260,133 @@ RAVENS_CRITICAL bool writeToNAND(size_t address, size_t length, const uint8_t *
 	return true;
 }
 
+/*
+ * Write combining
+ *
+ * 		Contiguous writes are gathered in RAM and programmed with a single programFlash call of up to WRITE_COMBINING_SIZE bytes.
+ * 		Until flushWriteBuffer is called, the data isn't in the flash: it must be flushed before erasing, before incrementing the counter
+ * 		and before reading the flash back (unless through readThroughWriteBuffer).
+ * 		The bytes of a granule we don't own are left to 0xff so that programming doesn't alter them.
+ */
+
+static uint8_t writeBuffer[WRITE_COMBINING_SIZE];
+static size_t writeBufferAddress = 0;		//Aligned on WRITE_GRANULARITY
+static size_t writeBufferLength = 0;		//0 when nothing is pending
+static size_t combinedWriteRequests = 0;	//Requests appended on a granule boundary, which could have been programmed on their own
+
+RAVENS_CRITICAL void flushWriteBuffer()
+{
+	if(writeBufferLength != 0)
+	{
+		writeToNAND(writeBufferAddress, (writeBufferLength + WRITE_GRANULARITY_MASK) & ~(size_t) WRITE_GRANULARITY_MASK, writeBuffer);
+		ACCOUNT_SAVED_PROGRAMS(combinedWriteRequests);
+
+		writeBufferLength = 0;
+		combinedWriteRequests = 0;
+	}
+}
+
+//A reboot clears the RAM, but we may start over without one (the dry run, or a simulated power loss)
+RAVENS_CRITICAL void discardWriteBuffer()
+{
+	writeBufferLength = 0;
+	combinedWriteRequests = 0;
+}
+
+RAVENS_CRITICAL void bufferedWriteToNAND(size_t address, size_t length, const uint8_t * source)
+{
+	while(length)
+	{
+		const size_t end = writeBufferAddress + writeBufferLength;
+		const size_t endOfGranule = (end + WRITE_GRANULARITY_MASK) & ~(size_t) WRITE_GRANULARITY_MASK;
+
+		//We can only append, although we may skip a few bytes of the last granule
+		if(writeBufferLength != 0 && (address < end || (address != end && address >= endOfGranule)))
+			flushWriteBuffer();
+
+		if(writeBufferLength == 0)
+		{
+			//Large aligned writes go straight to the flash
+			if((address & WRITE_GRANULARITY_MASK) == 0 && length >= WRITE_COMBINING_SIZE)
+			{
+				const size_t lengthToWrite = length & ~(size_t) WRITE_GRANULARITY_MASK;
+				writeToNAND(address, lengthToWrite, source);
+
+				source += lengthToWrite;
+				address += lengthToWrite;
+				length -= lengthToWrite;
+				continue;
+			}
+
+			memset(writeBuffer, 0xff, sizeof(writeBuffer));
+			writeBufferAddress = address & ~(size_t) WRITE_GRANULARITY_MASK;
+		}
+		//Finishing a pending granule saves nothing, that write had to wait for the rest of the granule anyway
+		else if((address & WRITE_GRANULARITY_MASK) == 0)
+			combinedWriteRequests += 1;
+
+		const size_t offset = address - writeBufferAddress;
+		const size_t lengthToCopy = MIN(length, sizeof(writeBuffer) - offset);
+
+		memcpy(&writeBuffer[offset], source, lengthToCopy);
+		writeBufferLength = offset + lengthToCopy;
+
+		source += lengthToCopy;
+		address += lengthToCopy;
+		length -= lengthToCopy;
+
+		if(writeBufferLength == sizeof(writeBuffer))
+			flushWriteBuffer();
+	}
+}
+
+RAVENS_CRITICAL bool writeBufferOverlaps(size_t address, size_t length)
+{
+	return writeBufferLength != 0 && address < writeBufferAddress + writeBufferLength && writeBufferAddress < address + length;
+}
+
+//As programming only clears bits, the flash will read as the AND of its current content and of what's pending
+RAVENS_CRITICAL void readThroughWriteBuffer(uint8_t * output, size_t source, size_t length)
+{
+	memcpy(output, FLASH_READ_POINTER(source), length);
+
+	if(writeBufferOverlaps(source, length))
+	{
+		const size_t end = MIN(source + length, writeBufferAddress + writeBufferLength);
+
+		for(size_t address = MAX(source, writeBufferAddress); address < end; ++address)
+			output[address - source] &= writeBuffer[address - writeBufferAddress];
+	}
+}
+
 RAVENS_CRITICAL void erasePage(size_t address)
 {
 	assert((address & BLOCK_OFFSET_MASK) == 0);
 	eraseSector(address);
 }
+
+RAVENS_CRITICAL void startErasePage(size_t address)
+{
+#ifdef RAVENS_ASYNC_ERASE
+	assert((address & BLOCK_OFFSET_MASK) == 0);
+	startEraseSector(address);
+#else
+	erasePage(address);
+#endif
+}
+
+RAVENS_CRITICAL bool erasePending()
+{
+#ifdef RAVENS_ASYNC_ERASE
+	return flashBusy();
+#else
+	return false;
+#endif
+}
+
+RAVENS_CRITICAL void waitForErase()
+{
+#ifdef RAVENS_ASYNC_ERASE
+	waitForFlash();
+#endif
+}
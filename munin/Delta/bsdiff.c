@@ -28,34 +28,101 @@ extern const UpdateMetadata updateMetadataSec;
 extern const uint8_t backupCache1[BLOCK_SIZE];
 extern const uint8_t backupCache2[BLOCK_SIZE];
 
-RAVENS_CRITICAL const uint8_t * getBuffer(const size_t traceCounter)
+RAVENS_CRITICAL const uint8_t * getBuffer(const BSDiffContext * context, const size_t traceCounter)
 {
-	return traceCounter & 2u ? backupCache2 : backupCache1;
+	return ((traceCounter & 2u) != 0) != context->swapBackupSpaces ? backupCache2 : backupCache1;
 }
 
-RAVENS_CRITICAL void savePageToBuffer(const size_t blockAddress, const size_t traceCounter)
+RAVENS_CRITICAL bool restartDecompression(BSDiffContext * context, uint32_t inputOffset)
 {
-	const uint8_t * cache = getBuffer(traceCounter);
+	if(inputOffset > context->lzfx.inputLength)
+		return false;
+
+	//Nothing before this point is referred to anymore, and the data buffered past it is decompressed again
+	context->lzfx.currentInputOffset = inputOffset;
+	context->lzfx.output = cacheRAM;
+	context->lzfx.status = LZFX_OK;
+	context->lzfx.lengthToRead = 0;
+	context->currentCacheOffset = context->lengthLeft = context->aheadLength = 0;
 
-	erasePage((size_t) cache);
-	writeToNAND((size_t) cache, sizeof(backupCache1), (const uint8_t *) (blockAddress & ~BLOCK_OFFSET_MASK));
+	return true;
 }
 
-RAVENS_CRITICAL uint8_t consumeByte(BSDiffContext * context)
+RAVENS_CRITICAL bool refillCache(BSDiffContext * context)
 {
-	if(context->currentCacheOffset >= context->lengthLeft)
-	{
-		context->lengthLeft = sizeof(cacheRAM);
+	//Complete what was decompressed ahead
+	context->lengthLeft = (uint16_t) (sizeof(cacheRAM) - context->aheadLength);
+	if(context->lengthLeft != 0)
 		lzfx_decompress(&context->lzfx, &context->lengthLeft);
-		context->currentCacheOffset = 0;
 
-		if(context->lengthLeft < 1)
-		{
-			context->isOutOfData = true;
-			return 0;
-		}
+	context->lengthLeft += context->aheadLength;
+	context->currentCacheOffset = context->aheadLength = 0;
+
+	if(context->lengthLeft < 1)
+	{
+		context->isOutOfData = true;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * The decompression output loops back to the beginning of cacheRAM once full, so the next refill can start in the part we already consumed.
+ * We do that while the flash is busy erasing, by small chunks so that we don't keep the CPU long after the erase is over.
+ * Returns false when there is nothing left to do before we consume more data.
+ */
+
+#define DECOMPRESS_AHEAD_CHUNK 256u
+
+RAVENS_CRITICAL bool decompressAhead(BSDiffContext * context)
+{
+	//A partial refill doesn't loop back, and means we're done anyway
+	if(context->lengthLeft != sizeof(cacheRAM) || context->aheadLength >= context->currentCacheOffset)
+		return false;
+
+	uint16_t length = (uint16_t) MIN(DECOMPRESS_AHEAD_CHUNK, context->currentCacheOffset - context->aheadLength);
+	lzfx_decompress(&context->lzfx, &length);
+
+	context->aheadLength += length;
+	return length != 0;
+}
+
+RAVENS_CRITICAL void eraseWhileDecompressing(BSDiffContext * context, size_t address)
+{
+	startErasePage(address);
+
+	while(erasePending() && decompressAhead(context));
+
+	waitForErase();
+}
+
+RAVENS_CRITICAL void savePageToBuffer(BSDiffContext * context, const size_t blockAddress, const size_t traceCounter)
+{
+	const uint8_t * cache = getBuffer(context, traceCounter);
+
+	eraseWhileDecompressing(context, (size_t) cache);
+	writeToNAND((size_t) cache, sizeof(backupCache1), FLASH_READ_POINTER(blockAddress & ~BLOCK_OFFSET_MASK));
+}
+
+//Everything left in cacheRAM, without consuming it. Empty only if we ran out of data
+RAVENS_CRITICAL const uint8_t * peekSpan(BSDiffContext * context, size_t * length)
+{
+	if(context->currentCacheOffset >= context->lengthLeft && !refillCache(context))
+	{
+		*length = 0;
+		return cacheRAM;
 	}
 
+	*length = (size_t) (context->lengthLeft - context->currentCacheOffset);
+	return &cacheRAM[context->currentCacheOffset];
+}
+
+RAVENS_CRITICAL uint8_t consumeByte(BSDiffContext * context)
+{
+	if(context->currentCacheOffset >= context->lengthLeft && !refillCache(context))
+		return 0;
+
 	uint8_t output = cacheRAM[context->currentCacheOffset];
 
 	context->currentCacheOffset += 1;
@@ -121,6 +188,134 @@ RAVENS_CRITICAL uint64_t consumeQWord(BSDiffContext * context)
 	return qword.qword;
 }
 
+/*
+ * The Thumb filter turned the relative BL offsets into absolute ones.
+ * Instructions are halfword aligned, so we need to look four bytes ahead at every even address (as long as the segment is long enough).
+ * Indexed payloads don't filter the branches straddling two pages, so that the window is always empty when we start a page.
+ * The scan must stay in sync with encodeThumbBranches in Hugin.
+ */
+
+//BL pair: 11110 S imm10 / 11J11 imm11
+RAVENS_CRITICAL bool isBranchPair(const uint8_t * instruction)
+{
+	return (instruction[1] & 0xF8u) == 0xF0u && (instruction[3] & 0xF8u) == 0xF8u;
+}
+
+RAVENS_CRITICAL void makeBranchRelative(const uint8_t * instruction, uint8_t * output, size_t address)
+{
+	uint32_t value = ((instruction[1] & 0x7u) << 19u) | ((uint32_t) instruction[0] << 11u) | ((instruction[3] & 0x7u) << 8u) | instruction[2];
+	value = ((value << 1u) - (uint32_t) (address + 4)) >> 1u;
+
+	output[1] = (uint8_t) (0xF0u | ((value >> 19u) & 0x7u));
+	output[0] = (uint8_t) (value >> 11u);
+	output[3] = (uint8_t) (0xF8u | ((value >> 8u) & 0x7u));
+	output[2] = (uint8_t) value;
+}
+
+RAVENS_CRITICAL uint8_t consumeExtraByte(BSDiffContext * context, size_t address, uint32_t lengthLeftSegment)
+{
+	if((context->filters & BSDIFF_FILTER_THUMB_BRANCH) == 0)
+		return consumeByte(context);
+
+	uint8_t * window = context->branchWindow;
+
+	if(context->branchWindowReady == 0)
+	{
+		const bool branchFits = !context->pageBoundedBranches || (address & BLOCK_OFFSET_MASK) <= BLOCK_SIZE - 4;
+		const uint8_t lengthNeeded = (address & 1u) == 0 && lengthLeftSegment >= 4 && branchFits ? 4 : 1;
+
+		while(context->branchWindowLength < lengthNeeded)
+			window[context->branchWindowLength++] = consumeByte(context);
+
+		if(lengthNeeded == 1)
+			context->branchWindowReady = 1;
+
+		else if(isBranchPair(window))
+		{
+			makeBranchRelative(window, window, address);
+			context->branchWindowReady = 4;
+		}
+		else
+			context->branchWindowReady = 2;
+	}
+
+	const uint8_t output = window[0];
+
+	context->branchWindowLength -= 1;
+	context->branchWindowReady -= 1;
+	for(uint8_t i = 0; i < context->branchWindowLength; ++i)
+		window[i] = window[i + 1];
+
+	return output;
+}
+
+/*
+ * The same scan, straight on the spans of cacheRAM. Only the instructions straddling two spans go through the window of consumeExtraByte.
+ * segmentPastLength is how much of the segment is left past the length we're asked to copy.
+ */
+
+RAVENS_CRITICAL void copyThumbExtra(BSDiffContext * context, size_t address, size_t length, uint32_t segmentPastLength, bool resuming)
+{
+	static uint8_t unfilteredData[8 * WRITE_GRANULARITY];
+
+	while(length)
+	{
+		size_t spanLength = 0, offset = 0;
+		const uint8_t * extra = NULL;
+
+		if(context->branchWindowLength == 0)
+		{
+			extra = peekSpan(context, &spanLength);
+			spanLength = MIN(MIN(spanLength, length), sizeof(unfilteredData));
+		}
+
+		while(offset < spanLength)
+		{
+			const size_t currentAddress = address + offset;
+			const bool branchFits = !context->pageBoundedBranches || (currentAddress & BLOCK_OFFSET_MASK) <= BLOCK_SIZE - 4;
+
+			if((currentAddress & 1u) == 0 && segmentPastLength + length - offset >= 4 && branchFits)
+			{
+				//The instruction continues in the next span
+				if(offset + 4 > spanLength)
+					break;
+
+				if(isBranchPair(&extra[offset]))
+				{
+					makeBranchRelative(&extra[offset], &unfilteredData[offset], currentAddress);
+					offset += 4;
+				}
+				else
+				{
+					unfilteredData[offset] = extra[offset];
+					unfilteredData[offset + 1] = extra[offset + 1];
+					offset += 2;
+				}
+			}
+			else
+			{
+				unfilteredData[offset] = extra[offset];
+				offset += 1;
+			}
+		}
+
+		//Finishing what's in the window, or an instruction straddling two spans
+		if(offset == 0)
+		{
+			unfilteredData[0] = consumeExtraByte(context, address, (uint32_t) (segmentPastLength + length));
+			offset = 1;
+		}
+		else
+			context->currentCacheOffset += offset;
+
+		if(!resuming)
+			bufferedWriteToNAND(address, offset, unfilteredData);
+
+		address += offset;
+		length -= offset;
+	}
+}
+
 RAVENS_CRITICAL bool performValidation(BSDiffContext * context, bool dryRun)
 {
 	//We at least need a word. This means we ran out of data before, which is bad
@@ -132,7 +327,7 @@ RAVENS_CRITICAL bool performValidation(BSDiffContext * context, bool dryRun)
 	while(numberValidation--)
 	{
 		const uint32_t startOfHash = consumeDWord(context);
-		const uint32_t length = consumeWord(context) + 1;
+		const uint32_t length = consumeWord(context);
 		uint8_t refHash[HASH_LENGTH];
 
 		for(uint8_t i = 0; i < HASH_LENGTH; ++i)
@@ -146,7 +341,7 @@ RAVENS_CRITICAL bool performValidation(BSDiffContext * context, bool dryRun)
 		if(!dryRun)
 		{
 			uint8_t computed[HASH_LENGTH];
-			hashMemory((const void *) (uintptr_t) startOfHash, length, computed);
+			hashMemory(FLASH_READ_POINTER(startOfHash), length, computed);
 
 			if(memcmp(computed, refHash, sizeof(refHash)) != 0)
 				return false;
@@ -156,24 +351,108 @@ RAVENS_CRITICAL bool performValidation(BSDiffContext * context, bool dryRun)
 	return true;
 }
 
-RAVENS_CRITICAL void addByteToOutputBuffer(uint8_t byte, size_t virtualAddress, uint8_t * currentCounter)
+//Bytewise addition, a qword at a time: the top bits are summed apart so that the carries never reach the next byte
+RAVENS_CRITICAL void addDelta(uint8_t * output, const uint8_t * delta, const uint8_t * oldData, size_t length)
 {
-	static uint8_t writeBuffer[WRITE_GRANULARITY];
+	const uint64_t highBits = 0x8080808080808080ull;
+	size_t i = 0;
+
+	for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+	{
+		uint64_t left, right;
+		memcpy(&left, &delta[i], sizeof(left));
+		memcpy(&right, &oldData[i], sizeof(right));
+
+		const uint64_t sum = ((left & ~highBits) + (right & ~highBits)) ^ ((left ^ right) & highBits);
+		memcpy(&output[i], &sum, sizeof(sum));
+	}
+
+	for(; i < length; ++i)
+		output[i] = delta[i] + oldData[i];
+}
+
+RAVENS_CRITICAL void applyDelta(BSDiffContext * context, const uint8_t * oldData, size_t address, size_t length, bool resuming)
+{
+	static uint8_t patchedData[8 * WRITE_GRANULARITY];
+
+	while(length && !context->isOutOfData)
+	{
+		//We're in the middle of a run of zeros, the old data is left untouched
+		if(context->pendingZeros)
+		{
+			const size_t runLength = MIN(context->pendingZeros, length);
+
+			if(!resuming)
+				bufferedWriteToNAND(address, runLength, oldData);
+
+			context->pendingZeros -= runLength;
+			oldData += runLength;
+			address += runLength;
+			length -= runLength;
+			continue;
+		}
+
+		size_t spanLength;
+		const uint8_t * delta = peekSpan(context, &spanLength);
+
+		spanLength = MIN(MIN(spanLength, length), sizeof(patchedData));
+
+		if(context->filters & BSDIFF_FILTER_ZERO_RUN)
+		{
+			const uint8_t * zero = memchr(delta, 0, spanLength);
+
+			//A zero is followed by the number of zeros following it
+			if(zero == delta)
+			{
+				context->currentCacheOffset += 1;
+				context->pendingZeros = consumeByte(context);
+
+				if(!resuming)
+					bufferedWriteToNAND(address, 1, oldData);
+
+				oldData += 1;
+				address += 1;
+				length -= 1;
+				continue;
+			}
 
-	if(*currentCounter >= sizeof(writeBuffer))
-		return;
+			if(zero != NULL)
+				spanLength = (size_t) (zero - delta);
+		}
 
-	writeBuffer[*currentCounter] = byte;
+		context->currentCacheOffset += spanLength;
 
-	//Is the buffer full
-	if(*currentCounter == sizeof(writeBuffer) - 1)
+		if(!resuming)
+		{
+			addDelta(patchedData, delta, oldData, spanLength);
+			bufferedWriteToNAND(address, spanLength, patchedData);
+		}
+
+		oldData += spanLength;
+		address += spanLength;
+		length -= spanLength;
+	}
+}
+
+RAVENS_CRITICAL void copyExtra(BSDiffContext * context, size_t address, size_t length, bool resuming)
+{
+	while(length)
 	{
-		//We shift the address to align with the size of the buffer
-		writeToNAND(virtualAddress & ~(sizeof(writeBuffer) - 1), sizeof(writeBuffer), writeBuffer);
-		*currentCounter = 0;
+		size_t spanLength;
+		const uint8_t * extra = peekSpan(context, &spanLength);
+
+		if(spanLength == 0)
+			return;
+
+		spanLength = MIN(spanLength, length);
+		context->currentCacheOffset += spanLength;
+
+		if(!resuming)
+			bufferedWriteToNAND(address, spanLength, extra);
+
+		address += spanLength;
+		length -= spanLength;
 	}
-	else
-		*currentCounter += 1;
 }
 
 /*
@@ -181,20 +460,33 @@ RAVENS_CRITICAL void addByteToOutputBuffer(uint8_t byte, size_t virtualAddress,
  *
  * typedef struct
  *	{
- *		uint32_t flag = BSDIFF_MAGIC;
- *		uint16_t numberSegments;
+ *		uint32_t flag = BSDIFF_MAGIC or BSDIFF_INDEXED_MAGIC;
+ *		uint32_t startPage;
+ *
+ *		//Only if BSDIFF_INDEXED_MAGIC
+ *		uint32_t numberSeekPoints;
+ *		BSDiffSeekPoint seekPoints[numberSeekPoints];
+ *		uint32_t numberPages;
+ *		uint8_t oldContentNeeded[(numberPages + 7) / 8];		//Bit (page % 8) of byte (page / 8)
+ *
+ *		//Compressed from this point
+ *		uint8_t filters;
+ *		uint32_t numberSegments;
  *
  *		struct
  *		{
- *			uint16_t lengthDelta;
- *			char delta[lengthDelta];
+ *			uint32_t lengthDelta;
+ *			char delta[lengthDelta];		//Zero-run encoded if BSDIFF_FILTER_ZERO_RUN
  *
- *			uint16_t lengthInsert;
- *			char extra[lengthInsert];
+ *			uint32_t lengthInsert;
+ *			char extra[lengthInsert];		//Thumb branches made absolute if BSDIFF_FILTER_THUMB_BRANCH
  *
  *		} bsdiff[];
  *	} BSDiff;
  *
+ * The lengths are always the ones of the unfiltered data.
+ * The compressed stream doesn't refer to anything before a seek point, so the decompression can restart from there.
+ * The pages whose old content isn't needed are fully overwritten, so we don't back them up.
  */
 
 #include <stdio.h>
@@ -204,15 +496,45 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 	bool resuming = (dryRun || traceCounter < previousCounter), *pResuming = dryRun ? NULL : &resuming;
 
 	const uint8_t * baseBSDiff = &((const uint8_t *) header)[sizeof(UpdateHeader) + currentIndex];
+	const size_t bsdiffLength = header->sectionSignedDeviceKey.manifestLength - currentIndex;
 
 	//Check the flag to make sure we're properly aligned
-	if(*(uint32_t*) baseBSDiff != BSDIFF_MAGIC)
+	const uint32_t flag = *(uint32_t*) baseBSDiff;
+	if(flag != BSDIFF_MAGIC && flag != BSDIFF_INDEXED_MAGIC)
 		return false;
 
-	baseBSDiff += sizeof(uint32_t);
-
 	//Parsing the starting offset
-	size_t currentPage = *(uint32_t*) baseBSDiff * BLOCK_SIZE;
+	const size_t firstPage = *(uint32_t*) &baseBSDiff[sizeof(uint32_t)] * BLOCK_SIZE;
+	size_t currentPage = firstPage, headerLength = 2 * sizeof(uint32_t);
+
+	//Parsing the index
+	const BSDiffSeekPoint * seekPoints = NULL;
+	const uint8_t * oldContentNeeded = NULL;
+	uint32_t numberSeekPoints = 0, nextSeekPoint = 0, numberPages = 0;
+
+	if(flag == BSDIFF_INDEXED_MAGIC)
+	{
+		numberSeekPoints = *(uint32_t*) &baseBSDiff[headerLength];
+		headerLength += sizeof(uint32_t);
+
+		if(numberSeekPoints > bsdiffLength / sizeof(BSDiffSeekPoint))
+			return false;
+
+		seekPoints = (const BSDiffSeekPoint *) &baseBSDiff[headerLength];
+		headerLength += numberSeekPoints * sizeof(BSDiffSeekPoint);
+
+		if(headerLength + sizeof(uint32_t) > bsdiffLength)
+			return false;
+
+		numberPages = *(uint32_t*) &baseBSDiff[headerLength];
+		headerLength += sizeof(uint32_t);
+
+		oldContentNeeded = &baseBSDiff[headerLength];
+		headerLength += (numberPages >> 3u) + ((numberPages & 7u) != 0);
+	}
+
+	if(headerLength > bsdiffLength)
+		return false;
 
 	/*
 	 * BaseBSDiff points to a compressed bytefield
@@ -222,9 +544,9 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 	BSDiffContext context = {
 			//Setup the LZFX context ignoring the commands
 			.lzfx = {
-					.input = baseBSDiff + sizeof(uint32_t),
+					.input = baseBSDiff + headerLength,
 					.currentInputOffset = 0,
-					.inputLength = header->sectionSignedDeviceKey.manifestLength - currentIndex - 2 * sizeof(uint32_t),
+					.inputLength = bsdiffLength - headerLength,
 
 					.referenceOutput = cacheRAM,
 					.output = cacheRAM,
@@ -234,15 +556,32 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 			},
 			.currentCacheOffset = 0,
 			.lengthLeft = sizeof(cacheRAM),
-			.isOutOfData = false
+			.aheadLength = 0,
+			.isOutOfData = false,
+
+			/*
+			 * Losing power while backing up our first page makes runCommands resume from its last erase, restoring the cache it backed up then.
+			 * Our first backup must thus go to the other space, which the counter alone can't tell since runCommands may skip backups.
+			 */
+			.swapBackupSpaces = (((traceCounter | 1u) & 2u) != 0) == lastBackupInSecondSpace(),
+
+			.filters = 0,
+			.pendingZeros = 0,
+			.branchWindowLength = 0,
+			.branchWindowReady = 0,
+			.pageBoundedBranches = flag == BSDIFF_INDEXED_MAGIC
 	};
 
 	//We grab a good chunk of data
 	if(lzfx_decompress(&context.lzfx, &context.lengthLeft) != LZFX_OK)
 		return false;
 
-	bool haveCachedPage = false, didDelta = false;
-	uint8_t writeCounter = 0;
+	//We can't undo a filter we don't know about
+	context.filters = consumeByte(&context);
+	if(context.filters & ~(BSDIFF_FILTER_ZERO_RUN | BSDIFF_FILTER_THUMB_BRANCH))
+		return false;
+
+	bool haveCachedPage = false, pageBackedUp = true, didDelta = false;
 	uint16_t currentSegment = 0, currentOutputOffset = 0;
 	uint32_t currentSegmentOffset = 0;
 
@@ -254,17 +593,52 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 	const uint32_t numberSegments = consumeDWord(&context);
 	uint32_t currentSubsegmentLength = consumeDWord(&context);
 
+	//Rather than replaying the whole payload, we resume from the last seek point before the interruption
+	if(!dryRun && resuming)
+	{
+		while(nextSeekPoint + 1 < numberSeekPoints && (traceCounter | 1u) + 2 * seekPoints[nextSeekPoint + 1].page < previousCounter)
+			nextSeekPoint += 1;
+
+		if(numberSeekPoints != 0 && (traceCounter | 1u) + 2 * seekPoints[nextSeekPoint].page < previousCounter)
+		{
+			const BSDiffSeekPoint * seekPoint = &seekPoints[nextSeekPoint];
+
+			currentSegment = (uint16_t) seekPoint->segment;
+			currentSegmentOffset = seekPoint->segmentOffset;
+			currentSubsegmentLength = seekPoint->subsegmentLength;
+			didDelta = seekPoint->didDelta;
+
+			//The first page incremented the counter up to three times, the others twice
+			currentPage = firstPage + seekPoint->page * BLOCK_SIZE;
+			traceCounter = (traceCounter | 1u) + 2 * seekPoint->page;
+		}
+	}
+
 	while(currentSegment < numberSegments && !context.isOutOfData)
 	{
 		//New page to patch!
 		if(!haveCachedPage)
 		{
+			//We always restart the decompression from the seek points, so that resuming from one decodes exactly what the dry run checked
+			if(nextSeekPoint < numberSeekPoints && currentPage == firstPage + seekPoints[nextSeekPoint].page * BLOCK_SIZE)
+			{
+				const BSDiffSeekPoint * seekPoint = &seekPoints[nextSeekPoint++];
+
+				if(seekPoint->segment != currentSegment || seekPoint->segmentOffset != currentSegmentOffset || seekPoint->subsegmentLength != currentSubsegmentLength
+				   || seekPoint->didDelta != didDelta || context.pendingZeros != 0 || context.branchWindowLength != 0
+				   || !restartDecompression(&context, seekPoint->inputOffset))
+					return false;
+			}
+
 			if((traceCounter & 1) == 0)
 				incrementCounter(&traceCounter, previousCounter, pResuming);
 
-			//Save a new page to cache
-			if(!resuming)
-				savePageToBuffer(currentPage, traceCounter);
+			//Save a new page to cache, unless we overwrite all of it
+			const size_t pageIndex = (currentPage - firstPage) >> BLOCK_SIZE_BIT;
+			pageBackedUp = oldContentNeeded == NULL || pageIndex >= numberPages || (oldContentNeeded[pageIndex >> 3u] >> (pageIndex & 7u)) & 1u;
+
+			if(!resuming && pageBackedUp)
+				savePageToBuffer(&context, currentPage, traceCounter);
 
 			//Signal the patching is starting and the buffer page is filled
 			incrementCounter(&traceCounter, previousCounter, pResuming);
@@ -273,7 +647,7 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 
 			//Erase the old page
 			if(!resuming)
-				erasePage(currentPage);
+				eraseWhileDecompressing(&context, currentPage);
 		}
 
 		//Actual patching
@@ -285,97 +659,27 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 
 		currentSegmentOffset += lengthLeft;
 
-		if(didDelta)
+		if(didDelta && context.filters & BSDIFF_FILTER_THUMB_BRANCH)
 		{
-			//Misaligned, we pad with a few bytes
-			while(currentOutputOffset & 7u && lengthLeft)
-			{
-				uint8_t data = consumeByte(&context);
-
-				if(!resuming)
-					addByteToOutputBuffer(data, currentPage + currentOutputOffset, &writeCounter);
-
-				currentOutputOffset += 1;
-				lengthLeft -= 1;
-			}
-
-			//Perform the main copy
-			while(lengthLeft >= sizeof(uint64_t))
-			{
-				uint64_t data = consumeQWord(&context);
-
-				if(!resuming)
-					writeToNAND(currentPage + currentOutputOffset, sizeof(data), (const uint8_t *) &data);
-
-				currentOutputOffset += sizeof(data);
-				lengthLeft -= sizeof(data);
-			}
-
-			//Finish up what may be left
-			while(lengthLeft)
-			{
-				uint8_t data = consumeByte(&context);
-
-				if(!resuming)
-					addByteToOutputBuffer(data, currentPage + currentOutputOffset, &writeCounter);
-
-				currentOutputOffset += 1;
-				lengthLeft -= 1;
-			}
+			//The Thumb filter needs to know how much of the segment is left, beyond the current page
+			copyThumbExtra(&context, currentPage + currentOutputOffset, lengthLeft, currentSubsegmentLength - currentSegmentOffset, resuming);
+			currentOutputOffset += lengthLeft;
+		}
+		//Unfiltered insert, copied straight from cacheRAM
+		else if(didDelta)
+		{
+			copyExtra(&context, currentPage + currentOutputOffset, lengthLeft, resuming);
+			currentOutputOffset += lengthLeft;
 		}
 		//Patch
 		else
 		{
-			const uint8_t * oldData = getBuffer(traceCounter - 1);
-
-			//Misaligned, we pad with a few bytes
-			while(currentOutputOffset & 7u && lengthLeft)
-			{
-				const uint8_t data = consumeByte(&context) + oldData[currentOutputOffset];
-
-				if(!resuming)
-					addByteToOutputBuffer(data, currentPage + currentOutputOffset, &writeCounter);
-
-				currentOutputOffset += 1;
-				lengthLeft -= 1;
-			}
-
-			//Perform the main copy
-			while(lengthLeft >= sizeof(uint64_t))
-			{
-				union {
-					uint64_t qword;
-					uint8_t byte[8];
-				} data;
-				data.qword = consumeQWord(&context);
-
-				data.byte[0] += oldData[currentOutputOffset];
-				data.byte[1] += oldData[currentOutputOffset + 1];
-				data.byte[2] += oldData[currentOutputOffset + 2];
-				data.byte[3] += oldData[currentOutputOffset + 3];
-				data.byte[4] += oldData[currentOutputOffset + 4];
-				data.byte[5] += oldData[currentOutputOffset + 5];
-				data.byte[6] += oldData[currentOutputOffset + 6];
-				data.byte[7] += oldData[currentOutputOffset + 7];
-
-				if(!resuming)
-					writeToNAND(currentPage + currentOutputOffset, sizeof(data), data.byte);
-
-				currentOutputOffset += sizeof(uint64_t);
-				lengthLeft -= sizeof(uint64_t);
-			}
-
-			//Finish up what may be left
-			while(lengthLeft)
-			{
-				const uint8_t data = consumeByte(&context) + oldData[currentOutputOffset];
-
-				if(!resuming)
-					addByteToOutputBuffer(data, currentPage + currentOutputOffset, &writeCounter);
+			//The index claimed we didn't need the old data
+			if(!pageBackedUp && lengthLeft)
+				return false;
 
-				currentOutputOffset += 1;
-				lengthLeft -= 1;
-			}
+			applyDelta(&context, &getBuffer(&context, traceCounter - 1)[currentOutputOffset], currentPage + currentOutputOffset, lengthLeft, resuming);
+			currentOutputOffset += lengthLeft;
 		}
 
 		//We finished a BSDiff subsegment
@@ -396,30 +700,36 @@ RAVENS_CRITICAL bool applyDeltaPatch(const UpdateHeader * header, size_t current
 		//We finished patching our current page
 		if(currentOutputOffset == BLOCK_SIZE)
 		{
-			//Signal the patching is over
+			//Signal the patching is over, once all of it reached the flash
+			flushWriteBuffer();
 			incrementCounter(&traceCounter, previousCounter, pResuming);
 			haveCachedPage = false;
+			currentPage += BLOCK_SIZE;
 		}
 	}
 
 	//We need to finish writing the current block, despite the end having been trimmed (also make sure we don't keep writing if we're having issues)
 	if(currentOutputOffset != BLOCK_SIZE && !context.isOutOfData)
 	{
-		//Pad the current qword
-		const uint8_t * oldData = getBuffer(traceCounter - 1);
-		while(currentOutputOffset & WRITE_GRANULARITY_MASK)
-		{
-			const uint8_t data = oldData[currentOutputOffset];
+		if(!pageBackedUp)
+			return false;
 
-			if(!resuming)
-				addByteToOutputBuffer(data, currentPage + currentOutputOffset, &writeCounter);
+		//Complete the page with its old content
+		const uint8_t * oldData = getBuffer(&context, traceCounter - 1);
 
-			currentOutputOffset += 1;
+		if(!resuming)
+		{
+			bufferedWriteToNAND(currentPage + currentOutputOffset, BLOCK_SIZE - currentOutputOffset, &oldData[currentOutputOffset]);
+			flushWriteBuffer();
 		}
 
-		if(!resuming)
-			writeToNAND(currentPage + currentOutputOffset, BLOCK_SIZE - currentOutputOffset, &oldData[currentOutputOffset]);
+		//Signal the patching is over. Otherwise, losing power in concludeUpdate would make us replay this page from a buffer it reused
+		incrementCounter(&traceCounter, previousCounter, pResuming);
 	}
 
+	//Some seek points were never reached
+	if(dryRun && nextSeekPoint != numberSeekPoints)
+		return false;
+
 	return performValidation(&context, dryRun);
 }
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <memory.h>
 #include "lzfx_light.h"
 #include "../core.h"
 
@@ -25,7 +26,7 @@
 #endif
 
 /* These cannot be changed, as they are related to the compressed format. */
-#define MAX_OFF_FORMAT_1 (1u << 11u)
+#define MAX_OFF_FORMAT_1 (1u << 10u)
 
 RAVENS_CRITICAL uint8_t * getOutputPointerWithBackOffset(Lzfx4KContext * context, uint16_t backOffset)
 {
@@ -46,6 +47,21 @@ RAVENS_CRITICAL uint16_t availableRoomBeforeLoopback(Lzfx4KContext * context, co
 	return (uint16_t) (context->outputRealSize - (ptr - context->referenceOutput));
 }
 
+//Copy a back reference, up to the end of the ring buffer. A reference overlapping the output repeats a pattern, and has to be copied byte by byte
+RAVENS_CRITICAL void copyBackReference(Lzfx4KContext * context, const uint8_t * ref, uint16_t length)
+{
+	if(ref >= context->output || ref + length <= context->output)
+	{
+		memmove(context->output, ref, length);
+		context->output += length;
+	}
+	else
+	{
+		while(length--)
+			*context->output++ = *ref++;
+	}
+}
+
 RAVENS_CRITICAL void resumeCurrentSegment(Lzfx4KContext * context, const uint16_t outputLength)
 {
 	if(context->status == LZFX_OK)
@@ -59,10 +75,8 @@ RAVENS_CRITICAL void resumeCurrentSegment(Lzfx4KContext * context, const uint16_
 	//Check whether we can process it all in a single run
 	if(length > outputLength)
 	{
+		//The output and the reference move together, so the back offset doesn't change
 		context->lengthToRead -= outputLength;
-		if(needReuse)
-			context->backRef = (uint16_t) ((uint16_t) (outputLength + context->backRef) & (context->outputRealSize - 1u));
-
 		length = outputLength;
 	}
 	else
@@ -89,8 +103,7 @@ RAVENS_CRITICAL void resumeCurrentSegment(Lzfx4KContext * context, const uint16_
 				length -= spaceLeft;
 
 			//Perform the copy
-			while(spaceLeft--)
-				*context->output++ = *ref++;
+			copyBackReference(context, ref, spaceLeft);
 
 			//Reset the buffer
 			ref = context->referenceOutput;
@@ -98,8 +111,9 @@ RAVENS_CRITICAL void resumeCurrentSegment(Lzfx4KContext * context, const uint16_
 	}
 	else
 	{
-		while(length--)
-			*context->output++ = context->input[context->currentInputOffset++];
+		memcpy(context->output, &context->input[context->currentInputOffset], length);
+		context->output += length;
+		context->currentInputOffset += length;
 	}
 }
 
@@ -124,6 +138,10 @@ RAVENS_CRITICAL int lzfx_decompress(Lzfx4KContext * context, uint16_t *outputLen
 		return LZFX_OK;
 	}
 
+	//The output is a ring buffer, we loop back once it's full
+	if(context->output == context->referenceOutput + context->outputRealSize)
+		context->output = context->referenceOutput;
+
 	const uint8_t * outputEnd = context->output + *outputLength, * originalOutput = context->output;
 
 	resumeCurrentSegment(context, *outputLength);
@@ -182,7 +200,7 @@ RAVENS_CRITICAL int lzfx_decompress(Lzfx4KContext * context, uint16_t *outputLen
 				context->status = LZFX_SUSPEND_DECOMPRESS;
 				context->lengthToRead = length - (uint32_t) (outputEnd - context->output);
 				length -= context->lengthToRead;
-				context->backRef = (uint16_t) (opOffset - length);
+				context->backRef = opOffset;
 			}
 
 			//If we will need to loop back at the beginning of the ring buffer
@@ -194,8 +212,7 @@ RAVENS_CRITICAL int lzfx_decompress(Lzfx4KContext * context, uint16_t *outputLen
 					spaceLeft = (uint16_t) length;
 
 				length -= spaceLeft;
-				while(spaceLeft--)
-					*context->output++ = *ref++;
+				copyBackReference(context, ref, (uint16_t) spaceLeft);
 
 				ref = context->referenceOutput;
 			}
@@ -217,10 +234,10 @@ RAVENS_CRITICAL int lzfx_decompress(Lzfx4KContext * context, uint16_t *outputLen
 			if (fx_expect_false(inputBuffer + ctrl > inputEnd))
 				return LZFX_ECORRUPT;
 
-			do
-			{
-				*context->output++ = *inputBuffer++;
-			} while (--ctrl);
+			//ctrl may be 0 if the output was already full
+			memcpy(context->output, inputBuffer, ctrl);
+			context->output += ctrl;
+			inputBuffer += ctrl;
 		}
 
 	}
@@ -229,6 +246,7 @@ RAVENS_CRITICAL int lzfx_decompress(Lzfx4KContext * context, uint16_t *outputLen
 		context->status = LZFX_DONE;
 
 	*outputLength = (uint16_t) (context->output - originalOutput);
+	ACCOUNT_DECOMPRESSION(*outputLength);
 	context->currentInputOffset += (inputBuffer - originalInput);
 	return LZFX_OK;
 }
\ No newline at end of file
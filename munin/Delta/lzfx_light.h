@@ -49,8 +49,18 @@ typedef struct
 
 	uint16_t currentCacheOffset;
 	uint16_t lengthLeft;
+	uint16_t aheadLength;		//Already decompressed at the beginning of cacheRAM, for the next refill
 
 	bool isOutOfData;
+	bool swapBackupSpaces;		//The backup spaces no longer follow the counter once the commands skipped a backup
+
+	//Undoing the BSDiff filters
+	uint8_t filters;
+	uint8_t pendingZeros;
+	uint8_t branchWindow[4];
+	uint8_t branchWindowLength;
+	uint8_t branchWindowReady;
+	bool pageBoundedBranches;
 
 } BSDiffContext;
 
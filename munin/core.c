@@ -32,7 +32,14 @@ typedef unsigned int uint;
  * (https://stackoverflow.com/a/6615788)
  */
 
-volatile const UpdateMetadata __attribute__((section(".rodata.Ravens.metadata$1"), aligned(BLOCK_SIZE))) updateMetadataMain = {
+#ifdef RAVENS_HOST_SIMULATION
+	//The simulated driver programs those pages in place, so they can't end up in a read-only segment
+	#define RAVENS_FLASH_SECTION(name) __attribute__((section(".data.Ravens." name), aligned(BLOCK_SIZE)))
+#else
+	#define RAVENS_FLASH_SECTION(name) __attribute__((section(".rodata.Ravens." name), aligned(BLOCK_SIZE)))
+#endif
+
+volatile const UpdateMetadata RAVENS_FLASH_SECTION("metadata$1") updateMetadataMain = {
 		.location = 0,
 		.bitField = {[0 ... (sizeof(updateMetadataMain.bitField) - 1)] = 0xff},
 		.footer = {
@@ -41,7 +48,7 @@ volatile const UpdateMetadata __attribute__((section(".rodata.Ravens.metadata$1"
 				.notExpired = DEFAULT_64B_FLASH_VALUE
 		}};
 
-volatile const UpdateMetadata __attribute__((section(".rodata.Ravens.metadata$3"), aligned(BLOCK_SIZE))) updateMetadataSec = {
+volatile const UpdateMetadata RAVENS_FLASH_SECTION("metadata$3") updateMetadataSec = {
 		.location = 0,
 		.bitField = {[0 ... (sizeof(updateMetadataSec.bitField) - 1)] = 0xff},
 		.footer = {
@@ -50,7 +57,7 @@ volatile const UpdateMetadata __attribute__((section(".rodata.Ravens.metadata$3"
 				.notExpired = 0
 		}};
 
-volatile const CriticalMetadata __attribute__((section(".rodata.Ravens.metadata$2"), aligned(BLOCK_SIZE))) criticalMetadata = {
+volatile const CriticalMetadata RAVENS_FLASH_SECTION("metadata$2") criticalMetadata = {
 		.devicePublicKey = {0x4d, 0x97, 0x1b, 0x60, 0xfd, 0x83, 0x7f, 0x91, 0xfd, 0x7e, 0xc3, 0x38, 0xc2, 0x80, 0xb7, 0x9c, 0xd1, 0xac, 0x73, 0x60, 0xf7, 0x3c, 0x4c, 0xef, 0xd1, 0x9b, 0x6c, 0xc3, 0x7f, 0x5d, 0xcf, 0x06},
 		.updateChallenge = {0x42},
 		.versionID = 1,
@@ -60,8 +67,8 @@ volatile const CriticalMetadata __attribute__((section(".rodata.Ravens.metadata$
 };
 
 //In between, all the update code is shoved via the RAVENS_CRITICAL macro
-volatile const uint8_t __attribute__((section(".rodata.Ravens.cache$1"), aligned(BLOCK_SIZE))) backupCache1[BLOCK_SIZE] = {[0 ... (BLOCK_SIZE - 1)] = 0xff};
-volatile const uint8_t __attribute__((section(".rodata.Ravens.cache$3"), aligned(BLOCK_SIZE))) backupCache2[BLOCK_SIZE] = {[0 ... (BLOCK_SIZE - 1)] = 0xff};
+volatile const uint8_t RAVENS_FLASH_SECTION("cache$1") backupCache1[BLOCK_SIZE] = {[0 ... (BLOCK_SIZE - 1)] = 0xff};
+volatile const uint8_t RAVENS_FLASH_SECTION("cache$3") backupCache2[BLOCK_SIZE] = {[0 ... (BLOCK_SIZE - 1)] = 0xff};
 
 uint8_t cacheRAM[BLOCK_SIZE] = {0};
 
@@ -114,7 +121,7 @@ RAVENS_CRITICAL void concludeUpdate(bool withError)
 	//If we're done applying the update, let's update the next update's challenge, and the versionID
 	if(!withError)
 	{
-		const UpdateHeader * header = getMetadata()->location;
+		const UpdateHeader * header = (const UpdateHeader *) FLASH_READ_POINTER(getMetadata()->location);
 
 		memcpy(criticalMetadataCopy.updateChallenge, header->sectionSignedUpdateKey.signature, sizeof(criticalMetadataCopy.updateChallenge));
 		criticalMetadataCopy.versionID = header->sectionSignedDeviceKey.versionID;
@@ -185,6 +192,8 @@ RAVENS_CRITICAL void bootloaderPerformUpdate()
 		return enableIRQ();
 	}
 
+	header = (const UpdateHeader *) FLASH_READ_POINTER(header);
+
 	/*
 	 * Warning: This code isn't resilient to fault injections
 	 */
@@ -214,17 +223,20 @@ RAVENS_CRITICAL void bootloaderPerformUpdate()
 	const size_t permanentTraceCounter = getCurrentCounter();
 
 	//We do a dry run to make sure everything is working properly before doing anything destructive
-
-	//We first validate everything will properly decode
-	if(!runCommands(baseCommand, &index, header->sectionSignedDeviceKey.manifestLength, &traceCounter, permanentTraceCounter, true))
+	//	If the counter moved, the update already passed it before we lost power, and the manifest was validated again since
+	if(permanentTraceCounter == 0)
 	{
-		return concludeUpdate(true);
-	}
-
-   //Then, we check everything will decompress successfully
-	if(!applyDeltaPatch(header, index, traceCounter, permanentTraceCounter, true))
-	{
-		return concludeUpdate(true);
+		//We first validate everything will properly decode
+		if(!runCommands(baseCommand, &index, header->sectionSignedDeviceKey.manifestLength, &traceCounter, permanentTraceCounter, true))
+		{
+			return concludeUpdate(true);
+		}
+
+		//Then, we check everything will decompress successfully
+		if(!applyDeltaPatch(header, index, traceCounter, permanentTraceCounter, true))
+		{
+			return concludeUpdate(true);
+		}
 	}
 
 	//Okay, everything should be good. We will go ahead and run the update
@@ -245,9 +257,11 @@ RAVENS_CRITICAL void bootloaderPerformUpdate()
 	reboot();
 }
 
+#ifndef RAVENS_HOST_SIMULATION
 void _start(void);
 RAVENS_CRITICAL void _start_with_update()
 {
 	bootloaderPerformUpdate();
 	_start();
 }
+#endif
@@ -16,11 +16,17 @@
 #include "io_management.h"
 #include "../common/layout.h"
 
-#define RAVENS_CRITICAL __attribute__((section(".rodata.Ravens.cache$2")))
+#ifdef RAVENS_HOST_SIMULATION
+	//The host simulator runs the update code from regular memory
+	#define RAVENS_CRITICAL
+#else
+	#define RAVENS_CRITICAL __attribute__((section(".rodata.Ravens.cache$2")))
+#endif
 
 #define isMetadataValid(a) ((a).footer.valid == VALID_64B_VALUE && (a).footer.notExpired == DEFAULT_64B_FLASH_VALUE)
 
 volatile const UpdateMetadata * getMetadata();
 void requestUpdate(const void * updateLocation);
+void bootloaderPerformUpdate();
 
 #endif //RAVENS_CORE_H
@@ -29,6 +29,15 @@ void disableIRQ();
 #ifndef NO_CRITICAL
 	RAVENS_CRITICAL void eraseSector(size_t address);
 	RAVENS_CRITICAL void programFlash(size_t address, const uint8_t *data, size_t length);
+
+	//Optional background erase, for drivers defining RAVENS_ASYNC_ERASE in device_config.h
+	//	startEraseSector issues the erase and returns, flashBusy polls it and waitForFlash blocks until it's over.
+	//	The flash must stay readable meanwhile (the manifest is read from it), but nothing is erased or programmed before waitForFlash
+	#ifdef RAVENS_ASYNC_ERASE
+		RAVENS_CRITICAL void startEraseSector(size_t address);
+		RAVENS_CRITICAL bool flashBusy();
+		RAVENS_CRITICAL void waitForFlash();
+	#endif
 #endif
 
 #ifdef __cplusplus
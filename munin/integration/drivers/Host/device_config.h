@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#ifndef RAVENS_DEVICE_CONFIG_H
+#define RAVENS_DEVICE_CONFIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Host simulation of the update process, used by Hugin to estimate the cost of a patch
+
+#define RAVENS_HOST_SIMULATION
+
+//Device drivers. The geometry mirrors the K64F and Hugin's default configuration
+
+//ADDRESSING_GRANULARITY is the smallest unit we're willing to pad. If set to 1, we accept padding anything. Don't set to 0
+#define ADDRESSING_GRANULARITY (1u << 2u)
+
+//Smallest supported write to NAND in bytes
+#define WRITE_GRANULARITY (1u << 3u)
+
+//Smallest supported write to NAND in bits, and number of bits each step of the update counter clears. Default to 8 * WRITE_GRANULARITY
+//	The simulated flash can program a word several times, so it can go down to 1 bit per step
+//#define MIN_BIT_WRITE_SIZE	64u
+
+//How many bits are needed to encode the length of the flash?
+#define FLASH_SIZE_BIT	20u
+
+//How many bits are needed to encode the length of a block of NAND flash
+#define BLOCK_SIZE_BIT	12u	// 4096
+
+//The driver can erase in the background (startEraseSector/flashBusy/waitForFlash). The simulator only does so if its timing model asks for it
+#define RAVENS_ASYNC_ERASE
+
+//Timing model, using the typical values of the K64F datasheet
+
+//Time to erase a sector, in µs
+#define SIMULATED_ERASE_TIME		13000u
+
+//Time to program WRITE_GRANULARITY bytes, in µs
+#define SIMULATED_PROGRAM_TIME		65u
+
+//Fixed cost of a program command on top of the data, in µs. The datasheet figure above already includes it
+#define SIMULATED_PROGRAM_CALL_TIME	0u
+
+//CPU frequency, in MHz, and average cost of decompressing a byte of the BSDiff stream
+#define SIMULATED_CPU_FREQUENCY		120u
+#define SIMULATED_LZFX_CYCLES_PER_BYTE	20u
+
+//Whether the simulated flash lets the CPU run while it erases. Off, like the blocking K64F driver
+#define SIMULATED_BACKGROUND_ERASE	false
+
+#endif //RAVENS_DEVICE_CONFIG_H
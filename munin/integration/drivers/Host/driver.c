@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#include <assert.h>
+#include <memory.h>
+#include <sys/param.h>
+#include "../../../core.h"
+#include "../../../driver_api.h"
+#include "flash_simulator.h"
+
+/*
+ * The simulated flash is a RAM buffer, addressed using the device's addresses (from 0 to FLASH_SIZE).
+ * Anything outside of this range is one of the host-allocated metadata/backup pages and is accessed directly.
+ */
+
+extern uint8_t backupCache1[BLOCK_SIZE];
+extern uint8_t backupCache2[BLOCK_SIZE];
+
+uint8_t hostFlash[FLASH_SIZE];
+FlashSimulatorReport hostFlashReport;
+
+static FlashTimingModel hostFlashTiming = {
+		.eraseTime = SIMULATED_ERASE_TIME,
+		.programTime = SIMULATED_PROGRAM_TIME,
+		.programCallTime = SIMULATED_PROGRAM_CALL_TIME,
+		.cpuFrequency = SIMULATED_CPU_FREQUENCY,
+		.lzfxCyclesPerByte = SIMULATED_LZFX_CYCLES_PER_BYTE,
+		.backgroundErase = SIMULATED_BACKGROUND_ERASE
+};
+
+FlashTimingModel simulatedTimingModel()
+{
+	return hostFlashTiming;
+}
+
+void setSimulatedTimingModel(const FlashTimingModel * model)
+{
+	hostFlashTiming = *model;
+}
+
+static void (*hostPowerLoss)(void) = NULL;
+static uint64_t hostOperationsBeforeCut = 0;
+
+void armSimulatedPowerCut(uint64_t operation, void (*powerLoss)(void))
+{
+	hostOperationsBeforeCut = operation;
+	hostPowerLoss = powerLoss;
+}
+
+void disarmSimulatedPowerCut()
+{
+	hostPowerLoss = NULL;
+}
+
+//Called before any flash operation, so that a cut leaves the flash as it was before
+static void checkPowerCut()
+{
+	if(hostPowerLoss == NULL)
+		return;
+
+	if(hostOperationsBeforeCut-- == 0)
+	{
+		void (*powerLoss)(void) = hostPowerLoss;
+		hostPowerLoss = NULL;
+		powerLoss();
+
+		assert(false && "The power loss handler returned");
+	}
+}
+
+static uint8_t * hostFlashWritePointer(size_t address)
+{
+	return address < FLASH_SIZE ? &hostFlash[address] : (uint8_t *) address;
+}
+
+const uint8_t * hostFlashPointer(size_t address)
+{
+	return hostFlashWritePointer(address);
+}
+
+void hostAccountDecompression(size_t length)
+{
+	hostFlashReport.decompressedBytes += length;
+	hostFlashReport.decompressionTime = hostFlashReport.decompressedBytes * hostFlashTiming.lzfxCyclesPerByte / hostFlashTiming.cpuFrequency;
+}
+
+void hostAccountSavedPrograms(size_t count)
+{
+	hostFlashReport.savedProgramCalls += count;
+}
+
+static SimulatedRegionStats * regionForAddress(size_t address)
+{
+	if(address < FLASH_SIZE)
+		return &hostFlashReport.regions[SIMULATED_REGION_FIRMWARE];
+
+	//BLOCK_MASK is only 32 bits wide, which doesn't work with host pointers
+	if(address - (size_t) backupCache1 < BLOCK_SIZE || address - (size_t) backupCache2 < BLOCK_SIZE)
+		return &hostFlashReport.regions[SIMULATED_REGION_BACKUP];
+
+	return &hostFlashReport.regions[SIMULATED_REGION_METADATA];
+}
+
+void reboot()
+{
+}
+
+void enableIRQ()
+{
+}
+
+void disableIRQ()
+{
+}
+
+//The CPU keeps running during a background erase. The decompression done until we wait for it doesn't add to the install time
+static bool hostErasePending = false;
+static uint64_t hostEraseStart;
+
+void eraseSector(size_t address)
+{
+	assert(!hostErasePending && "The flash is busy erasing");
+	assert((address & BLOCK_OFFSET_MASK) == 0);
+	assert(address >= FLASH_SIZE || address + BLOCK_SIZE <= FLASH_SIZE);
+
+	checkPowerCut();
+
+	memset(hostFlashWritePointer(address), 0xff, BLOCK_SIZE);
+
+	regionForAddress(address)->erasedPages += 1;
+	hostFlashReport.eraseTime += hostFlashTiming.eraseTime;
+}
+
+void programFlash(size_t address, const uint8_t *data, size_t length)
+{
+	assert((address & WRITE_GRANULARITY_MASK) == 0 && (length & WRITE_GRANULARITY_MASK) == 0);
+	assert(address >= FLASH_SIZE || address + length <= FLASH_SIZE);
+
+	assert(!hostErasePending && "The flash is busy erasing");
+	checkPowerCut();
+
+	//Programming can only clear bits
+	uint8_t * destination = hostFlashWritePointer(address);
+	for(size_t i = 0; i < length; ++i)
+		destination[i] &= data[i];
+
+	SimulatedRegionStats * region = regionForAddress(address);
+	region->programCalls += 1;
+	region->programmedUnits += length / WRITE_GRANULARITY;
+
+	hostFlashReport.programTime += hostFlashTiming.programCallTime + hostFlashTiming.programTime * (length / WRITE_GRANULARITY);
+}
+
+void startEraseSector(size_t address)
+{
+	eraseSector(address);
+
+	if(hostFlashTiming.backgroundErase)
+	{
+		hostErasePending = true;
+		hostEraseStart = hostFlashReport.decompressionTime;
+	}
+}
+
+bool flashBusy()
+{
+	return hostErasePending && hostFlashReport.decompressionTime - hostEraseStart < hostFlashTiming.eraseTime;
+}
+
+void waitForFlash()
+{
+	if(!hostErasePending)
+		return;
+
+	const uint64_t busyTime = hostFlashReport.decompressionTime - hostEraseStart;
+	hostFlashReport.overlappedTime += MIN(busyTime, hostFlashTiming.eraseTime);
+	hostErasePending = false;
+}
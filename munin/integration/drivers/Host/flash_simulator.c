@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <memory.h>
+#include <setjmp.h>
+#include "../../../core.h"
+#include "../../../Bytecode/execution.h"
+#include "../../../../common/layout.h"
+#include "../../../Delta/bsdiff.h"
+#include "flash_simulator.h"
+
+/*
+ * Host replacement for the pages core.c places in flash.
+ * They live in RAM but are aligned so that erasePage is satisfied, and are written through the driver so that we can account for them.
+ */
+
+UpdateMetadata __attribute__((aligned(BLOCK_SIZE))) updateMetadataMain;
+UpdateMetadata __attribute__((aligned(BLOCK_SIZE))) updateMetadataSec;
+
+uint8_t __attribute__((aligned(BLOCK_SIZE))) backupCache1[BLOCK_SIZE];
+uint8_t __attribute__((aligned(BLOCK_SIZE))) backupCache2[BLOCK_SIZE];
+
+uint8_t cacheRAM[BLOCK_SIZE];
+
+extern uint8_t hostFlash[FLASH_SIZE];
+extern FlashSimulatorReport hostFlashReport;
+
+volatile const UpdateMetadata * getMetadata()
+{
+	if(isMetadataValid(updateMetadataMain))
+		return &updateMetadataMain;
+
+	assert(isMetadataValid(updateMetadataSec));
+	return &updateMetadataSec;
+}
+
+size_t simulatedFlashSizeBit()
+{
+	return FLASH_SIZE_BIT;
+}
+
+size_t simulatedBlockSizeBit()
+{
+	return BLOCK_SIZE_BIT;
+}
+
+const uint8_t * simulatedFlash()
+{
+	return hostFlash;
+}
+
+static void resetSimulatedFlash(const uint8_t * oldImage, size_t oldImageLength)
+{
+	memset(hostFlash, 0xff, sizeof(hostFlash));
+	memcpy(hostFlash, oldImage, oldImageLength);
+
+	memset(backupCache1, 0xff, sizeof(backupCache1));
+	memset(backupCache2, 0xff, sizeof(backupCache2));
+
+	//Same initial state as core.c
+	memset(&updateMetadataMain, 0xff, sizeof(updateMetadataMain));
+	updateMetadataMain.location = NULL;
+	updateMetadataMain.footer.multiplier = 0;
+	updateMetadataMain.footer.valid = VALID_64B_VALUE;
+
+	memset(&updateMetadataSec, 0xff, sizeof(updateMetadataSec));
+	updateMetadataSec.location = NULL;
+	updateMetadataSec.footer.multiplier = 0;
+	updateMetadataSec.footer.valid = 0;
+	updateMetadataSec.footer.notExpired = 0;
+
+	memset(&hostFlashReport, 0, sizeof(hostFlashReport));
+}
+
+//A power cut leaves runSimulatedUpdate without freeing its header, so the next run does it
+static UpdateHeader * simulatedHeader = NULL;
+
+//Same sequence as bootloaderPerformUpdate, from whatever state the simulated flash is in
+static bool runSimulatedUpdate(const uint8_t * manifest, size_t manifestLength)
+{
+	if(manifestLength > UINT32_MAX)
+		return false;
+
+	//Munin expects the manifest right after its header, which content is irrelevant past this point
+	free(simulatedHeader);
+	simulatedHeader = calloc(1, sizeof(UpdateHeader) + manifestLength);
+	if(simulatedHeader == NULL)
+		return false;
+
+	simulatedHeader->sectionSignedDeviceKey.manifestLength = (uint32_t) manifestLength;
+	memcpy(&((uint8_t *) simulatedHeader)[sizeof(UpdateHeader)], manifest, manifestLength);
+
+	const uint8_t * baseCommand = &((const uint8_t *) simulatedHeader)[sizeof(UpdateHeader)];
+	size_t index = 0, traceCounter = 0;
+	const size_t permanentTraceCounter = getCurrentCounter();
+	bool success = true;
+
+	//We only validate the update before starting it, not when resuming
+	if(permanentTraceCounter == 0)
+	{
+		success = runCommands(baseCommand, &index, manifestLength, &traceCounter, permanentTraceCounter, true) &&
+				  applyDeltaPatch(simulatedHeader, index, traceCounter, permanentTraceCounter, true);
+	}
+
+	if(success)
+	{
+		index = traceCounter = 0;
+		runCommands(baseCommand, &index, manifestLength, &traceCounter, permanentTraceCounter, false);
+		success = applyDeltaPatch(simulatedHeader, index, traceCounter, permanentTraceCounter, false);
+	}
+
+	free(simulatedHeader);
+	simulatedHeader = NULL;
+
+	return success;
+}
+
+bool simulateUpdate(const uint8_t * oldImage, size_t oldImageLength, const uint8_t * manifest, size_t manifestLength, FlashSimulatorReport * report)
+{
+	if(oldImageLength > FLASH_SIZE)
+		return false;
+
+	resetSimulatedFlash(oldImage, oldImageLength);
+
+	const bool success = runSimulatedUpdate(manifest, manifestLength);
+
+	if(report != NULL)
+		*report = hostFlashReport;
+
+	return success;
+}
+
+static jmp_buf powerCutTarget;
+
+static void cutPower()
+{
+	longjmp(powerCutTarget, 1);
+}
+
+bool simulateUpdateUntilPowerCut(const uint8_t * oldImage, size_t oldImageLength, const uint8_t * manifest, size_t manifestLength, uint64_t operation)
+{
+	if(oldImageLength > FLASH_SIZE)
+		return false;
+
+	resetSimulatedFlash(oldImage, oldImageLength);
+
+	if(setjmp(powerCutTarget) != 0)
+		return true;
+
+	armSimulatedPowerCut(operation, cutPower);
+	runSimulatedUpdate(manifest, manifestLength);
+	disarmSimulatedPowerCut();
+
+	return false;
+}
+
+bool resumeSimulatedUpdate(const uint8_t * manifest, size_t manifestLength)
+{
+	//The RAM didn't survive the power loss
+	memset(cacheRAM, 0, sizeof(cacheRAM));
+
+	return runSimulatedUpdate(manifest, manifestLength);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * @author Emile-Hugo Spir
+ */
+
+#ifndef RAVENS_FLASH_SIMULATOR_H
+#define RAVENS_FLASH_SIMULATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+//This header is self-contained so that Hugin can include it without pulling Munin's configuration
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum
+{
+	SIMULATED_REGION_FIRMWARE = 0,
+	SIMULATED_REGION_BACKUP,		//backupCache1 & backupCache2
+	SIMULATED_REGION_METADATA,		//Metadata pages, including the counter bitfield
+	SIMULATED_REGION_COUNT
+} SimulatedRegion;
+
+typedef struct
+{
+	uint64_t erasedPages;
+	uint64_t programCalls;
+	uint64_t programmedUnits;		//Number of WRITE_GRANULARITY writes
+} SimulatedRegionStats;
+
+typedef struct
+{
+	SimulatedRegionStats regions[SIMULATED_REGION_COUNT];
+	uint64_t decompressedBytes;
+	uint64_t savedProgramCalls;		//Program commands avoided by appending a write to a pending one
+
+	//All times are in µs
+	uint64_t eraseTime;
+	uint64_t programTime;
+	uint64_t decompressionTime;
+	uint64_t overlappedTime;		//Decompression done during background erases, and thus not adding to the total
+
+} FlashSimulatorReport;
+
+//Timing model of the simulated device. Defaults to the values of device_config.h
+typedef struct
+{
+	uint32_t eraseTime;				//µs per sector
+	uint32_t programTime;			//µs per WRITE_GRANULARITY bytes
+	uint32_t programCallTime;		//µs of setup per programFlash call, whatever its length
+	uint32_t cpuFrequency;			//MHz
+	uint32_t lzfxCyclesPerByte;		//Average cost of inflating a byte of the BSDiff stream
+	bool backgroundErase;			//Otherwise, startEraseSector blocks like eraseSector
+
+} FlashTimingModel;
+
+FlashTimingModel simulatedTimingModel();
+void setSimulatedTimingModel(const FlashTimingModel * model);
+
+//Simulated power loss: the flash operation (erase or program call) of this index, counted from now, never reaches the flash.
+//powerLoss is called instead and must not return, typically by longjmp-ing back to the harness. The cut is disarmed once it fired
+void armSimulatedPowerCut(uint64_t operation, void (*powerLoss)(void));
+void disarmSimulatedPowerCut();
+
+//Geometry Munin was compiled with for the simulation
+size_t simulatedFlashSizeBit();
+size_t simulatedBlockSizeBit();
+
+//Run Munin on a flash containing oldImage, using the manifest generated by writeBSDiff. Returns whether the final validation passed
+bool simulateUpdate(const uint8_t * oldImage, size_t oldImageLength, const uint8_t * manifest, size_t manifestLength, FlashSimulatorReport * report);
+
+//Same as simulateUpdate, but the flash operation (erase or program call) of this index never reaches the flash.
+//Returns whether the power was cut before the update completed. The flash is then left as it was, for resumeSimulatedUpdate
+bool simulateUpdateUntilPowerCut(const uint8_t * oldImage, size_t oldImageLength, const uint8_t * manifest, size_t manifestLength, uint64_t operation);
+
+//Reboot into the update on the flash the last simulation left, as Munin does after a power loss. Returns whether the final validation passed
+bool resumeSimulatedUpdate(const uint8_t * manifest, size_t manifestLength);
+
+//Content of the simulated flash after the last simulation
+const uint8_t * simulatedFlash();
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif //RAVENS_FLASH_SIMULATOR_H
@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2018 Orange
+ *
+ * This software is distributed under the terms and conditions of the 'BSD-3-Clause-Clear'
+ * license which can be found in the file 'LICENSE.txt' in this package distribution
+ * or at 'https://spdx.org/licenses/BSD-3-Clause-Clear.html'.
+ */
+
+/**
+ * Purpose: Run bootloaderPerformUpdate on the host against the simulated flash, and report how long the device would take
+ * @author Emile-Hugo Spir
+ */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../../../core.h"
+#include "../../../driver_api.h"
+#include "../../../io_management.h"
+#include "../../../../common/layout.h"
+#include "flash_simulator.h"
+
+extern uint8_t hostFlash[FLASH_SIZE];
+extern FlashSimulatorReport hostFlashReport;
+
+extern uint8_t updateMetadataMain[BLOCK_SIZE];
+extern uint8_t updateMetadataSec[BLOCK_SIZE];
+extern uint8_t backupCache1[BLOCK_SIZE];
+extern uint8_t backupCache2[BLOCK_SIZE];
+
+//Everything Munin keeps in flash, outside of the firmware region
+static uint8_t * const persistentPages[] = {updateMetadataMain, updateMetadataSec, (uint8_t *) &criticalMetadata, backupCache1, backupCache2};
+#define PERSISTENT_PAGE_COUNT (sizeof(persistentPages) / sizeof(persistentPages[0]))
+
+//State of the device once the update is downloaded, restored before every install
+typedef struct
+{
+	uint8_t flash[FLASH_SIZE];
+	uint8_t pages[PERSISTENT_PAGE_COUNT][BLOCK_SIZE];
+} DeviceSnapshot;
+
+static jmp_buf powerCutTarget;
+
+static uint8_t * loadFile(const char * path, size_t * length)
+{
+	FILE * file = fopen(path, "rb");
+	if(file == NULL)
+		return NULL;
+
+	uint8_t * output = NULL;
+	if(fseek(file, 0, SEEK_END) == 0)
+	{
+		const long fileSize = ftell(file);
+		rewind(file);
+
+		if(fileSize > 0 && (output = malloc((size_t) fileSize)) != NULL)
+		{
+			*length = (size_t) fileSize;
+			if(fread(output, 1, *length, file) != *length)
+			{
+				free(output);
+				output = NULL;
+			}
+		}
+	}
+
+	fclose(file);
+	return output;
+}
+
+//Program our device key in the critical metadata, as the factory would
+static void provisionDevice(const uint8_t * devicePublicKey)
+{
+	CriticalMetadata criticalMetadataCopy = criticalMetadata;
+	memcpy(criticalMetadataCopy.devicePublicKey, devicePublicKey, sizeof(criticalMetadataCopy.devicePublicKey));
+
+	erasePage((size_t) &criticalMetadata);
+	writeToNAND((size_t) &criticalMetadata, sizeof(criticalMetadataCopy), (const uint8_t *) &criticalMetadataCopy);
+}
+
+//Sign the manifest for the current state of the device, as Hugin authenticate and Odin would, and store the update at the end of the flash
+static size_t stageUpdate(const uint8_t * manifest, size_t manifestLength, size_t imageEnd, const uint8_t * deviceSecretKey)
+{
+	const size_t updateLength = sizeof(UpdateHeader) + manifestLength;
+	if(updateLength > FLASH_SIZE || ((FLASH_SIZE - updateLength) & BLOCK_MASK) < imageEnd)
+		return 0;
+
+	const size_t location = (FLASH_SIZE - updateLength) & BLOCK_MASK;
+	const CriticalMetadata metadata = criticalMetadata;
+
+	UpdateHeader header;
+	memset(&header, 0, sizeof(header));
+
+	header.sectionSignedDeviceKey.formatVersion = metadata.formatVersionCompatibility;
+	header.sectionSignedDeviceKey.manifestLength = (uint32_t) manifestLength;
+	header.sectionSignedDeviceKey.oldVersionID = metadata.versionID;
+	header.sectionSignedDeviceKey.versionID = metadata.versionID + 1;
+	hashMemory(manifest, manifestLength, header.sectionSignedDeviceKey.updateHash);
+
+	uint8_t updateSecretKey[hydro_sign_SECRETKEYBYTES];
+	generateKeyMemory(updateSecretKey, header.sectionSignedDeviceKey.updatePubKey);
+
+	signBuffer((const uint8_t *) &header.sectionSignedDeviceKey + SIGNATURE_LENGTH,
+			   sizeof(header.sectionSignedDeviceKey) - SIGNATURE_LENGTH,
+			   header.sectionSignedDeviceKey.signature, deviceSecretKey);
+
+	//Reply to the challenge: Challenge + old vID + vID + updateKey + random
+	const uint32_t version = header.sectionSignedDeviceKey.versionID;
+	uint8_t challenge[sizeof(metadata.updateChallenge) + 2 * sizeof(uint32_t) + PUBLIC_KEY_LENGTH + sizeof(header.sectionSignedUpdateKey.random)];
+	uint8_t * cursor = challenge;
+
+	hydro_random_buf(&header.sectionSignedUpdateKey.random, sizeof(header.sectionSignedUpdateKey.random));
+
+	memcpy(cursor, metadata.updateChallenge, sizeof(metadata.updateChallenge));
+	cursor += sizeof(metadata.updateChallenge);
+	memcpy(cursor, &header.sectionSignedDeviceKey.oldVersionID, sizeof(uint32_t));
+	cursor += sizeof(uint32_t);
+	memcpy(cursor, &version, sizeof(version));
+	cursor += sizeof(version);
+	memcpy(cursor, header.sectionSignedDeviceKey.updatePubKey, PUBLIC_KEY_LENGTH);
+	cursor += PUBLIC_KEY_LENGTH;
+	memcpy(cursor, &header.sectionSignedUpdateKey.random, sizeof(header.sectionSignedUpdateKey.random));
+
+	signBuffer(challenge, sizeof(challenge), (uint8_t *) header.sectionSignedUpdateKey.signature, updateSecretKey);
+	clearMemory(updateSecretKey, sizeof(updateSecretKey));
+
+	//The userland downloaded the update there
+	memcpy(&hostFlash[location], &header, sizeof(header));
+	memcpy(&hostFlash[location + sizeof(header)], manifest, manifestLength);
+
+	return location;
+}
+
+static void saveDevice(DeviceSnapshot * snapshot)
+{
+	memcpy(snapshot->flash, hostFlash, sizeof(snapshot->flash));
+	for(size_t i = 0; i < PERSISTENT_PAGE_COUNT; ++i)
+		memcpy(snapshot->pages[i], persistentPages[i], BLOCK_SIZE);
+}
+
+static void restoreDevice(const DeviceSnapshot * snapshot)
+{
+	memcpy(hostFlash, snapshot->flash, sizeof(hostFlash));
+	for(size_t i = 0; i < PERSISTENT_PAGE_COUNT; ++i)
+		memcpy(persistentPages[i], snapshot->pages[i], BLOCK_SIZE);
+}
+
+//What a reboot does to Munin's RAM
+static void simulateReboot()
+{
+	memset(cacheRAM, 0, sizeof(cacheRAM));
+	memset(&hostFlashReport, 0, sizeof(hostFlashReport));
+}
+
+static uint64_t flashOperations(const FlashSimulatorReport * report)
+{
+	uint64_t output = 0;
+
+	for(size_t i = 0; i < SIMULATED_REGION_COUNT; ++i)
+		output += report->regions[i].erasedPages + report->regions[i].programCalls;
+
+	return output;
+}
+
+static uint64_t installTime(const FlashSimulatorReport * report)
+{
+	return report->eraseTime + report->programTime + report->decompressionTime - report->overlappedTime;
+}
+
+static bool checkInstall(const uint8_t * newImage, size_t newLength, uint32_t expectedVersion)
+{
+	if(criticalMetadata.versionID != expectedVersion || criticalMetadata.updateInProgress != DEFAULT_64B_FLASH_VALUE)
+	{
+		fprintf(stderr, "Munin didn't complete the update\n");
+		return false;
+	}
+
+	if(memcmp(hostFlash, newImage, newLength) != 0)
+	{
+		fprintf(stderr, "Munin didn't produce the new image\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void cutPower()
+{
+	longjmp(powerCutTarget, 1);
+}
+
+//Returns whether the power was cut before the installation completed
+static bool installUntilPowerCut(uint64_t operation)
+{
+	if(setjmp(powerCutTarget) != 0)
+		return true;
+
+	armSimulatedPowerCut(operation, cutPower);
+	bootloaderPerformUpdate();
+	disarmSimulatedPowerCut();
+
+	return false;
+}
+
+static void printReport(const FlashSimulatorReport * report, size_t iterations, double hostTime)
+{
+	const SimulatedRegionStats * firmware = &report->regions[SIMULATED_REGION_FIRMWARE];
+	const SimulatedRegionStats * backup = &report->regions[SIMULATED_REGION_BACKUP];
+	const SimulatedRegionStats * metadata = &report->regions[SIMULATED_REGION_METADATA];
+
+	const uint64_t programCalls = firmware->programCalls + backup->programCalls + metadata->programCalls;
+
+	printf("Device-equivalent install time: %.2f s\n", installTime(report) / 1000000.0);
+	printf("	Erasing: %.2f s\n", report->eraseTime / 1000000.0);
+	printf("	Programming (%llu calls, %llu saved by combining the writes): %.2f s\n", (unsigned long long) programCalls, (unsigned long long) report->savedProgramCalls, report->programTime / 1000000.0);
+	printf("	Decompressing %llu bytes: %.2f s\n", (unsigned long long) report->decompressedBytes, report->decompressionTime / 1000000.0);
+	if(report->overlappedTime != 0)
+		printf("	Decompressing during the erases: -%.2f s\n", report->overlappedTime / 1000000.0);
+
+	printf("Erase count: %llu\n", (unsigned long long) (firmware->erasedPages + backup->erasedPages + metadata->erasedPages));
+	printf("	Firmware: %llu erases, %llu writes\n", (unsigned long long) firmware->erasedPages, (unsigned long long) firmware->programmedUnits);
+	printf("	Cache backup: %llu erases, %llu writes\n", (unsigned long long) backup->erasedPages, (unsigned long long) backup->programmedUnits);
+	printf("	Metadata: %llu erases, %llu writes\n", (unsigned long long) metadata->erasedPages, (unsigned long long) metadata->programmedUnits);
+
+	printf("Host time: %.3f s per install (%zu installs)\n", hostTime / iterations, iterations);
+}
+
+/*
+ * Cut the power before every Nth flash operation of the install, reboot into bootloaderPerformUpdate and check the result.
+ * The cost of the interruption is what the interrupted and resumed boots did on top of an uninterrupted install.
+ */
+
+static bool powerCutCampaign(const DeviceSnapshot * snapshot, const FlashSimulatorReport * reference, uint32_t stride, const uint8_t * newImage, size_t newLength, uint32_t expectedVersion)
+{
+	const uint64_t referenceOperations = flashOperations(reference), referenceTime = installTime(reference);
+	uint64_t interruptions = 0, failures = 0, worstCut = 0;
+	int64_t totalExtraTime = 0, worstExtraTime = 0;
+
+	printf("\nCut	Resume time (s)	Extra operations	Extra time (s)\n");
+
+	for(uint64_t cut = stride; cut < referenceOperations; cut += stride)
+	{
+		restoreDevice(snapshot);
+		simulateReboot();
+
+		if(!installUntilPowerCut(cut))
+		{
+			fprintf(stderr, "The install completed before the operation %llu\n", (unsigned long long) cut);
+			failures += 1;
+			continue;
+		}
+
+		const FlashSimulatorReport interrupted = hostFlashReport;
+
+		simulateReboot();
+		bootloaderPerformUpdate();
+
+		interruptions += 1;
+		if(!checkInstall(newImage, newLength, expectedVersion))
+		{
+			fprintf(stderr, "The install didn't recover from a power loss before the operation %llu\n", (unsigned long long) cut);
+			failures += 1;
+			continue;
+		}
+
+		const uint64_t resumeTime = installTime(&hostFlashReport);
+		const uint64_t extraOperations = flashOperations(&interrupted) + flashOperations(&hostFlashReport) - referenceOperations;
+		//The resumed boot skips the dry run, so it can end up ahead of an uninterrupted install
+		const int64_t extraTime = (int64_t) (installTime(&interrupted) + resumeTime) - (int64_t) referenceTime;
+
+		printf("%llu	%.3f	%llu	%.3f\n", (unsigned long long) cut, resumeTime / 1000000.0, (unsigned long long) extraOperations, extraTime / 1000000.0);
+
+		totalExtraTime += extraTime;
+		if(extraTime > worstExtraTime)
+		{
+			worstExtraTime = extraTime;
+			worstCut = cut;
+		}
+	}
+
+	printf("\n%llu power cuts, %llu failures\n", (unsigned long long) interruptions, (unsigned long long) failures);
+	if(interruptions != 0)
+	{
+		printf("Average time lost: %.3f s\n", totalExtraTime / (interruptions * 1000000.0));
+		printf("Worst time lost: %.3f s, when cutting before the operation %llu\n", worstExtraTime / 1000000.0, (unsigned long long) worstCut);
+	}
+
+	return failures == 0;
+}
+
+static void printHelp()
+{
+	printf("Usage: munin_host [options] oldImage newImage manifest\n");
+	printf("Install the manifest generated by Hugin diff through bootloaderPerformUpdate, on a simulated flash\n\n");
+	printf("Options:\n");
+	printf("	--eraseTime <µs>: time to erase a sector\n");
+	printf("	--programTime <µs>: time to program %u bytes\n", WRITE_GRANULARITY);
+	printf("	--programCallTime <µs>: fixed cost of a program command\n");
+	printf("	--cpuFrequency <MHz>: frequency of the device\n");
+	printf("	--lzfxCycles <cycles>: average cost of inflating a byte\n");
+	printf("	--backgroundErase <0|1>: let Munin decompress while the flash erases (default: %d)\n", SIMULATED_BACKGROUND_ERASE);
+	printf("	--iterations <count>: install the update this many times in a row (default: 1)\n");
+	printf("	--powerCut <N>: then cut the power before every Nth flash operation of the install and measure the recovery\n");
+}
+
+static bool parseNumber(const char * string, uint32_t * output)
+{
+	char * end;
+	const unsigned long value = strtoul(string, &end, 10);
+
+	if(*string == '\0' || *end != '\0' || value > UINT32_MAX)
+		return false;
+
+	*output = (uint32_t) value;
+	return true;
+}
+
+int main(int argc, char * argv[])
+{
+	FlashTimingModel timing = simulatedTimingModel();
+	uint32_t iterations = 1, powerCutStride = 0, backgroundErase = timing.backgroundErase;
+	const char * files[3];
+	size_t numberFiles = 0;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		uint32_t * option = NULL;
+
+		if(!strcmp(argv[i], "--eraseTime"))
+			option = &timing.eraseTime;
+		else if(!strcmp(argv[i], "--programTime"))
+			option = &timing.programTime;
+		else if(!strcmp(argv[i], "--programCallTime"))
+			option = &timing.programCallTime;
+		else if(!strcmp(argv[i], "--cpuFrequency"))
+			option = &timing.cpuFrequency;
+		else if(!strcmp(argv[i], "--lzfxCycles"))
+			option = &timing.lzfxCyclesPerByte;
+		else if(!strcmp(argv[i], "--backgroundErase"))
+			option = &backgroundErase;
+		else if(!strcmp(argv[i], "--iterations"))
+			option = &iterations;
+		else if(!strcmp(argv[i], "--powerCut"))
+			option = &powerCutStride;
+		else if(numberFiles < 3 && argv[i][0] != '-')
+		{
+			files[numberFiles++] = argv[i];
+			continue;
+		}
+
+		if(option == NULL || i + 1 >= argc || !parseNumber(argv[++i], option))
+		{
+			printHelp();
+			return 1;
+		}
+	}
+
+	if(numberFiles != 3 || iterations == 0 || timing.cpuFrequency == 0 || backgroundErase > 1)
+	{
+		printHelp();
+		return 1;
+	}
+
+	timing.backgroundErase = backgroundErase != 0;
+
+	setSimulatedTimingModel(&timing);
+
+	size_t oldLength, newLength, manifestLength;
+	uint8_t * oldImage = loadFile(files[0], &oldLength), * newImage = loadFile(files[1], &newLength), * manifest = loadFile(files[2], &manifestLength);
+	DeviceSnapshot * snapshot = malloc(sizeof(DeviceSnapshot));
+	int output = 1;
+
+	if(oldImage == NULL || newImage == NULL || manifest == NULL || snapshot == NULL)
+		fprintf(stderr, "Couldn't read the input files\n");
+
+	else if(oldLength > FLASH_SIZE || newLength > FLASH_SIZE || manifestLength > UINT32_MAX)
+		fprintf(stderr, "The images don't fit in the simulated flash\n");
+
+	else
+	{
+		uint8_t deviceSecretKey[hydro_sign_SECRETKEYBYTES], devicePublicKey[PUBLIC_KEY_LENGTH];
+		generateKeyMemory(deviceSecretKey, devicePublicKey);
+		provisionDevice(devicePublicKey);
+
+		memset(hostFlash, 0xff, sizeof(hostFlash));
+		memcpy(hostFlash, oldImage, oldLength);
+
+		const size_t location = stageUpdate(manifest, manifestLength, oldLength > newLength ? oldLength : newLength, deviceSecretKey);
+		clearMemory(deviceSecretKey, sizeof(deviceSecretKey));
+
+		if(location == 0)
+			fprintf(stderr, "The update doesn't fit after the images\n");
+
+		else
+		{
+			const uint32_t expectedVersion = criticalMetadata.versionID + 1;
+			FlashSimulatorReport reference;
+			double hostTime = 0;
+			bool success = true;
+
+			requestUpdate((const void *) location);
+			saveDevice(snapshot);
+
+			//Every iteration installs the update on a fresh copy of the device
+			for(uint32_t iteration = 0; iteration < iterations && success; ++iteration)
+			{
+				restoreDevice(snapshot);
+				simulateReboot();
+
+				const clock_t start = clock();
+				bootloaderPerformUpdate();
+				hostTime += (double) (clock() - start) / CLOCKS_PER_SEC;
+
+				success = checkInstall(newImage, newLength, expectedVersion);
+
+				//Only keep the report of the first install, the next ones are identical
+				if(iteration == 0)
+					reference = hostFlashReport;
+			}
+
+			if(success)
+			{
+				printReport(&reference, iterations, hostTime);
+
+				if(powerCutStride != 0)
+					success = powerCutCampaign(snapshot, &reference, powerCutStride, newImage, newLength, expectedVersion);
+			}
+
+			output = success ? 0 : 1;
+		}
+	}
+
+	free(snapshot);
+	free(oldImage);
+	free(newImage);
+	free(manifest);
+	return output;
+}
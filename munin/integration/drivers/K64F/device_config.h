@@ -29,14 +29,20 @@
 #define WRITE_GRANULARITY (1u << 3u)
 
 //Smallest supported write to NAND in bits. Default to 8 * WRITE_GRANULARITY
+//	It's also the number of bits each step of the update counter clears. Only lower it if the flash can program a word several times
 //#define MIN_BIT_WRITE_SIZE	64u
 
+//Largest program command contiguous writes are gathered into, in bytes. Default to 32 * WRITE_GRANULARITY
+//#define WRITE_COMBINING_SIZE	256u
+
 //How many bits are needed to encode the length of the flash?
 #define FLASH_SIZE_BIT	20u
 
 //How many bits are needed to encode the length of a block of NAND flash
 #define BLOCK_SIZE_BIT	12u	// 4096
 
+//Background erases (RAVENS_ASYNC_ERASE) are left disabled: the manifest may sit in the flash block being erased, which can't be read meanwhile
+
 //Update requests
 
 #define BASE_REQUEST "GET /manifest HTTP/1.1\r\nHost: " UPDATE_SERVER ":" STR(UPDATE_SERVER_PORT) "\r\nUser-Agent: " DEVICE_NAME "/"
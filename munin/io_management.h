@@ -24,6 +24,11 @@
 	#define MIN_BIT_WRITE_SIZE (8u * WRITE_GRANULARITY)
 #endif
 
+//Largest program command we gather contiguous writes into
+#ifndef WRITE_COMBINING_SIZE
+	#define WRITE_COMBINING_SIZE (32u * WRITE_GRANULARITY)
+#endif
+
 #define WRITE_GRANULARITY_MASK (WRITE_GRANULARITY - 1u)
 #define ADDRESSING_GRANULARITY_MASK (ADDRESSING_GRANULARITY - 1u)
 
@@ -33,9 +38,37 @@
 #define BLOCK_OFFSET_MASK (BLOCK_SIZE - 1)
 #define BLOCK_MASK			(~BLOCK_OFFSET_MASK)
 
+//Flash is memory mapped on the device. The host simulator backs it with a RAM buffer and has to translate the addresses
+//	It also accounts for the decompression and the write combining, which the driver doesn't see
+#ifdef RAVENS_HOST_SIMULATION
+	const uint8_t * hostFlashPointer(size_t address);
+	void hostAccountDecompression(size_t length);
+	void hostAccountSavedPrograms(size_t count);
+	#define FLASH_READ_POINTER(address) hostFlashPointer((size_t) (address))
+	#define ACCOUNT_DECOMPRESSION(length) hostAccountDecompression(length)
+	#define ACCOUNT_SAVED_PROGRAMS(count) hostAccountSavedPrograms(count)
+#else
+	#define FLASH_READ_POINTER(address) ((const uint8_t *) (uintptr_t) (address))
+	#define ACCOUNT_DECOMPRESSION(length)
+	#define ACCOUNT_SAVED_PROGRAMS(count)
+#endif
+
 extern uint8_t cacheRAM[BLOCK_SIZE];
 
 bool writeToNAND(size_t address, size_t length, const uint8_t * source);
+
+//Write combining. The data may stay in RAM until flushWriteBuffer, so the flash must be read through readThroughWriteBuffer
+void bufferedWriteToNAND(size_t address, size_t length, const uint8_t * source);
+void flushWriteBuffer();
+void discardWriteBuffer();
+bool writeBufferOverlaps(size_t address, size_t length);
+void readThroughWriteBuffer(uint8_t * output, size_t source, size_t length);
 void erasePage(size_t address);
 
+//Erase while the CPU does something else, polling erasePending. Blocking drivers erase straight away
+//	waitForErase must be called before the flash is erased or programmed again
+void startErasePage(size_t address);
+bool erasePending();
+void waitForErase();
+
 #endif //RAVENS_IO_MANAGEMENT_H